@@ -4,26 +4,61 @@
 #include <stdint.h>
 #include <string.h>
 
+/*
+ * Count the number of bits set in a byte.
+ */
+static inline uint8_t popcount8(uint8_t v) {
+    v = v - ((v >> 1) & 0x55);
+    v = (v & 0x33) + ((v >> 2) & 0x33);
+    return (v + (v >> 4)) & 0x0f;
+}
+
+/*
+ * IndexTypeFor<MAX>::Type is the smallest unsigned type that can hold MAX.
+ *
+ * 8-bit arithmetic is much cheaper than 16-bit on AVR, so code that is
+ * templated on a size should use this for its index type rather than always
+ * using uint16_t.
+ */
+template<bool FITS_8BITS>
+struct IndexTypeSelect {
+    typedef uint8_t Type;
+};
+template<>
+struct IndexTypeSelect<false> {
+    typedef uint16_t Type;
+};
+template<uint16_t MAX>
+struct IndexTypeFor {
+    typedef typename IndexTypeSelect<(MAX <= 0xff)>::Type Type;
+};
+
 /*
  * A fixed-size bitmap.
+ *
+ * Bitmaps of up to 256 bits use 8-bit indices; larger ones use 16-bit
+ * indices.
  */
-template<uint8_t SIZE>
+template<uint16_t SIZE,
+         typename IndexT = typename IndexTypeFor<SIZE - 1>::Type>
 struct Bitmap {
-    bool operator[](uint8_t idx) const {
+    typedef IndexT Index;
+
+    bool operator[](Index idx) const {
         return get(idx);
     }
 
-    bool get(uint8_t idx) const {
+    bool get(Index idx) const {
         return bytes[idx >> 3] & (1 << (idx & 0x7));
     }
 
-    void set(uint8_t idx) {
+    void set(Index idx) {
         bytes[idx >> 3] |= (1 << (idx & 0x7));
     }
-    void unset(uint8_t idx) {
+    void unset(Index idx) {
         bytes[idx >> 3] &= ~(1 << (idx & 0x7));
     }
-    void set(uint8_t idx, bool value) {
+    void set(Index idx, bool value) {
         if (value) {
             set(idx);
         } else {
@@ -31,6 +66,25 @@ struct Bitmap {
         }
     }
 
+    bool any() const {
+        const uint8_t end = NUM_BYTES;
+        for (uint8_t n = 0; n < end; ++n) {
+            if (bytes[n]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    typename IndexTypeFor<SIZE>::Type count() const {
+        typename IndexTypeFor<SIZE>::Type total = 0;
+        const uint8_t end = NUM_BYTES;
+        for (uint8_t n = 0; n < end; ++n) {
+            total += popcount8(bytes[n]);
+        }
+        return total;
+    }
+
     void clear() {
         const uint8_t end = NUM_BYTES;
         for (uint8_t n = 0; n < end; ++n) {
@@ -46,5 +100,9 @@ struct Bitmap {
     }
 
     enum { NUM_BYTES = (SIZE >> 3) + ((SIZE & 0x7) ? 1 : 0)};
+    static_assert(SIZE > 0, "empty bitmap");
+    static_assert(NUM_BYTES <= 0xff, "bitmap too large");
+    static_assert(static_cast<Index>(SIZE - 1) == SIZE - 1,
+                  "index type too small for bitmap size");
     uint8_t bytes[NUM_BYTES]{0};
 };
@@ -3,6 +3,8 @@
 
 #include <avrpp/atomic.h>
 #include <avrpp/log.h>
+#include <avrpp/system_time.h>
+#include <avrpp/task_scheduler.h>
 #include <avrpp/usb.h>
 #include <avrpp/usb_descriptors.h>
 #include <avrpp/usb_hid.h>
@@ -21,13 +23,16 @@ DebugIface::DebugIface(uint8_t iface, uint8_t endpoint,
                        uint16_t buf_len, uint8_t report_len)
     : UsbInterface(iface),
       _endpoint(endpoint, report_len),
-      _buflen(buf_len) {
+      _buflen(buf_len),
+      _flushTask(this) {
     if (buf_len > 0) {
         _buffer = static_cast<uint8_t*>(malloc(buf_len));
     }
+    TaskScheduler::singleton()->addEvent(&_flushTask);
 }
 
 DebugIface::~DebugIface() {
+    TaskScheduler::singleton()->remove(&_flushTask);
     free(_buffer);
 }
 
@@ -142,20 +147,41 @@ DebugIface::_tryUsbWrite(uint8_t c) {
     if (!isset(ueintx_bits, UEINTXFlags::RW_ALLOWED)) {
         // Clear the FIFOCON bit
         set_UEINTX(ueintx_bits & ~UEINTXFlags::FIFO_CONTROL);
-        _flushTimer = 0;
-    } else if (_flushTimer == 0) {
-        _flushTimer = DBG_FLUSH_TIMEOUT_MS;
+        _flushPending = false;
+    } else if (!_flushPending) {
+        _flushPending = true;
+        _flushDeadline = static_cast<uint16_t>(
+            SystemTime::singleton()->millis()) + DBG_FLUSH_TIMEOUT_MS;
     }
     return true;
 }
 
 bool
 DebugIface::addEndpoints(UsbController* usb) {
+    // Partial packets are flushed on a deadline kept with the SystemTime
+    // clock, so make sure it is running whoever set up USB.  This does
+    // nothing if it already is.
+    SystemTime::singleton()->start();
     return usb->addEndpoint(&_endpoint);
 }
 
 void
 DebugIface::startOfFrame() {
+    // Leave the copying to the main loop, rather than doing it in the USB
+    // interrupt.
+    TaskScheduler::singleton()->post(&_flushTask);
+}
+
+/*
+ * Move buffered log data into the endpoint bank, and send any partial packet
+ * that has waited too long.
+ *
+ * This runs as a task, posted on each start-of-frame.
+ */
+void
+DebugIface::flush() {
+    // The USB interrupt and putchar() both use UENUM and the buffer.
+    AtomicGuard ag;
     UENUM = _endpoint.getNumber();
 
     // If we have any data pending in the write buffer,
@@ -176,9 +202,10 @@ DebugIface::startOfFrame() {
 
     // If we have a partial packet pending, flush it now if it has been pending
     // for more than DBG_FLUSH_TIMEOUT milliseconds.
-    if (_flushTimer != 0) {
-        --_flushTimer;
-        if (_flushTimer == 0) {
+    if (_flushPending) {
+        const uint16_t now = SystemTime::singleton()->millis();
+        if (static_cast<int16_t>(now - _flushDeadline) >= 0) {
+            _flushPending = false;
             // PJRC's hid_listen program on Windows doesn't seem to behave
             // well if we don't always send full packets.  (On the other hand,
             // Linux is fine with partial packets.)
@@ -1,6 +1,7 @@
 // Copyright (c) 2013, Adam Simpkins
 #pragma once
 
+#include <avrpp/task_scheduler.h>
 #include <avrpp/usb.h>
 #include <stdint.h>
 
@@ -37,14 +38,19 @@ class DebugIface : public UsbInterface {
      */
     DebugIface(uint8_t iface, uint8_t endpoint,
                uint16_t buf_len=256, uint8_t report_len=32);
-    virtual ~DebugIface();
+    ~DebugIface();
 
     static bool putcharC(uint8_t c, void *arg);
     bool putchar(uint8_t c);
 
-    virtual bool addEndpoints(UsbController* usb) override;
-    virtual bool handleSetupPacket(const SetupPacket *pkt) override;
-    virtual void startOfFrame() override;
+    bool addEndpoints(UsbController* usb);
+    bool handleSetupPacket(const SetupPacket *pkt);
+    /*
+     * Called from the USB interrupt on each start-of-frame.  This posts a
+     * TaskScheduler task to send the buffered log data, so log output only
+     * flows while the main loop is running tasks.
+     */
+    void startOfFrame();
 
     bool isPaused() const {
         return _paused;
@@ -57,6 +63,20 @@ class DebugIface : public UsbInterface {
     }
 
   private:
+    class FlushTask : public Task {
+      public:
+        explicit FlushTask(DebugIface *iface)
+            : Task("log_flush"), _iface(iface) {}
+
+        virtual void run() override {
+            _iface->flush();
+        }
+
+      private:
+        DebugIface *_iface;
+    };
+
+    void flush();
     bool _handleSetReport(const SetupPacket *pkt);
     bool _writeToBuffer(uint8_t c);
     bool _tryImmediateWrite(uint8_t c);
@@ -65,12 +85,14 @@ class DebugIface : public UsbInterface {
 
     DebugEndpoint _endpoint;
 
-    // flush_timer is set to 0 when there is no data outstanding waiting to be
-    // flushed.  When we receive the first byte in a new packet, flush_timer
-    // will be set to DBG_FLUSH_TIMEOUT_MS.  It will be decremented on every
-    // SOF packet.  If it reaches 0 before we receive a full packet worth of
-    // log data then the partial data that we have will be sent.
-    uint8_t _flushTimer{0};
+    // _flushPending is false when there is no data outstanding waiting to be
+    // flushed.  When we receive the first byte in a new packet, it is set,
+    // and _flushDeadline is set to DBG_FLUSH_TIMEOUT_MS from now, in the low
+    // 16 bits of SystemTime::millis().  If the deadline passes before we
+    // receive a full packet worth of log data then the partial data that we
+    // have will be sent by the flush task after the next SOF.
+    bool _flushPending{false};
+    uint16_t _flushDeadline{0};
 
     // A buffer to store log data when we cannot write it immediately to the
     // USB endpoint bank.  This allows log_msg() to work even when USB is not
@@ -81,4 +103,6 @@ class DebugIface : public UsbInterface {
     bool _paused{false};
     uint16_t _buflen{0};
     uint8_t *_buffer{nullptr};
+
+    FlushTask _flushTask;
 };
@@ -4,8 +4,11 @@
 #include <avrpp/i2c.h>
 #include <avrpp/i2c-defs.h>
 #include <avrpp/log.h>
+#include <avrpp/system_time.h>
+#include <avrpp/task_scheduler.h>
 #include <avrpp/usb.h>
 #include <avrpp/usb_descriptors.h>
+#include <avrpp/usb_iface_list.h>
 #include <avrpp/util.h>
 
 #include <avrpp/eeprom_ctl/usb_config.h>
@@ -196,6 +199,26 @@ void run_eeprom() {
     run_eeprom_read(&bus);
 }
 
+class EepromTask : public Task {
+  public:
+    EepromTask() : Task("eeprom") {}
+
+    virtual void run() override {
+        FLOG(1, "EEPROM controller initialized\n");
+        run_eeprom();
+        FLOG(1, "EEPROM logic complete\n");
+    }
+};
+
+class BlinkTask : public Task {
+  public:
+    BlinkTask() : Task("blink") {}
+
+    virtual void run() override {
+        PORTD ^= 0x40;
+    }
+};
+
 int main() {
     // Set the clock speed as the first thing we do
     set_cpu_prescale();
@@ -236,23 +259,23 @@ int main() {
 
     // Initialize USB
     auto usb = UsbController::singleton();
-    usb->addInterface(&dbg_if);
+    UsbInterfaceList<DebugIface> interfaces;
+    interfaces.set(&dbg_if);
+    usb->setInterfaceTable(&interfaces);
     usb->init(ENDPOINT0_SIZE, pgm_cast(usb_descriptors));
+    SystemTime::singleton()->start();
+    auto tasks = TaskScheduler::singleton();
     // Enable interrupts
     sei();
     // Wait for USB configuration with the host to complete
     while (!usb->configured()) {
-        // wait
+        tasks->runOnce();
     }
 
-    // Do our stuff
-    FLOG(1, "EEPROM controller initialized\n");
-    run_eeprom();
-    FLOG(1, "EEPROM logic complete\n");
-
-    while (true) {
-        // Blink the LED
-        PORTD ^= 0x40;
-        _delay_ms(200);
-    }
+    // Do our stuff, then blink the LED
+    EepromTask eeprom_task;
+    BlinkTask blink_task;
+    tasks->addOneShot(&eeprom_task, 0);
+    tasks->addPeriodic(&blink_task, 200);
+    tasks->run();
 }
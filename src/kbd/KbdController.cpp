@@ -1,106 +1,235 @@
 // Copyright (c) 2013, Adam Simpkins
 #include <avrpp/kbd/KbdController.h>
 
+#include <avrpp/atomic.h>
 #include <avrpp/avr_registers.h>
 #include <avrpp/dbg_endpoint.h>
 #include <avrpp/log.h>
+#include <avrpp/system_time.h>
+#include <avrpp/task_scheduler.h>
 
+#include <avr/interrupt.h>
 #include <avr/sleep.h>
-#include <util/delay.h>
+#include <avr/wdt.h>
+#include <string.h>
 
 F_LOG_LEVEL(2);
 
-KbdController::KbdController(Keyboard *kbd, LedController *leds,
-                             uint8_t iface_number, uint8_t endpoint_number)
-    : _kbd(kbd),
-      _leds(leds),
-      _kbdIface(iface_number, endpoint_number) {
+KbdControllerBase::KbdControllerBase(uint8_t iface_number,
+                                     uint8_t endpoint_number)
+    : _kbdIface(iface_number, endpoint_number) {
 }
 
-KbdController::~KbdController() {
+KbdControllerBase::~KbdControllerBase() {
     delete _dbgIface;
 }
 
-void KbdController::cfgDebugIface(uint8_t iface_number,
-                                  uint8_t endpoint_number,
-                                  uint16_t buf_len,
-                                  uint8_t report_len) {
+void KbdControllerBase::cfgDebugIface(uint8_t iface_number,
+                                      uint8_t endpoint_number,
+                                      uint16_t buf_len,
+                                      uint8_t report_len) {
     if (_dbgIface) {
         return;
     }
     _dbgIface = new DebugIface(iface_number, endpoint_number,
                                buf_len, report_len);
     set_log_putchar(DebugIface::putcharC, _dbgIface);
-    UsbController::singleton()->addInterface(_dbgIface);
 }
 
-void KbdController::init(uint8_t endpoint0_size,
-                         pgm_ptr<UsbDescriptor> descriptors) {
+void KbdControllerBase::init(uint8_t endpoint0_size,
+                             pgm_ptr<UsbDescriptor> descriptors) {
     FLOG(2, "Keyboard booting\n");
 
-    // TODO: Apply other power saving settings as recommended by
-    // the at90usb1286 manual.
-    // The HalfKay bootloader does seem to leave some features enabled that
-    // consume power.  We draw a couple mA more when started via a HalfKay
-    // reset than we do when restarted from a plain power on.
+    // Power down the peripherals we don't use.  The HalfKay bootloader
+    // leaves some of these enabled, and we draw a couple mA more when
+    // started via a HalfKay reset than from a plain power on.
     //
-    // PRR0 and PRR1 control some power reduction settings.
+    // Timer 1 drives the ScanScheduler, timer 3 the SystemTime, and USB
+    // obviously has to stay on.  The ADC has to be disabled before it is
+    // powered down, or it stays active.
+    ADCSRA = 0;
+    ACSR = (1 << ACD);
+    PRR0 = (1 << PRTWI) | (1 << PRTIM2) | (1 << PRTIM0) |
+           (1 << PRSPI) | (1 << PRADC);
+    PRR1 = (1 << PRUSART1);
 
     // Initialize USB
     auto usb = UsbController::singleton();
     usb->setStateCallback(this);
     _kbdIface.setLedCallback(this);
-    usb->addInterface(&_kbdIface);
+    _interfaces.set(&_kbdIface, _dbgIface);
+    usb->setInterfaceTable(&_interfaces);
     usb->init(endpoint0_size, descriptors);
+    SystemTime::singleton()->start();
     // Enable interrupts
     sei();
     // Wait for USB configuration with the host to complete
     waitForUsbInit(usb);
 }
 
-void KbdController::loop() {
-    _kbd->loop(this);
-}
-
-void KbdController::waitForUsbInit(UsbController *usb) {
+void KbdControllerBase::waitForUsbInit(UsbController *usb) {
+    // Configuration happens in the USB interrupt.  Each runOnce() call
+    // sleeps until the next interrupt, which is at most 1ms away.
+    auto tasks = TaskScheduler::singleton();
     while (!usb->configured()) {
-        _delay_ms(1);
+        tasks->runOnce();
     }
 }
 
-void KbdController::onConfigured() {
-    _leds->clearErrorLED();
-}
-
-void KbdController::onUnconfigured() {
-    _leds->setErrorLED();
-}
-
-void KbdController::onSuspend() {
-    auto led_state = _leds->suspendLEDs();
+void KbdControllerBase::suspend(Keyboard *kbd) {
+    auto usb = UsbController::singleton();
     set_sleep_mode(SLEEP_MODE_PWR_DOWN);
     AtomicGuard ag;
-    if (UsbController::singleton()->suspended()) {
+    ++_suspends;
+
+    // If the host lets us wake it, use the watchdog to wake up and check
+    // the matrix every 16ms.  Everything else stays powered down in between.
+    const bool can_wake =
+        usb->remoteWakeupEnabled() && kbd->prepareSuspendScan();
+    if (can_wake) {
+        wdt_reset();
+        WDTCSR = (1 << WDCE) | (1 << WDE);
+        WDTCSR = (1 << WDIE) | WDTO_15MS;
+    }
+
+    // The USB WAKE_UP interrupt runs nested in here, and clears the
+    // suspended state when the host resumes the bus.
+    while (usb->suspended()) {
         sleep_enable();
         sei();
         sleep_cpu();
         sleep_disable();
+        cli();
+
+        if (can_wake) {
+            ++_suspendPolls;
+            if (kbd->checkSuspendScan()) {
+                ScanScheduler::singleton()->setSlowClock(false);
+                if (usb->sendRemoteWakeup()) {
+                    ++_remoteWakeups;
+                }
+                break;
+            }
+        }
+    }
+
+    if (can_wake) {
+        wdt_disable();
     }
-    _leds->restoreLEDs(led_state);
 }
 
-void KbdController::onWake() {
+void KbdControllerBase::onStartOfFrame() {
+    // Keep the scans lined up with the frames the host polls on.
+    ScanScheduler::singleton()->startOfFrame();
+
+    // Reveal the next staged key once the previous report has gone out.
+    if (_numStaged == 0) {
+        return;
+    }
+    if (_stagedFrames < 0xff) {
+        ++_stagedFrames;
+    }
+    if (_kbdIface.updatePending()) {
+        return;
+    }
+    --_numStaged;
+    memmove(_staged, _staged + 1, _numStaged * sizeof(StagedKey));
+    ++_stagedReports;
+    if (_numStaged == 0 && _stagedFrames > _maxStagedFrames) {
+        _maxStagedFrames = _stagedFrames;
+    }
+    sendReport();
 }
 
-void KbdController::updateLeds(uint8_t led_value) {
-    _leds->setKeyboardLEDs(led_value);
+void KbdControllerBase::updateState(uint8_t modifiers, const uint8_t *keys,
+                                    const Keyboard::KeyEvent *events,
+                                    uint8_t num_events) {
+    AtomicGuard ag;
+    memcpy(_keys, keys, sizeof(_keys));
+    _modifiers = modifiers;
+    if (num_events == Keyboard::EVENTS_UNAVAILABLE) {
+        // The order of the changes isn't known, so report everything now.
+        _numStaged = 0;
+        sendReport();
+        return;
+    }
+
+    // Keys still staged from an earlier scan stay staged unless they have
+    // been released.
+    for (uint8_t n = 0; n < num_events; ++n) {
+        const auto &ev = events[n];
+        if (ev.pressed) {
+            continue;
+        }
+        for (uint8_t idx = 0; idx < _numStaged; ++idx) {
+            if (_staged[idx].col == ev.col && _staged[idx].row == ev.row) {
+                --_numStaged;
+                memmove(_staged + idx, _staged + idx + 1,
+                        (_numStaged - idx) * sizeof(StagedKey));
+                break;
+            }
+        }
+    }
+
+    // Every new press after the first waits for its own report, as do all
+    // of them if earlier keys are still waiting.
+    bool reveal_first = (_numStaged == 0);
+    for (uint8_t n = 0; n < num_events; ++n) {
+        const auto &ev = events[n];
+        if (!ev.pressed) {
+            continue;
+        }
+        if (reveal_first) {
+            reveal_first = false;
+            _stagedFrames = 0;
+            continue;
+        }
+        if (_numStaged < MAX_STAGED) {
+            _staged[_numStaged].col = ev.col;
+            _staged[_numStaged].row = ev.row;
+            _staged[_numStaged].code = ev.code;
+            _staged[_numStaged].modifier = ev.modifier;
+            ++_numStaged;
+        }
+    }
+    sendReport();
 }
 
-void KbdController::onChange(Keyboard* kbd) {
-    uint8_t keys_len = KeyboardIface::MAX_KEYS;
-    uint8_t pressed_keys[KeyboardIface::MAX_KEYS]{0};
-    uint8_t modifier_mask{0};
+/*
+ * Send the latest state to the host, minus any keys still staged.
+ *
+ * This must be called with interrupts disabled.
+ */
+void KbdControllerBase::sendReport() {
+    uint8_t keys[KeyboardIface::MAX_KEYS];
+    memcpy(keys, _keys, sizeof(keys));
+    uint8_t hidden_mods = 0;
+    for (uint8_t idx = 0; idx < _numStaged; ++idx) {
+        hidden_mods |= _staged[idx].modifier;
+        // Newer presses are listed later, so hide the last match.
+        for (uint8_t n = KeyboardIface::MAX_KEYS; n > 0; --n) {
+            if (keys[n - 1] == _staged[idx].code) {
+                memmove(keys + n - 1, keys + n,
+                        KeyboardIface::MAX_KEYS - n);
+                keys[KeyboardIface::MAX_KEYS - 1] = 0;
+                break;
+            }
+        }
+    }
+    // Modifiers the host already has must stay set, even if a staged key
+    // shares them.
+    const uint8_t modifiers = _modifiers & ~(hidden_mods & ~_sentModifiers);
+    _kbdIface.update(keys, modifiers);
+    _sentModifiers = modifiers;
+}
 
-    kbd->getState(&modifier_mask, pressed_keys, &keys_len);
-    _kbdIface.update(pressed_keys, modifier_mask);
+void KbdControllerBase::logStats() const {
+    FLOG(2, "report stats: staged=%u max_staged_frames=%u\n",
+         _stagedReports, _maxStagedFrames);
+    FLOG(2, "suspend stats: suspends=%u polls=%lu remote_wakeups=%u\n",
+         _suspends, _suspendPolls, _remoteWakeups);
 }
+
+// The watchdog only wakes us from power-down while suspended;
+// suspend() does all of the work.
+EMPTY_INTERRUPT(WDT_vect);
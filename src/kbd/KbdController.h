@@ -1,37 +1,42 @@
 // Copyright (c) 2013, Adam Simpkins
 #pragma once
 
+#include <avrpp/dbg_endpoint.h>
 #include <avrpp/kbd_endpoint.h>
 #include <avrpp/kbd/Keyboard.h>
+#include <avrpp/task_scheduler.h>
 #include <avrpp/usb.h>
+#include <avrpp/usb_iface_list.h>
 
-class DebugIface;
-
-class KbdController : private Keyboard::Callback,
-                      private KeyboardIface::LedCallback,
-                      private UsbController::StateCallback {
+class KbdLedController {
   public:
-    class LedController {
-      public:
-        virtual ~LedController() {}
-
-        virtual void setPowerLED() = 0;
-        virtual void clearPowerLED() = 0;
-        virtual void setErrorLED() = 0;
-        virtual void clearErrorLED() = 0;
-        virtual void setKeyboardLEDs(uint8_t led_value) = 0;
-        /*
-         * Turn off all LEDs for entering suspend mode.
-         * Returns the current LED state.  This can be restored after suspending
-         * by calling restoreLEDs().
-         */
-        virtual uint8_t suspendLEDs() = 0;
-        virtual void restoreLEDs(uint8_t value) = 0;
-    };
+    virtual ~KbdLedController() {}
+
+    virtual void setPowerLED() = 0;
+    virtual void clearPowerLED() = 0;
+    virtual void setErrorLED() = 0;
+    virtual void clearErrorLED() = 0;
+    virtual void setKeyboardLEDs(uint8_t led_value) = 0;
+    /*
+     * Turn off all LEDs for entering suspend mode.
+     * Returns the current LED state.  This can be restored after suspending
+     * by calling restoreLEDs().
+     */
+    virtual uint8_t suspendLEDs() = 0;
+    virtual void restoreLEDs(uint8_t value) = 0;
+};
 
-    KbdController(Keyboard *kbd, LedController *leds,
-                  uint8_t iface_number, uint8_t endpoint_number);
-    virtual ~KbdController();
+/*
+ * The parts of the keyboard controller that don't depend on the keyboard
+ * and LED types: USB setup, staged reporting, and the suspend loop.
+ *
+ * Use it through KbdControllerT, below.
+ */
+class KbdControllerBase : protected Keyboard::Callback,
+                          protected KeyboardIface::LedCallback,
+                          protected UsbController::StateCallback {
+  public:
+    virtual ~KbdControllerBase();
 
     /*
      * Configure the debug interface.
@@ -41,27 +46,160 @@ class KbdController : private Keyboard::Callback,
     void cfgDebugIface(uint8_t iface_number, uint8_t endpoint_number,
                        uint16_t buf_len, uint8_t report_len);
     void init(uint8_t endpoint0_size, pgm_ptr<UsbDescriptor> descriptors);
-    void loop();
+
+  protected:
+    KbdControllerBase(uint8_t iface_number, uint8_t endpoint_number);
+
+    /*
+     * Run the USB suspend loop, polling kbd for a key press to wake the
+     * host if it allows that.  This returns once the suspend is over.
+     */
+    void suspend(Keyboard *kbd);
+    /*
+     * Hand a new keyboard state and its events, as returned by
+     * Keyboard::getState() and Keyboard::getEvents(), to the host.
+     */
+    void updateState(uint8_t modifiers, const uint8_t *keys,
+                     const Keyboard::KeyEvent *events, uint8_t num_events);
 
   private:
     // Forbidden copy constructor and assignment operator
-    KbdController(KbdController const &) = delete;
-    KbdController& operator=(KbdController const &) = delete;
+    KbdControllerBase(KbdControllerBase const &) = delete;
+    KbdControllerBase& operator=(KbdControllerBase const &) = delete;
 
     void waitForUsbInit(UsbController *usb);
 
-    // USB state changes
-    virtual void onConfigured() override;
-    virtual void onUnconfigured() override;
-    virtual void onSuspend() override;
-    virtual void onWake() override;
-
-    virtual void updateLeds(uint8_t led_value);
+    virtual void onStartOfFrame() override;
+    virtual void logStats() const override;
+    void sendReport();
 
-    virtual void onChange(Keyboard* kbd) override;
+    enum : uint8_t {
+        MAX_STAGED = Keyboard::MAX_EVENTS,
+    };
+    // A newly pressed key that hasn't been reported to the host yet.  The
+    // matrix position identifies it when it is released, since several keys
+    // may share a code or a modifier.
+    struct StagedKey {
+        uint8_t col;
+        uint8_t row;
+        uint8_t code;
+        uint8_t modifier;
+    };
 
-    Keyboard *_kbd{nullptr};
-    LedController *_leds;
     KeyboardIface _kbdIface;
     DebugIface *_dbgIface{nullptr};
+    UsbInterfaceList<KeyboardIface, DebugIface> _interfaces;
+
+    // Staged reporting.
+    // When several keys are pressed in one scan, they are revealed to the
+    // host one per report, in the order they were sampled, so that fast
+    // rolls aren't transposed.  _keys and _modifiers hold the latest state
+    // from the keyboard, and _staged the presses in it still hidden from
+    // the host, oldest first.  These are shared with the SOF interrupt.
+    uint8_t _keys[KeyboardIface::MAX_KEYS]{0};
+    uint8_t _modifiers{0};
+    uint8_t _sentModifiers{0};
+    StagedKey _staged[MAX_STAGED];
+    uint8_t _numStaged{0};
+    // Frames since the current batch of staged keys started.
+    uint8_t _stagedFrames{0};
+    // The number of reports delayed by staging, and the largest number of
+    // frames the last key of a batch was held back.  Each staged key waits
+    // for the host to poll for the report before it, so with kbd_v2's 10ms
+    // endpoint interval this is about 10ms per key pressed in the same scan.
+    uint16_t _stagedReports{0};
+    uint8_t _maxStagedFrames{0};
+
+    // Suspend statistics: the number of times USB was suspended, the number
+    // of times the matrix was polled while suspended, and the number of
+    // suspends we ended ourselves with a remote wakeup.
+    uint16_t _suspends{0};
+    uint32_t _suspendPolls{0};
+    uint16_t _remoteWakeups{0};
 };
+
+/*
+ * A keyboard controller for a given keyboard and LED controller type.
+ *
+ * KbdController works with any Keyboard and KbdLedController.  A firmware
+ * that knows its keyboard and LED classes at compile time can use them
+ * directly instead: if KbdT is a final class, the scan loop's calls into
+ * the keyboard are resolved statically, and LedsT need not derive from
+ * KbdLedController at all.
+ */
+template<typename KbdT, typename LedsT>
+class KbdControllerT final : public KbdControllerBase {
+  public:
+    typedef LedsT LedController;
+
+    KbdControllerT(KbdT *kbd, LedsT *leds,
+                   uint8_t iface_number, uint8_t endpoint_number)
+        : KbdControllerBase(iface_number, endpoint_number),
+          _kbd(kbd),
+          _leds(leds),
+          _ledTask(this) {
+        TaskScheduler::singleton()->addEvent(&_ledTask);
+    }
+    ~KbdControllerT() {
+        TaskScheduler::singleton()->remove(&_ledTask);
+    }
+
+    void loop() __attribute__((noreturn)) {
+        KeyboardScanTask<KbdT, KbdControllerT> scan_task(_kbd, this);
+        _kbd->runScanTasks(&scan_task, this);
+    }
+
+  private:
+    friend class KeyboardScanTask<KbdT, KbdControllerT>;
+
+    class LedTask : public Task {
+      public:
+        explicit LedTask(KbdControllerT *ctl) : Task("leds"), _ctl(ctl) {}
+
+        virtual void run() override {
+            _ctl->_leds->setKeyboardLEDs(_ctl->_ledValue);
+        }
+
+      private:
+        KbdControllerT *_ctl;
+    };
+
+    // USB state changes
+    virtual void onConfigured() override {
+        _leds->clearErrorLED();
+    }
+    virtual void onUnconfigured() override {
+        _leds->setErrorLED();
+    }
+    virtual void onSuspend() override {
+        auto led_state = _leds->suspendLEDs();
+        suspend(_kbd);
+        _leds->restoreLEDs(led_state);
+    }
+
+    virtual void updateLeds(uint8_t led_value) override {
+        // This is called from the USB interrupt.  Only record the new value
+        // here, and leave the LED controller to the main loop.
+        _ledValue = led_value;
+        TaskScheduler::singleton()->post(&_ledTask);
+    }
+
+    virtual void onChange(Keyboard*) override {
+        uint8_t keys_len = KeyboardIface::MAX_KEYS;
+        uint8_t pressed_keys[KeyboardIface::MAX_KEYS]{0};
+        uint8_t modifier_mask{0};
+
+        _kbd->getState(&modifier_mask, pressed_keys, &keys_len);
+        const Keyboard::KeyEvent *events;
+        const uint8_t num_events = _kbd->getEvents(&events);
+        updateState(modifier_mask, pressed_keys, events, num_events);
+    }
+
+    KbdT *_kbd;
+    LedsT *_leds;
+    // The most recent LED state from the host, applied by _ledTask.
+    volatile uint8_t _ledValue{0};
+    LedTask _ledTask;
+};
+
+typedef KbdControllerT<Keyboard, KbdLedController> KbdController;
@@ -3,69 +3,689 @@
 
 #include <avrpp/kbd/KbdDiodeImpl.h>
 
+#include <avrpp/atomic.h>
+#include <avrpp/system_time.h>
+#include <avrpp/util.h>
+
+#include <util/delay_basic.h>
+
+// The settle time used for lines that have not been calibrated,
+// or that fail to settle during calibration: 5us worth of _delay_loop_1()
+// iterations.
+#define KBD_DEFAULT_SETTLE_LOOPS (((F_CPU / 1000000) * 5 + 2) / 3)
+static_assert(KBD_DEFAULT_SETTLE_LOOPS < 256,
+              "default settle time does not fit in _delay_loop_1()");
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+KbdDiodeImpl<NC, NR, ImplT>::KbdDiodeImpl() {
+    static_assert(ImplT::Diodes::template fits<NC, NR>(),
+                  "diode outside of the key matrix");
+
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        _colSettle[col] = KBD_DEFAULT_SETTLE_LOOPS;
+    }
+    for (uint8_t row = 0; row < NUM_ROWS; ++row) {
+        _rowSettle[row] = KBD_DEFAULT_SETTLE_LOOPS;
+    }
+    _maxColSettle = KBD_DEFAULT_SETTLE_LOOPS;
+    _maxRowSettle = KBD_DEFAULT_SETTLE_LOOPS;
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        _colHeat[col] = 0;
+    }
+    for (uint8_t cls = 0; cls < NUM_DEBOUNCE_CLASSES; ++cls) {
+        setDebounce(cls, DEFAULT_PRESS_SCANS, DEFAULT_RELEASE_SCANS);
+    }
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::setDebounce(uint8_t keyClass,
+                                         uint8_t pressScans,
+                                         uint8_t releaseScans) {
+    if (keyClass >= NUM_DEBOUNCE_CLASSES) {
+        return;
+    }
+    auto clamp = [](uint8_t scans) -> uint8_t {
+        return scans < 1 ? 1 :
+            (scans > MAX_DEBOUNCE_SCANS ?
+             static_cast<uint8_t>(MAX_DEBOUNCE_SCANS) : scans);
+    };
+    _pressScans[keyClass] = clamp(pressScans);
+    _releaseScans[keyClass] = clamp(releaseScans);
+
+    // Spread each threshold bit over a whole byte, so debounce() can compare
+    // 8 counters against their thresholds at once.
+    for (uint8_t k = 0; k < DEBOUNCE_BITS; ++k) {
+        auto plane = [k](uint8_t scans) -> uint8_t {
+            return (scans & (1 << k)) ? 0xff : 0x00;
+        };
+        DebouncePlane *p = &_debouncePlanes[k];
+        p->press = plane(_pressScans[DEBOUNCE_NORMAL]);
+        p->pressSlow = p->press ^ plane(_pressScans[DEBOUNCE_SLOW]);
+        p->release = plane(_releaseScans[DEBOUNCE_NORMAL]);
+        p->releaseSlow = p->release ^ plane(_releaseScans[DEBOUNCE_SLOW]);
+    }
+}
+
+/*
+ * The pressed keys and modifiers are kept up to date by each scan, so this
+ * only needs to copy them out.  Keys are listed in the order they were
+ * pressed.
+ */
 template<uint8_t NC, uint8_t NR, typename ImplT>
 void
 KbdDiodeImpl<NC, NR, ImplT>::getState(uint8_t *modifiers,
                                       uint8_t *keys,
                                       uint8_t *keys_len) const {
-    *modifiers = 0;
+    *modifiers = _modifiers;
+    const uint8_t n = (_numListed < *keys_len) ? _numListed : *keys_len;
+    for (uint8_t idx = 0; idx < n; ++idx) {
+        keys[idx] = _pressed[idx].code;
+    }
+    FLOG(6, "getState(): [%d keys pressed]\n", _numPressed);
+    *keys_len = _numPressed;
+}
 
-    FLOG(6, "getState():");
-    uint8_t pressed_idx = 0;
-    for (uint8_t col = 0; col < NUM_COLS; ++col) {
-        for (uint8_t row = 0; row < NUM_ROWS; ++row) {
-            auto idx = getIndex(col, row);
-            bool pressed = _curMap->get(idx);
-
-            // Log the key changes, if the log level is high enough.
-            if (f_log_level >= 5) {
-                bool prev = _prevMap->get(idx);
-                if (prev != pressed) {
-                    uint8_t key = _keyTable[idx];
-                    FLOG(5, "%s (%d, %d) %s\n",
-                         pressed ? "press" : "release",
-                         col, row,
-                         g_key_descriptions[key]);
-                }
-            }
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::scanKeys() {
+    if (_sliced) {
+        return processFrame();
+    }
+
+    if (_suspendScanned) {
+        // A suspend came in between scans.  prepareSuspendScan() left the
+        // matrix set up for idle mode, which is just what checkIdle()
+        // expects, and any other scan sets up its own lines.
+        _suspendScanned = false;
+        ScanScheduler::singleton()->setSlowClock(_idle);
+    }
 
-            if (pressed) {
-                FLOG(6, " (%d,%d)=%d", col, row, _keyTable[idx]);
-                if (pressed_idx < *keys_len) {
-                    keys[pressed_idx] = _keyTable[idx];
+    const bool wasIdle = _idle;
+    if (_idle && checkIdle()) {
+        // Still idle, nothing has changed.
+        _numEvents = 0;
+        return false;
+    }
+
+    // Swap _prevMap and _curMap
+    auto tmp = _prevMap;
+    _prevMap = _curMap;
+    _curMap = tmp;
+
+    KeyCount numPressed;
+    if (ImplT::SPLIT_COLS == 0) {
+        if (_fullScanInterval <= 1) {
+            numPressed = scanColumns();
+            ++_scanStats.fullScans;
+        } else {
+            if (wasIdle) {
+                // The idle check covered every column.
+                _scansSinceFull = 0;
+            }
+            ++_scansSinceFull;
+            bool full = wasIdle || _scansSinceFull >= _fullScanInterval;
+            if (!full) {
+                numPressed = scanHotColumns();
+                if (hasNewPress()) {
+                    // The new key could be a ghost caused by keys on cold
+                    // columns, so check everything before reporting it.
+                    ++_scanStats.promotedScans;
+                    full = true;
+                } else {
+                    ++_scanStats.partialScans;
                 }
-                ++pressed_idx;
-                uint8_t modifier = _modifierTable[idx];
-                *modifiers |= modifier;
             }
+            if (full) {
+                numPressed = scanColumns();
+                ++_scanStats.fullScans;
+                recordColdDetections();
+                _scansSinceFull = 0;
+            }
+            updateHeat();
         }
+        ScanScheduler::singleton()->recordSample();
+
+        // Now look for possible ghosting, and attempt to resolve it,
+        // or perform blocking if we cannot determing if a key press is
+        // real or ghosting.
+        resolveMatrix(numPressed, 0);
+    } else {
+        KeyCount numLeft;
+        KeyCount numRight;
+        scanSplitColumns(&numLeft, &numRight);
+        ++_scanStats.fullScans;
+        ScanScheduler::singleton()->recordSample();
+        resolveMatrix(numLeft, numRight);
+        numPressed = numLeft + numRight;
     }
-    FLOG(6, " [%d keys pressed]\n", pressed_idx);
 
-    *keys_len = pressed_idx;
+    if (_suspendScanned) {
+        discardScan();
+        _numEvents = 0;
+        return false;
+    }
+
+    const bool bouncing = debounce();
+    updateIdle(numPressed != 0 || bouncing);
+    return updateEvents();
 }
 
+/*
+ * Throw away a scan that prepareSuspendScan() interrupted.
+ *
+ * The interrupt changed which lines were driven partway through, so both the
+ * reads and any ghosting resolution based on them are garbage.  The reported
+ * state stays as it was, and the next call performs a full scan.
+ */
 template<uint8_t NC, uint8_t NR, typename ImplT>
-bool
-KbdDiodeImpl<NC, NR, ImplT>::scanKeys() {
-    // Prepare to scan the first column.
-    // It takes a very brief period for the rows to be readable after this,
-    // so do this early, before we actually need to read the rows.
-    // This way we can avoid an artificial delay.
+void
+KbdDiodeImpl<NC, NR, ImplT>::discardScan() {
+    FLOG(3, "scan interrupted by suspend, discarding\n");
+    _suspendScanned = false;
+    auto tmp = _prevMap;
+    _prevMap = _curMap;
+    _curMap = tmp;
+
+    _memoValid = false;
+    _pending.valid = false;
+    _resolveStartCol = 0;
+    // Make the next adaptive scan a full one.
+    _scansSinceFull = _fullScanInterval - 1;
+    ScanScheduler::singleton()->setSlowClock(false);
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+ScanScheduler::SliceCallback *
+KbdDiodeImpl<NC, NR, ImplT>::getSliceCallback(uint8_t *numSlices) {
+    if (!_sliced) {
+        return nullptr;
+    }
+
+    // The interrupt isn't running yet, so there's no need to be atomic here.
+    _frameReady = false;
+    _sliceIdle = false;
+    _sliceEnterIdle = false;
+    _sliceBack = 0;
+    _sliceCol = 0;
     _prepareColScan(0);
 
+    *numSlices = NUM_COLS;
+    return this;
+}
+
+/*
+ * Sample one column of the matrix.
+ *
+ * This is called from the ScanScheduler's timer interrupt.  The column read
+ * here was signalled on the previous tick, so it has had a full slice period
+ * to settle.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::onSlice() {
+    RowMap rows;
+    _readRows(&rows);
+
+    if (_sliceIdle) {
+        // All columns are signalled; just look for any activity.
+        if (!rows.any()) {
+            return false;
+        }
+        ScanScheduler::singleton()->setSlowClock(false);
+        _sliceIdle = false;
+        _sliceCol = 0;
+        _prepareColScan(0);
+        return false;
+    }
+
+    rows.bytes[ROW_BYTES - 1] &= LAST_ROW_MASK;
+    uint8_t *colBytes = _frames[_sliceBack].bytes + (_sliceCol * ROW_BYTES);
+    for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+        colBytes[n] = rows.bytes[n];
+    }
+
+    ++_sliceCol;
+    if (_sliceCol < NUM_COLS) {
+        _prepareColScan(_sliceCol);
+        return false;
+    }
+
+    // The frame is complete.  Only hand it off if scanKeys() has finished
+    // with the last one; otherwise fill the same buffer again.
+    bool handedOff = false;
+    if (!_frameReady) {
+        _sliceBack ^= 1;
+        _frameReady = true;
+        handedOff = true;
+    } else {
+        ++_droppedFrames;
+    }
+
+    _sliceCol = 0;
+    if (_sliceEnterIdle) {
+        _sliceEnterIdle = false;
+        _sliceIdle = true;
+        _prepareIdleScan();
+        ScanScheduler::singleton()->setSlowClock(true);
+    } else {
+        _prepareColScan(0);
+    }
+    return handedOff;
+}
+
+/*
+ * Process a frame completed by onSlice().
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::processFrame() {
+    if (!_frameReady) {
+        _numEvents = 0;
+        return false;
+    }
+
     // Swap _prevMap and _curMap
     auto tmp = _prevMap;
     _prevMap = _curMap;
     _curMap = tmp;
-    // Clear _curMap in preparation for this scan
-    _curMap->clear();
 
-    // Perform a basic scan over the keys
-    uint8_t numPressed = 0;
+    // Each column was sampled at the start of its slice.
+    const uint16_t sliceTicks = ScanScheduler::singleton()->getPeriodTicks();
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        _colTime[col] = col * sliceTicks;
+    }
+
+    // The interrupt won't touch the front buffer until we clear _frameReady.
+    const uint8_t *frame = _frames[_sliceBack ^ 1].bytes;
+    KeyCount numPressed = 0;
+    for (uint8_t n = 0; n < KeyMap::NUM_BYTES; ++n) {
+        _curMap->bytes[n] = frame[n];
+        numPressed += popcount8(frame[n]);
+    }
+    _frameReady = false;
+    ++_scanStats.fullScans;
+
+    resolveMatrix(numPressed, 0);
+
+    const bool bouncing = debounce();
+    updateIdle(numPressed != 0 || bouncing);
+    return updateEvents();
+}
+
+/*
+ * Resolve ghosting in the freshly scanned _curMap.
+ *
+ * numLeft and numRight are the keys seen down in each half of a split
+ * matrix.  For other matrices numLeft is the total, and numRight is 0.
+ *
+ * While a chord is held, every scan sees the same raw matrix and
+ * resolveGhosting() reaches the same decision each time.  So the last raw
+ * input and its resolved output are remembered, and reused as long as the
+ * raw scan is unchanged and the previous scan reported that same output for
+ * the keys in it; see memoMatches().
+ *
+ * This only holds for decisions made from the raw scan alone.  A key can be
+ * pressed or released underneath a ghost without changing the raw scan, and
+ * only a reverse scan will notice, so results that used reverse scans are
+ * never memoized.  Nor are results with work deferred to the next scan.
+ *
+ * Resolution gets ImplT::RESOLVE_BUDGET_US per call.  resolveGhosting()
+ * checks the time before each unit of work, and defers whatever doesn't fit.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::resolveMatrix(KeyCount numLeft,
+                                           KeyCount numRight) {
+    // A rectangle needs at least 4 keys down in one half.
+    if (numLeft < 4 && numRight < 4) {
+        return;
+    }
+
+    if (_memoValid && memoMatches()) {
+        *_curMap = _memoOut;
+        ++_scanStats.resolveHits;
+        _scanStats.resolveTicksSaved += _memoCost;
+        return;
+    }
+
+    auto sched = ScanScheduler::singleton();
+    const uint16_t start = sched->elapsedInIteration();
+    const uint32_t deadline = static_cast<uint32_t>(start) +
+        ScanScheduler::usToTicks(ImplT::RESOLVE_BUDGET_US);
+    _resolveDeadline = (deadline > 0xffff) ? 0xffff : deadline;
+    _resolveDeferred = false;
+    _resolveStarted = false;
+    _memoIn = *_curMap;
+    _memoSkip = false;
+    if (ImplT::SPLIT_COLS == 0) {
+        resolveGhosting(0, NUM_COLS, 0, NUM_ROWS);
+    } else {
+        // The two halves are electrically independent, so a ghosting
+        // rectangle can never span both of them.
+        if (numLeft >= 4) {
+            resolveGhosting(0, ImplT::SPLIT_COLS, 0, ImplT::SPLIT_ROWS);
+        }
+        if (numRight >= 4) {
+            resolveGhosting(ImplT::SPLIT_COLS, NUM_COLS,
+                            ImplT::SPLIT_ROWS, NUM_ROWS);
+        }
+    }
+    if (!_resolveDeferred) {
+        _resolveStartCol = 0;
+    }
+    _memoOut = *_curMap;
+    _memoCost = sched->elapsedInIteration() - start;
+    _memoValid = !_memoSkip;
+    ++_scanStats.resolveMisses;
+    if (_memoCost > _scanStats.maxResolveTicks) {
+        _scanStats.maxResolveTicks = _memoCost;
+    }
+}
+
+/*
+ * Whether the memoized resolution result applies to the scan in _curMap.
+ *
+ * The raw scan must be the one memoized.  The reported state matters too,
+ * because blocking keeps keys that were already reported, but only for keys
+ * in the raw scan: the resolver never looks at any others.  Given its own
+ * output as the previous state, the resolver is a fixed point.
+ *
+ * _prevMap is the debounced state, so it can differ from _memoOut outside
+ * the raw scan, such as a released key whose release is still being
+ * counted.  Comparing only the keys in _memoIn lets those scans reuse the
+ * result too.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::memoMatches() const {
+    for (uint8_t n = 0; n < KeyMap::NUM_BYTES; ++n) {
+        const uint8_t in = _memoIn.bytes[n];
+        if (_curMap->bytes[n] != in ||
+            (_prevMap->bytes[n] & in) != _memoOut.bytes[n]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Whether any of the ghosting resolution time budget for this scan remains.
+ *
+ * The first check in each scan always succeeds, so that work deferred from
+ * earlier scans keeps making progress even if the budget is tiny.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::resolveTimeLeft() {
+    if (!_resolveStarted) {
+        _resolveStarted = true;
+        return true;
+    }
+    return ScanScheduler::singleton()->elapsedInIteration() < _resolveDeadline;
+}
+
+/*
+ * Leave the component containing col for the next scan, because this scan's
+ * time budget has run out.
+ *
+ * The next scan starts resolving at the first component deferred.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::deferComponent(uint8_t col) {
+    FLOG(3, "  Ghosting budget exhausted at column %d\n", col);
+    ++_scanStats.resolveDeferrals;
+    _memoSkip = true;
+    if (!_resolveDeferred) {
+        _resolveDeferred = true;
+        _resolveStartCol = col;
+    }
+}
+
+/*
+ * Build the event list for getEvents() from the keys that differ between
+ * _curMap and _prevMap.
+ *
+ * Changed keys are found a byte at a time, so only the keys that actually
+ * changed cost a key table lookup.  Events are listed in column order,
+ * which is the order the columns were sampled in.
+ *
+ * Returns true if any key changed.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::updateEvents() {
+    uint8_t numEvents = 0;
+    const uint8_t *cur = _curMap->bytes;
+    const uint8_t *prev = _prevMap->bytes;
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+            uint8_t changed = cur[n] ^ prev[n];
+            for (uint8_t row = n * 8; changed != 0; ++row, changed >>= 1) {
+                if (!(changed & 1)) {
+                    continue;
+                }
+                if (numEvents == MAX_EVENTS) {
+                    // Too many changes at once.  Callers fall back to
+                    // getState().
+                    _numEvents = EVENTS_UNAVAILABLE;
+                    rebuildPressed();
+                    return true;
+                }
+                const auto key_idx = getKeyIndex(col, row);
+                KeyEvent *ev = &_events[numEvents++];
+                ev->col = col;
+                ev->row = row;
+                ev->code = _keyTable[key_idx];
+                ev->modifier = _modifierTable[key_idx];
+                ev->pressed = cur[n] & (1 << (row & 0x7));
+                ev->time = _colTime[col];
+                FLOG(5, "%s (%d, %d) %s at %u\n",
+                     ev->pressed ? "press" : "release", col, row,
+                     g_key_descriptions[ev->code], ev->time);
+            }
+        }
+        cur += ROW_BYTES;
+        prev += ROW_BYTES;
+    }
+    _numEvents = numEvents;
+    if (numEvents == 0) {
+        return false;
+    }
+    updatePressed();
+    return true;
+}
+
+/*
+ * Apply this scan's events to the pressed key list and modifier mask.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::updatePressed() {
+    if (_numPressed != _numListed) {
+        // Some pressed keys aren't listed, so a release may need to bring
+        // one of them into the list.
+        rebuildPressed();
+        return;
+    }
+
+    for (uint8_t n = 0; n < _numEvents; ++n) {
+        const KeyEvent &ev = _events[n];
+        const KeyIndex idx = getIndex(ev.col, ev.row);
+        if (ev.pressed) {
+            if (_numListed == MAX_PRESSED) {
+                rebuildPressed();
+                return;
+            }
+            PressedKey *key = &_pressed[_numListed++];
+            key->idx = idx;
+            key->code = ev.code;
+            key->modifier = ev.modifier;
+            continue;
+        }
+
+        uint8_t pos = 0;
+        while (pos < _numListed && _pressed[pos].idx != idx) {
+            ++pos;
+        }
+        if (pos == _numListed) {
+            // Not expected, since every pressed key is listed.
+            rebuildPressed();
+            return;
+        }
+        --_numListed;
+        for (; pos < _numListed; ++pos) {
+            _pressed[pos] = _pressed[pos + 1];
+        }
+    }
+    _numPressed = _numListed;
+
+    // Several keys can share a modifier, so recompute the mask rather than
+    // clearing bits on release.
+    uint8_t modifiers = 0;
+    for (uint8_t n = 0; n < _numListed; ++n) {
+        modifiers |= _pressed[n].modifier;
+    }
+    _modifiers = modifiers;
+}
+
+/*
+ * Rebuild the pressed key list and modifier mask from _curMap.
+ *
+ * This is only needed when more keys change at once than there are events,
+ * or more keys are down than fit in the list.  Keys are then listed in
+ * matrix order, and any past MAX_PRESSED are left out of the list but still
+ * counted.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::rebuildPressed() {
+    _numListed = 0;
+    _numPressed = 0;
+    _modifiers = 0;
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        for (uint8_t row = 0; row < NUM_ROWS; ++row) {
+            const KeyIndex idx = getIndex(col, row);
+            if (!_curMap->get(idx)) {
+                continue;
+            }
+            const auto key_idx = getKeyIndex(col, row);
+            const uint8_t modifier = _modifierTable[key_idx];
+            _modifiers |= modifier;
+            ++_numPressed;
+            if (_numListed < MAX_PRESSED) {
+                PressedKey *key = &_pressed[_numListed++];
+                key->idx = idx;
+                key->code = _keyTable[key_idx];
+                key->modifier = modifier;
+            }
+        }
+    }
+}
+
+/*
+ * Debounce the resolved scan in _curMap against the reported state in
+ * _prevMap, leaving the new reported state in _curMap.
+ *
+ * Each key has a 3-bit vertical counter in _bounce, so the counters for 8
+ * keys are advanced and checked with a handful of byte operations.  A key's
+ * counter counts the consecutive scans that have seen it differ from its
+ * reported state.  Once it reaches the key's threshold the key changes
+ * state and the counter is cleared; if the scan agrees with the reported
+ * state again first, the counter is cleared without a change.
+ *
+ * This runs after ghosting resolution, not before it.  The resolver works
+ * out which keys are down from the electrical state of the matrix, and its
+ * reverse scans read the live lines, so it needs the raw scan as its input.
+ * A debounced map can still hold a key whose release is being counted, or
+ * leave out one whose press is, and resolving that against the live lines
+ * reports ghosts.  Resolution only keeps keys that were seen down in this
+ * scan, so a bounce is resolved like any other change and debounced here.
+ *
+ * Returns true if any key is reported down or has its count running, in
+ * which case idle mode must not be entered yet.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::debounce() {
+    typedef KeyTable<typename ImplT::SlowKeys, ROW_STRIDE,
+                     typename MakeByteSeq<KeyMap::NUM_BYTES>::Type> SlowMap;
+
+    uint8_t active = 0;
+    for (uint8_t n = 0; n < KeyMap::NUM_BYTES; ++n) {
+        const uint8_t state = _prevMap->bytes[n];
+        const uint8_t delta = _curMap->bytes[n] ^ state;
+        const uint8_t c0 = _bounce[0].bytes[n];
+        const uint8_t c1 = _bounce[1].bytes[n];
+        const uint8_t c2 = _bounce[2].bytes[n];
+        active |= state | delta;
+        if (delta == 0) {
+            // The common case: nothing changing in these 8 keys.
+            const uint8_t counting = c0 | c1 | c2;
+            if (counting) {
+                _scanStats.bouncesFiltered += popcount8(counting);
+                _bounce[0].bytes[n] = 0;
+                _bounce[1].bytes[n] = 0;
+                _bounce[2].bytes[n] = 0;
+            }
+            continue;
+        }
+
+        // Count one more scan for the keys that differ, and clear the rest.
+        // No counter can pass MAX_DEBOUNCE_SCANS, since it is cleared when
+        // its key changes state.
+        const uint8_t count[DEBOUNCE_BITS] = {
+            static_cast<uint8_t>(~c0 & delta),
+            static_cast<uint8_t>((c1 ^ c0) & delta),
+            static_cast<uint8_t>((c2 ^ (c1 & c0)) & delta),
+        };
+        _scanStats.bouncesFiltered += popcount8((c0 | c1 | c2) & ~delta);
+
+        // Compare each count against its key's threshold, which depends on
+        // the key's class and on whether it is waiting to be pressed or
+        // released.
+        const uint8_t slow = pgm_read_byte(SlowMap::bytes + n);
+        uint8_t mismatch = 0;
+        for (uint8_t k = 0; k < DEBOUNCE_BITS; ++k) {
+            const DebouncePlane &p = _debouncePlanes[k];
+            const uint8_t press = p.press ^ (p.pressSlow & slow);
+            const uint8_t release = p.release ^ (p.releaseSlow & slow);
+            const uint8_t limit = press ^ ((press ^ release) & state);
+            mismatch |= count[k] ^ limit;
+        }
+        const uint8_t flip = delta & ~mismatch;
+
+        _curMap->bytes[n] = state ^ flip;
+        _bounce[0].bytes[n] = count[0] & ~flip;
+        _bounce[1].bytes[n] = count[1] & ~flip;
+        _bounce[2].bytes[n] = count[2] & ~flip;
+    }
+    return active != 0;
+}
+
+/*
+ * Scan the columns one at a time into _curMap.
+ *
+ * Returns the number of keys seen down.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+typename KbdDiodeImpl<NC, NR, ImplT>::KeyCount
+KbdDiodeImpl<NC, NR, ImplT>::scanColumns() {
+    // The last column from the previous scan (or all columns, if we were just
+    // idle) is still being driven until this call.
+    _prepareColScan(0);
+    settle(_maxColSettle);
+
+    // Every byte of _curMap is overwritten by this loop, so there is no need
+    // to clear it first.
+    auto sched = ScanScheduler::singleton();
+    KeyCount numPressed = 0;
+    uint8_t *colBytes = _curMap->bytes;
     for (uint8_t col = 0; col < NUM_COLS; ++col) {
         // Read the rows
         RowMap rows;
+        _colTime[col] = sched->timerCount();
         _readRows(&rows);
 
         // Prepare to scan the column for the next iteration.
@@ -77,32 +697,619 @@ KbdDiodeImpl<NC, NR, ImplT>::scanKeys() {
             _prepareColScan(col + 1);
         }
 
-        for (uint8_t row = 0; row < NUM_ROWS; ++row) {
-            if (rows[row]) {
-                ++numPressed;
-                _curMap->set(getIndex(col, row));
-            }
+        rows.bytes[ROW_BYTES - 1] &= LAST_ROW_MASK;
+        uint8_t rowsActive = 0;
+        for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+            colBytes[n] = rows.bytes[n];
+            rowsActive |= rows.bytes[n];
+            numPressed += popcount8(rows.bytes[n]);
+        }
+        colBytes += ROW_BYTES;
+
+        // Wait for the column we just released to return high before reading
+        // the next one.  If any keys were down on it, the rows they were
+        // pulling low also need to recover.
+        if (col + 1 < NUM_COLS) {
+            uint8_t loops = _colSettle[col];
+            if (rowsActive && _maxRowSettle > loops) {
+                loops = _maxRowSettle;
+            }
+            settle(loops);
+        }
+    }
+    return numPressed;
+}
+
+/*
+ * Scan only the hot columns into _curMap.
+ *
+ * Cold columns had no keys down in the previous scan, and are left empty.
+ * Returns the number of keys seen down.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+typename KbdDiodeImpl<NC, NR, ImplT>::KeyCount
+KbdDiodeImpl<NC, NR, ImplT>::scanHotColumns() {
+    // We don't know which column the previous scan left driven.
+    uint8_t loops = _maxColSettle;
+
+    auto sched = ScanScheduler::singleton();
+    KeyCount numPressed = 0;
+    uint8_t *colBytes = _curMap->bytes;
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        if (_colHeat[col] == 0) {
+            _colTime[col] = sched->timerCount();
+            for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+                colBytes[n] = 0;
+            }
+            colBytes += ROW_BYTES;
+            continue;
+        }
+
+        // Hot columns are usually not adjacent, so there is nothing to
+        // overlap the settle time with here.
+        _prepareColScan(col);
+        settle(loops);
+
+        RowMap rows;
+        _colTime[col] = sched->timerCount();
+        _readRows(&rows);
+        rows.bytes[ROW_BYTES - 1] &= LAST_ROW_MASK;
+        uint8_t rowsActive = 0;
+        for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+            colBytes[n] = rows.bytes[n];
+            rowsActive |= rows.bytes[n];
+            numPressed += popcount8(rows.bytes[n]);
+        }
+        colBytes += ROW_BYTES;
+
+        loops = _colSettle[col];
+        if (rowsActive && _maxRowSettle > loops) {
+            loops = _maxRowSettle;
+        }
+    }
+    return numPressed;
+}
+
+/*
+ * Whether _curMap has any key down that was not down in _prevMap.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::hasNewPress() const {
+    for (uint8_t n = 0; n < KeyMap::NUM_BYTES; ++n) {
+        if (_curMap->bytes[n] & ~_prevMap->bytes[n]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * After a full scan, record keys found down on columns that were cold.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::recordColdDetections() {
+    const uint8_t *colBytes = _curMap->bytes;
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        if (_colHeat[col] == 0) {
+            uint8_t rowsActive = 0;
+            for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+                rowsActive |= colBytes[n];
+            }
+            if (rowsActive) {
+                ++_scanStats.coldDetections;
+                if (_scansSinceFull > _scanStats.maxColdLatency) {
+                    _scanStats.maxColdLatency = _scansSinceFull;
+                }
+            }
+        }
+        colBytes += ROW_BYTES;
+    }
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::updateHeat() {
+    const uint8_t *colBytes = _curMap->bytes;
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        uint8_t rowsActive = 0;
+        for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+            rowsActive |= colBytes[n];
+        }
+        colBytes += ROW_BYTES;
+
+        if (rowsActive) {
+            _colHeat[col] = _hotHoldoff;
+        } else if (_colHeat[col] != 0) {
+            --_colHeat[col];
+        }
+    }
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::logStats() const {
+    FLOG(1, "kbd scan stats: full=%lu partial=%lu promoted=%u "
+         "cold_detections=%u max_cold_latency=%u dropped=%u\n",
+         _scanStats.fullScans, _scanStats.partialScans,
+         _scanStats.promotedScans, _scanStats.coldDetections,
+         _scanStats.maxColdLatency, getDroppedFrames());
+    FLOG(1, "kbd ghosting memo: hits=%lu misses=%lu ticks_saved=%lu "
+         "rescan_retries=%u rescan_deferrals=%u\n",
+         _scanStats.resolveHits, _scanStats.resolveMisses,
+         _scanStats.resolveTicksSaved, _scanStats.rescanRetries,
+         _scanStats.rescanDeferrals);
+    FLOG(1, "kbd ghosting budget: deferrals=%u max_ticks=%u\n",
+         _scanStats.resolveDeferrals, _scanStats.maxResolveTicks);
+    FLOG(1, "kbd debounce: bounces_filtered=%lu\n",
+         _scanStats.bouncesFiltered);
+}
+
+/*
+ * Scan a split matrix into _curMap, driving one column in each half at a
+ * time.
+ *
+ * The number of keys seen down in each half is returned in numLeft and
+ * numRight.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::scanSplitColumns(KeyCount *numLeft,
+                                              KeyCount *numRight) {
+    const uint8_t LEFT_COLS = ImplT::SPLIT_COLS;
+    const uint8_t RIGHT_COLS = NUM_COLS - ImplT::SPLIT_COLS;
+    const uint8_t NUM_STEPS = LEFT_COLS > RIGHT_COLS ? LEFT_COLS : RIGHT_COLS;
+    const uint8_t SPLIT_ROWS = ImplT::SPLIT_ROWS;
+    const uint8_t NONE = NO_COL;
+    // This is compiled for every board, but only called if SPLIT_COLS is set.
+    static_assert(LEFT_COLS == 0 || LEFT_COLS < NUM_COLS,
+                  "each half of a split matrix needs at least one column");
+    static_assert(LEFT_COLS == 0 || (SPLIT_ROWS > 0 && SPLIT_ROWS < NUM_ROWS),
+                  "each half of a split matrix needs at least one row");
+
+    _prepareSplitColScan(0, LEFT_COLS);
+    settle(_maxColSettle);
+
+    auto sched = ScanScheduler::singleton();
+    *numLeft = 0;
+    *numRight = 0;
+    for (uint8_t step = 0; step < NUM_STEPS; ++step) {
+        const uint8_t left = (step < LEFT_COLS) ? step : NONE;
+        const uint8_t right = (step < RIGHT_COLS) ? LEFT_COLS + step : NONE;
+
+        RowMap rows;
+        const uint16_t now = sched->timerCount();
+        _readRows(&rows);
+        if (left != NONE) {
+            _colTime[left] = now;
+        }
+        if (right != NONE) {
+            _colTime[right] = now;
+        }
+
+        const uint8_t next = step + 1;
+        if (next < NUM_STEPS) {
+            _prepareSplitColScan((next < LEFT_COLS) ? next : NONE,
+                                 (next < RIGHT_COLS) ? LEFT_COLS + next : NONE);
+        }
+
+        // Every column is scanned in exactly one step, so as with
+        // scanColumns() every byte of _curMap gets overwritten.
+        uint8_t rowsActive = 0;
+        for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+            const uint8_t leftMask = rowBitsBelow(n, SPLIT_ROWS);
+            const uint8_t rightMask = rowBitsBelow(n, NUM_ROWS) & ~leftMask;
+            if (left != NONE) {
+                const uint8_t bits = rows.bytes[n] & leftMask;
+                _curMap->bytes[(left * ROW_BYTES) + n] = bits;
+                rowsActive |= bits;
+                *numLeft += popcount8(bits);
+            }
+            if (right != NONE) {
+                const uint8_t bits = rows.bytes[n] & rightMask;
+                _curMap->bytes[(right * ROW_BYTES) + n] = bits;
+                rowsActive |= bits;
+                *numRight += popcount8(bits);
+            }
+        }
+
+        if (next < NUM_STEPS) {
+            uint8_t loops = 0;
+            if (left != NONE) {
+                loops = _colSettle[left];
+            }
+            if (right != NONE && _colSettle[right] > loops) {
+                loops = _colSettle[right];
+            }
+            if (rowsActive && _maxRowSettle > loops) {
+                loops = _maxRowSettle;
+            }
+            settle(loops);
+        }
+    }
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::settle(uint8_t loops) {
+    // _delay_loop_1(0) would delay for 256 iterations
+    if (loops != 0) {
+        _delay_loop_1(loops);
+    }
+}
+
+/*
+ * Convert a number of calibration polls into a settle time in
+ * _delay_loop_1() iterations.
+ *
+ * poll_ticks is the time MAX_SETTLE_POLLS polls of the line take, in
+ * SystemTime timer counts, as measured by timeColPolls() or timeRowPolls().
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint8_t
+KbdDiodeImpl<NC, NR, ImplT>::pollsToSettleLoops(uint8_t polls,
+                                                uint16_t poll_ticks) {
+    // A line that had already settled by the first poll took less than one
+    // poll, which is too short to measure.  Keep the old fixed delay for it.
+    if (polls == 0) {
+        return KBD_DEFAULT_SETTLE_LOOPS;
+    }
+
+    // Each timer count is TIMER_PRESCALE cycles, and each _delay_loop_1()
+    // iteration takes 3.  Use twice the measured time, rounded up, for some
+    // safety margin against temperature and supply variation.
+    enum : uint16_t { DIVISOR = 3 * MAX_SETTLE_POLLS };
+    const uint32_t scaled = static_cast<uint32_t>(polls) * poll_ticks *
+        (2 * SystemTime::TIMER_PRESCALE);
+    const uint32_t loops = (scaled + DIVISOR - 1) / DIVISOR;
+    if (loops > 0xff) {
+        return 0xff;
+    }
+    return loops;
+}
+
+/*
+ * Poll a column until it stops reading as driven.
+ *
+ * Returns the number of polls that still saw it driven, up to
+ * MAX_SETTLE_POLLS.  This must be called with interrupts disabled.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint8_t
+KbdDiodeImpl<NC, NR, ImplT>::pollColSettle(uint8_t col) {
+    const uint8_t byte_idx = col >> 3;
+    const uint8_t mask = 1 << (col & 0x7);
+
+    uint8_t polls = 0;
+    while (true) {
+        ColMap cols;
+        _readCols(&cols);
+        if (!(cols.bytes[byte_idx] & mask)) {
+            break;
+        }
+        if (++polls >= MAX_SETTLE_POLLS) {
+            break;
+        }
+    }
+    return polls;
+}
+
+/*
+ * Poll a row until it stops reading as driven.
+ *
+ * Returns the number of polls that still saw it driven, up to
+ * MAX_SETTLE_POLLS.  This must be called with interrupts disabled.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint8_t
+KbdDiodeImpl<NC, NR, ImplT>::pollRowSettle(uint8_t row) {
+    const uint8_t byte_idx = row >> 3;
+    const uint8_t mask = 1 << (row & 0x7);
+
+    uint8_t polls = 0;
+    while (true) {
+        RowMap rows;
+        _readRows(&rows);
+        if (!(rows.bytes[byte_idx] & mask)) {
+            break;
+        }
+        if (++polls >= MAX_SETTLE_POLLS) {
+            break;
+        }
+    }
+    return polls;
+}
+
+/*
+ * Measure how long MAX_SETTLE_POLLS column polls take, in SystemTime timer
+ * counts.
+ *
+ * This polls a column while it is still being driven, so the poll loop
+ * never exits early.  The cost of reading the clock is measured and taken
+ * off.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint16_t
+KbdDiodeImpl<NC, NR, ImplT>::timeColPolls() {
+    auto clock = SystemTime::singleton();
+    _prepareColScan(0);
+    _delay_loop_1(KBD_DEFAULT_SETTLE_LOOPS);
+
+    uint8_t polls;
+    uint32_t elapsed;
+    uint32_t overhead;
+    {
+        AtomicGuard ag;
+        uint32_t start = clock->ticks();
+        overhead = clock->ticks() - start;
+        start = clock->ticks();
+        polls = pollColSettle(0);
+        elapsed = clock->ticks() - start;
+    }
+
+    if (polls < MAX_SETTLE_POLLS) {
+        // The driven column didn't read as driven, so there is nothing to
+        // time.  Fall back to an estimate of 8 cycles per poll.
+        FLOG(1, "column 0 did not read as driven\n");
+        return MAX_SETTLE_POLLS;
+    }
+    return elapsed > overhead ? elapsed - overhead : 1;
+}
+
+/*
+ * Measure how long MAX_SETTLE_POLLS row polls take, in SystemTime timer
+ * counts.  See timeColPolls().
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint16_t
+KbdDiodeImpl<NC, NR, ImplT>::timeRowPolls() {
+    auto clock = SystemTime::singleton();
+    _prepareRowScan(0);
+    _delay_loop_1(KBD_DEFAULT_SETTLE_LOOPS);
+
+    uint8_t polls;
+    uint32_t elapsed;
+    uint32_t overhead;
+    {
+        AtomicGuard ag;
+        uint32_t start = clock->ticks();
+        overhead = clock->ticks() - start;
+        start = clock->ticks();
+        polls = pollRowSettle(0);
+        elapsed = clock->ticks() - start;
+    }
+    _finishRowScan();
+
+    if (polls < MAX_SETTLE_POLLS) {
+        FLOG(1, "row 0 did not read as driven\n");
+        return MAX_SETTLE_POLLS;
+    }
+    return elapsed > overhead ? elapsed - overhead : 1;
+}
+
+/*
+ * Measure the time for a column to return high after we stop driving it.
+ *
+ * Returns the settle time in _delay_loop_1() iterations.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint8_t
+KbdDiodeImpl<NC, NR, ImplT>::measureColSettle(uint8_t col,
+                                              uint16_t poll_ticks) {
+    const uint8_t other_col = (col + 1 < NUM_COLS) ? col + 1 : 0;
+
+    // Drive the column low, and give it plenty of time to discharge
+    _prepareColScan(col);
+    _delay_loop_1(KBD_DEFAULT_SETTLE_LOOPS);
+
+    uint8_t polls;
+    {
+        // Don't let interrupts inflate the measurement
+        AtomicGuard ag;
+        // Switch to another column, exactly as scanKeys() does,
+        // and count how long it takes for this column to read high again.
+        _prepareColScan(other_col);
+        polls = pollColSettle(col);
+    }
+
+    if (polls >= MAX_SETTLE_POLLS) {
+        FLOG(1, "column %d did not settle\n", col);
+        return KBD_DEFAULT_SETTLE_LOOPS;
+    }
+    return pollsToSettleLoops(polls, poll_ticks);
+}
+
+/*
+ * Measure the time for a row to return high after we stop driving it.
+ *
+ * Returns the settle time in _delay_loop_1() iterations.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint8_t
+KbdDiodeImpl<NC, NR, ImplT>::measureRowSettle(uint8_t row,
+                                              uint16_t poll_ticks) {
+    _prepareRowScan(row);
+    _delay_loop_1(KBD_DEFAULT_SETTLE_LOOPS);
+
+    uint8_t polls;
+    {
+        AtomicGuard ag;
+        _finishRowScan();
+        polls = pollRowSettle(row);
+    }
+
+    if (polls >= MAX_SETTLE_POLLS) {
+        FLOG(1, "row %d did not settle\n", row);
+        return KBD_DEFAULT_SETTLE_LOOPS;
+    }
+    return pollsToSettleLoops(polls, poll_ticks);
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::calibrate() {
+    // The measurements are converted to delay loops at F_CPU, so keep the
+    // current settle times if the clock is scaled down.
+    if (!check_full_speed()) {
+        return;
+    }
+
+    // The poll loops are timed with the system clock, so that the settle
+    // times don't depend on what the compiler made of them.  start() does
+    // nothing if the clock is already running.
+    SystemTime::singleton()->start();
+
+    // Measure the rows first.  _prepareRowScan() releases all of the
+    // columns, and the column measurements leave a column driven, ready for
+    // the first scan.
+    const uint16_t row_poll_ticks = timeRowPolls();
+    _maxRowSettle = 0;
+    FLOG(1, "row poll: %u ticks per %u polls\n",
+         row_poll_ticks, static_cast<uint16_t>(MAX_SETTLE_POLLS));
+    FLOG(1, "row settle loops:");
+    for (uint8_t row = 0; row < NUM_ROWS; ++row) {
+        _rowSettle[row] = measureRowSettle(row, row_poll_ticks);
+        if (_rowSettle[row] > _maxRowSettle) {
+            _maxRowSettle = _rowSettle[row];
+        }
+        FLOG(1, " %d", _rowSettle[row]);
+    }
+    FLOG(1, "\n");
+
+    const uint16_t col_poll_ticks = timeColPolls();
+    _maxColSettle = 0;
+    FLOG(1, "column poll: %u ticks per %u polls\n",
+         col_poll_ticks, static_cast<uint16_t>(MAX_SETTLE_POLLS));
+    FLOG(1, "column settle loops:");
+    for (uint8_t col = 0; col < NUM_COLS; ++col) {
+        _colSettle[col] = measureColSettle(col, col_poll_ticks);
+        if (_colSettle[col] > _maxColSettle) {
+            _maxColSettle = _colSettle[col];
+        }
+        FLOG(1, " %d", _colSettle[col]);
+    }
+    FLOG(1, "\n");
+}
+
+/*
+ * Check for activity while in idle mode.
+ *
+ * Returns true if we should remain idle, or false if any row is active.
+ * In the latter case idle mode is cleared, and the caller should proceed
+ * with a full scan.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::checkIdle() {
+    // All columns were already signalled by updateIdle() when we entered
+    // idle mode, so all we need to do is read the rows.
+    RowMap rows;
+    _readRows(&rows);
+    if (!rows.any()) {
+        return true;
+    }
+
+    // Get back to full speed before the settle delays in the full scan.
+    ScanScheduler::singleton()->setSlowClock(false);
+    FLOG(4, "leaving idle mode\n");
+    _idle = false;
+    _emptyScans = 0;
+    return false;
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::updateIdle(bool active) {
+    if (active) {
+        _emptyScans = 0;
+        return;
+    }
+    if (_idleHoldoff == 0) {
+        return;
+    }
+
+    ++_emptyScans;
+    if (_sliced) {
+        if (_emptyScans >= _idleHoldoff) {
+            // The interrupt signals all columns at the end of its current
+            // frame.
+            FLOG(4, "entering idle mode\n");
+            _sliceEnterIdle = true;
+            _emptyScans = 0;
         }
+        return;
     }
+    if (_emptyScans >= _idleHoldoff) {
+        // Nothing has been pressed for a while.  Signal all of the columns,
+        // so that checkIdle() can detect a press on any key with a single
+        // read of the rows.
+        FLOG(4, "entering idle mode\n");
+        _prepareIdleScan();
+        _idle = true;
+        // Only a single read of the rows happens per scan until a key is
+        // pressed, so there is no need to run at full speed.
+        ScanScheduler::singleton()->setSlowClock(true);
+    }
+}
 
-    if (numPressed >= 4) {
-        // Now look for possible ghosting, and attempt to resolve it,
-        // or perform blocking if we cannot determing if a key press is
-        // real or ghosting.
-        resolveGhosting();
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::prepareSuspendScan() {
+    // Signal all columns, as for idle mode.
+    //
+    // This is called from the USB interrupt, which may have stopped
+    // scanKeys() at any point, even in the middle of a reverse scan.  Idle
+    // mode state is left alone: _idle is only ever set along with the idle
+    // line setup, which is what we leave behind.  Instead _suspendScanned
+    // tells scanKeys() that the lines changed under it, so that it discards
+    // any scan we interrupted.
+    //
+    // The sliced scan interrupt can't run in the middle of this, and simply
+    // goes idle.
+    _finishRowScan();
+    _prepareIdleScan();
+    if (_sliced) {
+        _sliceEnterIdle = false;
+        _sliceIdle = true;
+        _sliceCol = 0;
+    } else {
+        _suspendScanned = true;
     }
 
-    return (*_curMap != *_prevMap);
+    settleAll();
+    _readRows(&_suspendRows);
+    _suspendRows.bytes[ROW_BYTES - 1] &= LAST_ROW_MASK;
+    ScanScheduler::singleton()->setSlowClock(true);
+    return true;
+}
+
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::checkSuspendScan() {
+    RowMap rows;
+    _readRows(&rows);
+    rows.bytes[ROW_BYTES - 1] &= LAST_ROW_MASK;
+    for (uint8_t n = 0; n < ROW_BYTES; ++n) {
+        if (rows.bytes[n] & ~_suspendRows.bytes[n]) {
+            return true;
+        }
+    }
+    return false;
 }
 
 // Whether to perform a more complicated ghosting resolution scheme,
 // or a simple one that just does simple blocking.
 //
 // The complex scheme tries doing a reverse scan (signal rows, read columns)
-// to see if we can detect which keys are really down.  Unfortunately it
+// to see if we can detect which keys are really down.  On its own this
 // suffers from timing problems--it can produce incorrect results if the keys
-// have changed between the original scan and its reverse scan.  Therefore we
-// have it disabled for now.
+// have changed between the original scan and its reverse scan.  To avoid
+// this, every reverse scan is bracketed by forward reads that must match the
+// original scan, and the whole pass must finish within a short timing window
+// (see setRescanWindow()).  A pass that fails is retried, and if it keeps
+// failing the keys involved are blocked until the next scan.  A build may
+// define this as 0 to use simple blocking instead.
 //
 // There are still some issues that are not avoided by either scheme:
 // In some cases a key can be pressed halfway through a the scan, after we have
@@ -110,156 +1317,697 @@ KbdDiodeImpl<NC, NR, ImplT>::scanKeys() {
 // another key that hasn't been scanned yet to appear down, and we don't detect
 // this as a full rectangle being down.
 //
-// We probably need some sort of debounce or delay scheme for this.  For
-// instance, we could wait until a key has been down for 2 scan cycles to
-// report it.  This should avoid the incorrect key being reported in the first
-// cycle.
-#define COMPLEX_GHOSTING_RESOLUTION 0
+// Deferring presses until a key has been down for 2 scans avoids reporting
+// the incorrect key in the first scan; see setDebounce().
+#ifndef COMPLEX_GHOSTING_RESOLUTION
+#define COMPLEX_GHOSTING_RESOLUTION 1
+#endif
 
 #if COMPLEX_GHOSTING_RESOLUTION
 template<uint8_t NC, uint8_t NR, typename ImplT>
 void
-KbdDiodeImpl<NC, NR, ImplT>::resolveGhosting() {
-    // Walk through the keys, and look for rectangles where all 4 corners
-    // are pressed.  In these cases, 1 corner might not really be pressed,
+KbdDiodeImpl<NC, NR, ImplT>::resolveGhosting(uint8_t col_begin,
+                                             uint8_t col_end,
+                                             uint8_t row_begin,
+                                             uint8_t row_end) {
+    // Find every key that is a corner of a rectangle with all 4 corners
+    // pressed.  In these cases, 1 corner might not really be pressed,
     // but was simply detected due to ghosting.
     //
-    // This process is O(N^2) in the worst case (where N is the total number of
-    // keys).  However, in the common case where very few keys are pressed it
-    // is close to O(N).  (It is O(N + K*N), where K is the number of keys
-    // pressed.)
-
-    // First find all rectangles.  We can't process rectangles as we find them,
-    // since we want to make sure that there aren't overlapping rectangles.
-    struct Rect {
-        Rect() {}
-        Rect(uint8_t ca, uint8_t cb, uint8_t ra, uint8_t rb)
-            : col_a(ca), col_b(cb), row_a(ra), row_b(rb) {}
-
-        uint8_t col_a{0xff};
-        uint8_t col_b{0xff};
-        uint8_t row_a{0xff};
-        uint8_t row_b{0xff};
-    };
+    // Two rows form rectangles exactly when they have 2 or more columns
+    // down in common, and every key in those common columns is a corner.
+    // So rather than visiting each rectangle, which can take a very long
+    // time with many keys down, compare every pair of rows once.  This
+    // keeps the worst case down to one bitmask AND per pair of rows.
+    ColMap rowCols[NUM_ROWS];
+    RowMap multi_rows;
+    for (uint8_t col = col_begin; col < col_end; ++col) {
+        const uint8_t *colBytes = _curMap->bytes + (col * ROW_BYTES);
+        for (uint8_t row = nextBit(colBytes, row_begin, row_end);
+             row < row_end;
+             row = nextBit(colBytes, row + 1, row_end)) {
+            if (rowCols[row].any()) {
+                multi_rows.set(row);
+            }
+            rowCols[row].set(col);
+        }
+    }
 
-    // Remember up to 4 rectangles.  If we find more than this, just perform
-    // simple blocking on the additional rectangles.
-    enum : uint8_t { NUM_RECTS = 4 };
-    Rect rects[NUM_RECTS];
-    uint8_t num_rects = 0;
-
-    KeyMap in_rect;
-    KeyMap overlaps;
-    for (uint8_t col_a = 0; col_a < NUM_COLS; ++col_a) {
-        for (uint8_t row_a = 0; row_a < NUM_ROWS; ++row_a) {
-            auto idx_aa = getIndex(col_a, row_a);
-            if (!_curMap->get(idx_aa)) {
+    // rectCols[row] holds the columns of the keys in row that are rectangle
+    // corners.
+    ColMap rectCols[NUM_ROWS];
+    ColMap rect_cols;
+    for (uint8_t row_a = nextBit(multi_rows.bytes, row_begin, row_end);
+         row_a < row_end;
+         row_a = nextBit(multi_rows.bytes, row_a + 1, row_end)) {
+        for (uint8_t row_b = nextBit(multi_rows.bytes, row_a + 1, row_end);
+             row_b < row_end;
+             row_b = nextBit(multi_rows.bytes, row_b + 1, row_end)) {
+            ColMap both;
+            for (uint8_t n = 0; n < ColMap::NUM_BYTES; ++n) {
+                both.bytes[n] =
+                    rowCols[row_a].bytes[n] & rowCols[row_b].bytes[n];
+            }
+            if (both.count() < 2) {
                 continue;
             }
+            FLOG(4, "Found rectangles on rows %d and %d\n", row_a, row_b);
+            for (uint8_t n = 0; n < ColMap::NUM_BYTES; ++n) {
+                rectCols[row_a].bytes[n] |= both.bytes[n];
+                rectCols[row_b].bytes[n] |= both.bytes[n];
+                rect_cols.bytes[n] |= both.bytes[n];
+            }
+        }
+    }
 
-            // Look for another row_a down on this column
-            for (uint8_t row_b = row_a + 1; row_b < NUM_ROWS; ++row_b) {
-                auto idx_ab = getIndex(col_a, row_b);
-                if (!_curMap->get(idx_ab)) {
-                    continue;
+    // Rectangles that share keys, or are joined by other pressed keys, are
+    // electrically connected: current can flow from one to the other, so
+    // they can't be resolved independently.  Group the pressed keys into
+    // connected components, and resolve each component containing a
+    // rectangle as a whole.
+    //
+    // Every pressed key in a column belongs to the same component, so
+    // components are tracked by column.  Components are visited starting
+    // from the first one deferred by the previous scan, so that work left
+    // over when the time budget runs out is always picked up first.
+    const uint8_t num_cols = col_end - col_begin;
+    uint8_t first = col_begin;
+    if (_resolveStartCol > col_begin && _resolveStartCol < col_end) {
+        first = _resolveStartCol;
+    }
+    ColMap done;
+    for (uint8_t n = 0; n < num_cols; ++n) {
+        uint8_t seed = first + n;
+        if (seed >= col_end) {
+            seed -= num_cols;
+        }
+        if (!rect_cols.get(seed) || done.get(seed)) {
+            continue;
+        }
+
+        if (!resolveTimeLeft()) {
+            // Out of time.  Hold the keys of every rectangle not resolved
+            // yet in their previously reported state, and come back to them
+            // on the next scan.
+            deferComponent(seed);
+            ColMap left;
+            for (uint8_t n = 0; n < ColMap::NUM_BYTES; ++n) {
+                left.bytes[n] = rect_cols.bytes[n] & ~done.bytes[n];
+            }
+            blockRectangles(rectCols, left, multi_rows,
+                            col_begin, col_end, row_begin, row_end);
+            return;
+        }
+
+        // Flood out from the seed column, alternately adding every row
+        // with a key down in the newly added columns, and every column with
+        // a key down in the newly added rows.  Each column and row is only
+        // expanded once, so finding a component costs one visit per key
+        // down in it, plus one mask per row.
+        ColMap comp_cols;
+        RowMap comp_rows;
+        ColMap new_cols;
+        new_cols.set(seed);
+        while (new_cols.any()) {
+            RowMap new_rows;
+            for (uint8_t col = nextBit(new_cols.bytes, col_begin, col_end);
+                 col < col_end;
+                 col = nextBit(new_cols.bytes, col + 1, col_end)) {
+                comp_cols.set(col);
+                const uint8_t *colBytes = _curMap->bytes + (col * ROW_BYTES);
+                for (uint8_t row = nextBit(colBytes, row_begin, row_end);
+                     row < row_end;
+                     row = nextBit(colBytes, row + 1, row_end)) {
+                    if (!comp_rows.get(row)) {
+                        comp_rows.set(row);
+                        new_rows.set(row);
+                    }
+                }
+            }
+            new_cols.clear();
+            for (uint8_t row = nextBit(new_rows.bytes, row_begin, row_end);
+                 row < row_end;
+                 row = nextBit(new_rows.bytes, row + 1, row_end)) {
+                for (uint8_t n = 0; n < ColMap::NUM_BYTES; ++n) {
+                    new_cols.bytes[n] |= rowCols[row].bytes[n] &
+                        ~comp_cols.bytes[n];
                 }
+            }
+        }
+        for (uint8_t n = 0; n < ColMap::NUM_BYTES; ++n) {
+            done.bytes[n] |= comp_cols.bytes[n];
+        }
 
-                // aa and ab are both down.
-                // Look for another column with both ba and bb down
-                for (uint8_t col_b = col_a + 1; col_b < NUM_COLS; ++col_b) {
-                    auto idx_ba = getIndex(col_b, row_a);
-                    auto idx_bb = getIndex(col_b, row_b);
-                    if (_curMap->get(idx_ba) && _curMap->get(idx_bb)) {
-                        // Found a rectangle
-                        FLOG(4, "Found rectangle (%d, %d) x (%d, %d)\n",
-                             col_a, row_a, col_b, row_b);
-                        // Track which keys are in multiple rectangles.
-                        overlaps.set(idx_aa, in_rect.get(idx_aa));
-                        overlaps.set(idx_ab, in_rect.get(idx_ab));
-                        overlaps.set(idx_ba, in_rect.get(idx_ba));
-                        overlaps.set(idx_bb, in_rect.get(idx_bb));
-                        in_rect.set(idx_aa);
-                        in_rect.set(idx_ab);
-                        in_rect.set(idx_bb);
-                        in_rect.set(idx_ba);
-
-                        if (num_rects >= NUM_RECTS) {
-                            // Just perform basic blocking for this rectangle.
-                            FLOG(2, "Too many rectangles to process!  "
-                                 "Falling back to simple blocking\n");
-                            performBlocking(col_a, col_b, row_a, row_b);
-                            continue;
-                        }
-
-                        rects[num_rects] = Rect(col_a, col_b, row_a, row_b);
-                        ++num_rects;
+        if (!resolveComponent(comp_cols, comp_rows,
+                              col_begin, col_end, row_begin, row_end)) {
+            FLOG(2, "Unable to resolve ghosting component at column %d.  "
+                 "Falling back to simple blocking\n", seed);
+            blockRectangles(rectCols, comp_cols, comp_rows,
+                            col_begin, col_end, row_begin, row_end);
+        }
+    }
+}
+
+/*
+ * Block the rectangle corners in the specified columns and rows: only keys
+ * that were already reported in the previous scan are kept.
+ *
+ * rectCols holds the corner columns of each row, as computed by
+ * resolveGhosting().
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::blockRectangles(const ColMap *rectCols,
+                                             const ColMap &cols,
+                                             const RowMap &rows,
+                                             uint8_t col_begin,
+                                             uint8_t col_end,
+                                             uint8_t row_begin,
+                                             uint8_t row_end) {
+    for (uint8_t row = nextBit(rows.bytes, row_begin, row_end);
+         row < row_end;
+         row = nextBit(rows.bytes, row + 1, row_end)) {
+        ColMap corners;
+        for (uint8_t n = 0; n < ColMap::NUM_BYTES; ++n) {
+            corners.bytes[n] = rectCols[row].bytes[n] & cols.bytes[n];
+        }
+        for (uint8_t col = nextBit(corners.bytes, col_begin, col_end);
+             col < col_end;
+             col = nextBit(corners.bytes, col + 1, col_end)) {
+            const KeyIndex idx = getIndex(col, row);
+            if (!_prevMap->get(idx)) {
+                _curMap->unset(idx);
+            }
+        }
+    }
+}
+
+/*
+ * Resolve ghosting for one connected component of pressed keys.
+ *
+ * Returns false if the component could not be resolved, in which case the
+ * caller blocks it.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::resolveComponent(const ColMap &comp_cols,
+                                              const RowMap &comp_rows,
+                                              uint8_t col_begin,
+                                              uint8_t col_end,
+                                              uint8_t row_begin,
+                                              uint8_t row_end) {
+    // Assign component-local numbers to the columns, rows and keys.
+    // A connected component with K keys spans at most K columns and K rows,
+    // so once the key count is checked the local numbers fit in a byte.
+    //
+    // Everything is zeroed, so that the whole struct can be compared with
+    // _pending.
+    Component comp{};
+    for (uint8_t row = nextBit(comp_rows.bytes, row_begin, row_end);
+         row < row_end;
+         row = nextBit(comp_rows.bytes, row + 1, row_end)) {
+        if (comp.numRows >= MAX_COMPONENT_KEYS) {
+            return false;
+        }
+        comp.rows[comp.numRows++] = row;
+    }
+    for (uint8_t col = nextBit(comp_cols.bytes, col_begin, col_end);
+         col < col_end;
+         col = nextBit(comp_cols.bytes, col + 1, col_end)) {
+        if (comp.numCols >= MAX_COMPONENT_KEYS) {
+            return false;
+        }
+        for (uint8_t lr = 0; lr < comp.numRows; ++lr) {
+            if (!_curMap->get(getIndex(col, comp.rows[lr]))) {
+                continue;
+            }
+            if (comp.numKeys >= MAX_COMPONENT_KEYS) {
+                FLOG(3, "  Too many keys in ghosting component\n");
+                return false;
+            }
+            comp.keyCol[comp.numKeys] = comp.numCols;
+            comp.keyRow[comp.numKeys] = lr;
+            if (hasDiode(col, comp.rows[lr])) {
+                comp.diodes |= (1 << comp.numKeys);
+            }
+            ++comp.numKeys;
+        }
+        comp.cols[comp.numCols++] = col;
+    }
+
+    // What was seen in the original scan: the rows reached from each column.
+    for (uint8_t k = 0; k < comp.numKeys; ++k) {
+        comp.colRowsSeen[comp.keyCol[k]] |= (1 << comp.keyRow[k]);
+    }
+
+    // Re-scans can't be done in sliced mode without interfering with the
+    // scan interrupt, in which case only the original scan is used.
+    // resolveGhosting() has already checked the time budget.
+    comp.rescanned = !_sliced;
+
+    // A single isolated rectangle is handled by the specialized code for
+    // each arrangement of diodes, which relies on reverse scans.
+    if (comp.rescanned &&
+        comp.numKeys == 4 && comp.numCols == 2 && comp.numRows == 2) {
+        return resolveRectGuarded(comp);
+    }
+
+    FLOG(3, "Resolving ghosting component: %d keys, %d cols, %d rows\n",
+         comp.numKeys, comp.numCols, comp.numRows);
+
+    if (comp.rescanned && !rescanComponent(&comp)) {
+        return false;
+    }
+
+    // A key is definitely down if its row can't be reached from its column
+    // through the other keys.
+    const uint8_t all_keys = (1 << comp.numKeys) - 1;
+    uint8_t required = 0;
+    for (uint8_t k = 0; k < comp.numKeys; ++k) {
+        uint8_t col_rows[MAX_COMPONENT_KEYS];
+        uint8_t row_cols[MAX_COMPONENT_KEYS];
+        keyPaths(comp, all_keys & ~(1 << k), col_rows, row_cols);
+        uint8_t reached_cols = (1 << comp.keyCol[k]);
+        uint8_t reached_rows = 0;
+        componentReach(comp, col_rows, row_cols, &reached_cols, &reached_rows);
+        if (!(reached_rows & (1 << comp.keyRow[k]))) {
+            required |= (1 << k);
+        }
+    }
+
+    // Keys in all of the states that explain what we saw are definitely
+    // down, and keys in none of them are definitely ghosts.
+    uint8_t must = 0xff;
+    uint8_t may = 0;
+    if (!(comp.diodes & all_keys)) {
+        // Without diodes every scan sees every key in the component, so any
+        // state that connects them all is possible.  Only the required keys
+        // are known to be down.
+        must = required;
+        may = all_keys;
+    } else {
+        // Search every combination of the keys that aren't required.
+        //
+        // This can take longer than one scan's time budget, in which case
+        // the search is paused in _pending and resumed on the next scan,
+        // provided that the component and everything seen in it are still
+        // exactly the same.
+        const uint8_t unknown = all_keys & ~required;
+        const uint16_t states = 1 << popcount8(unknown);
+        uint16_t state = 0;
+        uint16_t first_state = 0;
+        if (_pending.valid &&
+            memcmp(&_pending.comp, &comp, sizeof(comp)) == 0) {
+            state = _pending.nextState;
+            first_state = state;
+            FLOG(3, "  Resuming search at state %u of %u\n", state, states);
+            must = _pending.must;
+            may = _pending.may;
+        }
+        _pending.valid = false;
+
+        for (; state < states; ++state) {
+            // Reading the time costs about as much as checking a few
+            // states, so only check it every 4th one.  At least one batch
+            // is always checked, so that a paused search moves forwards.
+            if ((state & 3) == 0 && state != first_state &&
+                !resolveTimeLeft()) {
+                _pending.comp = comp;
+                _pending.nextState = state;
+                _pending.must = must;
+                _pending.may = may;
+                _pending.valid = true;
+                deferComponent(comp.cols[0]);
+                return false;
+            }
+            // Spread the bits of state over the unknown keys.
+            uint8_t keys = required;
+            uint8_t next = 1;
+            for (uint8_t k = 0; k < comp.numKeys; ++k) {
+                if (unknown & (1 << k)) {
+                    if (state & next) {
+                        keys |= (1 << k);
                     }
+                    next <<= 1;
                 }
             }
+            if (componentMatches(comp, keys)) {
+                must &= keys;
+                may |= keys;
+            }
+        }
+        if (must == 0xff && may == 0) {
+            // Nothing explains what we saw.  Most likely the keys changed
+            // partway through the scan.
+            FLOG(3, "  No consistent key state\n");
+            return false;
+        }
+    }
+
+    for (uint8_t k = 0; k < comp.numKeys; ++k) {
+        const uint8_t bit = (1 << k);
+        const uint8_t col = comp.cols[comp.keyCol[k]];
+        const uint8_t row = comp.rows[comp.keyRow[k]];
+        const KeyIndex idx = getIndex(col, row);
+        if (must & bit) {
+            continue;
+        }
+        if (!(may & bit)) {
+            FLOG(3, "  Fixed ghosting on (%d, %d)\n", col, row);
+            _curMap->unset(idx);
+        } else if (!_prevMap->get(idx)) {
+            // The wiring can't tell us whether this key is really down.
+            FLOG(3, "  Blocking ambiguous key (%d, %d)\n", col, row);
+            _curMap->unset(idx);
+        }
+    }
+    return true;
+}
+
+/*
+ * Re-scan a component with the timing guard.
+ *
+ * Reading the columns while each column is signalled shows which other
+ * columns it reaches, and signalling each row shows which columns it reaches
+ * through keys without diodes.  A reverse scan only agrees with the forward
+ * scan if no key changed in between, so the forward reads are taken again
+ * straight afterwards, and the whole pass must fit in the rescan window.
+ * The forward state was then the same at both ends of a window much shorter
+ * than a key press, so the reverse reads saw it too.
+ *
+ * A pass that fails this is retried.  If every attempt fails, returns false
+ * and the component is left to the next scan.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::rescanComponent(Component *comp) {
+    _memoSkip = true;
+    auto sched = ScanScheduler::singleton();
+    for (uint8_t attempt = 0; attempt < RESCAN_ATTEMPTS; ++attempt) {
+        if (attempt > 0) {
+            if (!resolveTimeLeft()) {
+                deferComponent(comp->cols[0]);
+                return false;
+            }
+            ++_scanStats.rescanRetries;
+        }
+        const uint16_t start = sched->elapsedInIteration();
+        if (!readComponentCols(*comp, comp->colColsSeen)) {
+            continue;
+        }
+
+        ColMap cols_read;
+        for (uint8_t lr = 0; lr < comp->numRows; ++lr) {
+            _prepareRowScan(comp->rows[lr]);
+            settleAll();
+            _readCols(&cols_read);
+            _finishRowScan();
+            comp->rowColsSeen[lr] =
+                localBits(cols_read.bytes, comp->cols, comp->numCols);
+        }
+
+        uint8_t confirm_cols[MAX_COMPONENT_KEYS];
+        if (!readComponentCols(*comp, confirm_cols)) {
+            continue;
+        }
+        if (memcmp(confirm_cols, comp->colColsSeen, comp->numCols) != 0) {
+            FLOG(3, "  Column links changed during re-scan\n");
+            continue;
+        }
+        if (static_cast<uint16_t>(sched->elapsedInIteration() - start) >
+            _rescanWindowTicks) {
+            FLOG(3, "  Re-scan exceeded the timing window\n");
+            continue;
+        }
+        return true;
+    }
+
+    FLOG(2, "Keys unstable during re-scan.  Deferring to the next scan\n");
+    ++_scanStats.rescanDeferrals;
+    return false;
+}
+
+/*
+ * Signal each of a component's columns, and check that the rows read still
+ * match the original scan.  The columns reached from each one are returned
+ * in col_cols.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::readComponentCols(const Component &comp,
+                                               uint8_t *col_cols) {
+    RowMap rows_read;
+    ColMap cols_read;
+    for (uint8_t lc = 0; lc < comp.numCols; ++lc) {
+        _prepareColScan(comp.cols[lc]);
+        settleAll();
+        _readRows(&rows_read);
+        _readCols(&cols_read);
+        if (localBits(rows_read.bytes, comp.rows, comp.numRows) !=
+            comp.colRowsSeen[lc]) {
+            // The keys have changed since the scan.
+            FLOG(3, "  Keys changed in column %d\n", comp.cols[lc]);
+            return false;
+        }
+        col_cols[lc] = localBits(cols_read.bytes, comp.cols, comp.numCols);
+    }
+    return true;
+}
+
+/*
+ * Resolve a single isolated rectangle with resolveRect(), under the same
+ * timing guard as rescanComponent().
+ *
+ * resolveRect() performs its own reverse scans, so the forward reads are
+ * checked once it returns, and its changes to _curMap are undone if they
+ * don't match or took too long.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::resolveRectGuarded(const Component &comp) {
+    const uint8_t col_a = comp.cols[0];
+    const uint8_t col_b = comp.cols[1];
+    const uint8_t row_a = comp.rows[0];
+    const uint8_t row_b = comp.rows[1];
+
+    auto sched = ScanScheduler::singleton();
+    for (uint8_t attempt = 0; attempt < RESCAN_ATTEMPTS; ++attempt) {
+        if (attempt > 0) {
+            // All 4 corners were down in the original scan.
+            _curMap->set(getIndex(col_a, row_a));
+            _curMap->set(getIndex(col_a, row_b));
+            _curMap->set(getIndex(col_b, row_a));
+            _curMap->set(getIndex(col_b, row_b));
+            if (!resolveTimeLeft()) {
+                deferComponent(col_a);
+                return false;
+            }
+            ++_scanStats.rescanRetries;
+        }
+        const uint16_t start = sched->elapsedInIteration();
+        if (!resolveRect(col_a, col_b, row_a, row_b)) {
+            // The diodes don't allow this rectangle to be resolved.
+            return false;
+        }
+
+        _memoSkip = true;
+        uint8_t confirm_cols[MAX_COMPONENT_KEYS];
+        if (!readComponentCols(comp, confirm_cols)) {
+            continue;
+        }
+        if (static_cast<uint16_t>(sched->elapsedInIteration() - start) >
+            _rescanWindowTicks) {
+            FLOG(3, "  Re-scan exceeded the timing window\n");
+            continue;
         }
+        return true;
     }
 
-    // Now perform ghosting resolution on each rectangle we found.
-    for (uint8_t n = 0; n < num_rects; ++n) {
-        const Rect& r = rects[n];
-        // Check for overlaps
-        if (overlaps.get(getIndex(r.col_a, r.row_a)) ||
-            overlaps.get(getIndex(r.col_a, r.row_b)) ||
-            overlaps.get(getIndex(r.col_b, r.row_a)) ||
-            overlaps.get(getIndex(r.col_b, r.row_b))) {
-            // This rectangle overlaps with another rectangle.  Trying to
-            // actually resolve the ghosting would be complicated, so just
-            // perform simple blocking.
-            FLOG(2, "Found overlapping rectangles.  "
-                 "Falling back to simple blocking\n");
-            performBlocking(r.col_a, r.col_b, r.row_a, r.row_b);
+    FLOG(2, "Keys unstable during re-scan.  Deferring to the next scan\n");
+    ++_scanStats.rescanDeferrals;
+    _curMap->set(getIndex(col_a, row_a));
+    _curMap->set(getIndex(col_a, row_b));
+    _curMap->set(getIndex(col_b, row_a));
+    _curMap->set(getIndex(col_b, row_b));
+    return false;
+}
+
+/*
+ * Compute the direct connections made by a set of a component's keys.
+ *
+ * Signalling a column pulls down the rows of all of its keys, while a row
+ * only pulls down the columns of its keys without diodes.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::keyPaths(const Component &comp,
+                                      uint8_t keys,
+                                      uint8_t *col_rows,
+                                      uint8_t *row_cols) {
+    for (uint8_t lc = 0; lc < comp.numCols; ++lc) {
+        col_rows[lc] = 0;
+    }
+    for (uint8_t lr = 0; lr < comp.numRows; ++lr) {
+        row_cols[lr] = 0;
+    }
+    for (uint8_t k = 0; k < comp.numKeys; ++k) {
+        if (!(keys & (1 << k))) {
             continue;
         }
+        col_rows[comp.keyCol[k]] |= (1 << comp.keyRow[k]);
+        if (!(comp.diodes & (1 << k))) {
+            row_cols[comp.keyRow[k]] |= (1 << comp.keyCol[k]);
+        }
+    }
+}
+
+/*
+ * Whether a set of a component's keys being down would produce exactly
+ * what the scans saw.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::componentMatches(const Component &comp,
+                                              uint8_t keys) {
+    uint8_t col_rows[MAX_COMPONENT_KEYS];
+    uint8_t row_cols[MAX_COMPONENT_KEYS];
+    keyPaths(comp, keys, col_rows, row_cols);
+
+    for (uint8_t lc = 0; lc < comp.numCols; ++lc) {
+        uint8_t reached_cols = (1 << lc);
+        uint8_t reached_rows = 0;
+        componentReach(comp, col_rows, row_cols, &reached_cols, &reached_rows);
+        if (reached_rows != comp.colRowsSeen[lc]) {
+            return false;
+        }
+        if (comp.rescanned && reached_cols != comp.colColsSeen[lc]) {
+            return false;
+        }
+    }
+    if (!comp.rescanned) {
+        return true;
+    }
+    for (uint8_t lr = 0; lr < comp.numRows; ++lr) {
+        uint8_t reached_cols = row_cols[lr];
+        uint8_t reached_rows = (1 << lr);
+        componentReach(comp, col_rows, row_cols, &reached_cols, &reached_rows);
+        if (reached_cols != comp.rowColsSeen[lr]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Extend the columns and rows reached through a component's keys until no
+ * more can be reached.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+void
+KbdDiodeImpl<NC, NR, ImplT>::componentReach(const Component &comp,
+                                            const uint8_t *col_rows,
+                                            const uint8_t *row_cols,
+                                            uint8_t *reached_cols,
+                                            uint8_t *reached_rows) {
+    uint8_t prev_cols = 0;
+    while (*reached_cols != prev_cols) {
+        prev_cols = *reached_cols;
+        for (uint8_t lc = 0; lc < comp.numCols; ++lc) {
+            if (prev_cols & (1 << lc)) {
+                *reached_rows |= col_rows[lc];
+            }
+        }
+        for (uint8_t lr = 0; lr < comp.numRows; ++lr) {
+            if (*reached_rows & (1 << lr)) {
+                *reached_cols |= row_cols[lr];
+            }
+        }
+    }
+}
 
-        if (!resolveRect(r.col_a, r.col_b, r.row_a, r.row_b)) {
-            performBlocking(r.col_a, r.col_b, r.row_a, r.row_b);
+/*
+ * Pick the bits listed in ids out of a bitmap, as a component-local mask.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint8_t
+KbdDiodeImpl<NC, NR, ImplT>::localBits(const uint8_t *bytes,
+                                       const uint8_t *ids,
+                                       uint8_t num_ids) {
+    uint8_t local = 0;
+    for (uint8_t n = 0; n < num_ids; ++n) {
+        if (bytes[ids[n] >> 3] & (1 << (ids[n] & 0x7))) {
+            local |= (1 << n);
         }
     }
+    return local;
 }
 #else
 template<uint8_t NC, uint8_t NR, typename ImplT>
 void
-KbdDiodeImpl<NC, NR, ImplT>::resolveGhosting() {
+KbdDiodeImpl<NC, NR, ImplT>::resolveGhosting(uint8_t col_begin,
+                                             uint8_t col_end,
+                                             uint8_t row_begin,
+                                             uint8_t row_end) {
     // Walk through the keys, and look for rectangles where all 4 corners
     // are pressed.  In these cases, 1 corner might not really be pressed,
     // but was simply detected due to ghosting.
     //
-    // This process is O(N^2) in the worst case (where N is the total number of
-    // keys).  However, in the common case where very few keys are pressed it
-    // is close to O(N).  (It is O(N + K*N), where K is the number of keys
-    // pressed.)
-
-    for (uint8_t col_a = 0; col_a < NUM_COLS; ++col_a) {
-        for (uint8_t row_a = 0; row_a < NUM_ROWS; ++row_a) {
-            auto idx_aa = getIndex(col_a, row_a);
-            if (!_curMap->get(idx_aa)) {
-                continue;
-            }
+    // Rather than testing every candidate corner one bit at a time, keep a
+    // bitmask of the columns that are down in each row.  For each pair of
+    // keys down in a column, ANDing the two rows' masks yields every column
+    // that completes a rectangle with them.  This makes the search
+    // O(C * K^2 * C/8) byte operations, where C is the number of columns and
+    // K is the most keys down in any one column.
+    //
+    // Rectangles are visited in the same order as a plain nested loop over
+    // (col_a, row_a, row_b, col_b), and blocking one rectangle can stop a
+    // later one from being found, so the masks are kept in sync with _curMap
+    // as keys are blocked.
+    ColMap rowCols[NUM_ROWS];
+    for (uint8_t col = col_begin; col < col_end; ++col) {
+        const uint8_t *colBytes = _curMap->bytes + (col * ROW_BYTES);
+        for (uint8_t row = nextBit(colBytes, row_begin, row_end);
+             row < row_end;
+             row = nextBit(colBytes, row + 1, row_end)) {
+            rowCols[row].set(col);
+        }
+    }
 
+    for (uint8_t col_a = col_begin; col_a < col_end; ++col_a) {
+        const uint8_t *colBytes = _curMap->bytes + (col_a * ROW_BYTES);
+        for (uint8_t row_a = nextBit(colBytes, row_begin, row_end);
+             row_a < row_end;
+             row_a = nextBit(colBytes, row_a + 1, row_end)) {
             // Look for another row_a down on this column
-            for (uint8_t row_b = row_a + 1; row_b < NUM_ROWS; ++row_b) {
-                auto idx_ab = getIndex(col_a, row_b);
-                if (!_curMap->get(idx_ab)) {
-                    continue;
+            for (uint8_t row_b = nextBit(colBytes, row_a + 1, row_end);
+                 row_b < row_end;
+                 row_b = nextBit(colBytes, row_b + 1, row_end)) {
+                // aa and ab are both down.
+                // Find all other columns with both ba and bb down.  Blocking
+                // only changes col_a and col_b, so this stays accurate for
+                // the rest of the loop.
+                ColMap both;
+                for (uint8_t n = 0; n < ColMap::NUM_BYTES; ++n) {
+                    both.bytes[n] =
+                        rowCols[row_a].bytes[n] & rowCols[row_b].bytes[n];
                 }
 
-                // aa and ab are both down.
-                // Look for another column with both ba and bb down
-                for (uint8_t col_b = col_a + 1; col_b < NUM_COLS; ++col_b) {
-                    auto idx_ba = getIndex(col_b, row_a);
-                    auto idx_bb = getIndex(col_b, row_b);
-                    if (_curMap->get(idx_ba) && _curMap->get(idx_bb)) {
-                        // Found a rectangle
-                        FLOG(4, "Found rectangle (%d, %d) x (%d, %d)\n",
-                             col_a, row_a, col_b, row_b);
-
-                        performBlocking(col_a, col_b, row_a, row_b);
-                    }
+                for (uint8_t col_b = nextBit(both.bytes, col_a + 1, col_end);
+                     col_b < col_end;
+                     col_b = nextBit(both.bytes, col_b + 1, col_end)) {
+                    // Found a rectangle
+                    FLOG(4, "Found rectangle (%d, %d) x (%d, %d)\n",
+                         col_a, row_a, col_b, row_b);
+
+                    performBlocking(col_a, col_b, row_a, row_b);
+                    rowCols[row_a].set(col_a,
+                                       _curMap->get(getIndex(col_a, row_a)));
+                    rowCols[row_b].set(col_a,
+                                       _curMap->get(getIndex(col_a, row_b)));
+                    rowCols[row_a].set(col_b,
+                                       _curMap->get(getIndex(col_b, row_a)));
+                    rowCols[row_b].set(col_b,
+                                       _curMap->get(getIndex(col_b, row_b)));
                 }
             }
         }
@@ -267,6 +2015,35 @@ KbdDiodeImpl<NC, NR, ImplT>::resolveGhosting() {
 }
 #endif
 
+/*
+ * Find the first bit set in a bitmap at or after pos, and before end.
+ *
+ * Returns end if there is none.  end must be no more than 255.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+uint8_t
+KbdDiodeImpl<NC, NR, ImplT>::nextBit(const uint8_t *bytes,
+                                     uint8_t pos,
+                                     uint8_t end) {
+    while (pos < end) {
+        uint8_t value = bytes[pos >> 3] >> (pos & 0x7);
+        if (value == 0) {
+            // Skip the rest of this byte.
+            if ((pos | 0x7) >= end) {
+                break;
+            }
+            pos = (pos | 0x7) + 1;
+            continue;
+        }
+        while (!(value & 1)) {
+            value >>= 1;
+            ++pos;
+        }
+        return pos < end ? pos : end;
+    }
+    return end;
+}
+
 template<uint8_t NC, uint8_t NR, typename ImplT>
 void
 KbdDiodeImpl<NC, NR, ImplT>::performBlocking(uint8_t col_a, uint8_t col_b,
@@ -299,6 +2076,33 @@ KbdDiodeImpl<NC, NR, ImplT>::performBlocking(uint8_t col_a, uint8_t col_b,
     }
 }
 
+/*
+ * Whether the key at (col, row) has a diode.
+ *
+ * The diode map has the same layout as a KeyMap, and lives in program
+ * memory.
+ */
+template<uint8_t NC, uint8_t NR, typename ImplT>
+bool
+KbdDiodeImpl<NC, NR, ImplT>::hasDiode(uint8_t col, uint8_t row) const {
+    typedef KeyTable<typename ImplT::Diodes, ROW_STRIDE,
+                     typename MakeByteSeq<KeyMap::NUM_BYTES>::Type> DiodeMap;
+    const KeyIndex idx = getIndex(col, row);
+    return pgm_read_byte(DiodeMap::bytes + (idx >> 3)) & (1 << (idx & 0x7));
+}
+
+/*
+ * Resolve ghosting on a single rectangle, using the diodes on its corners.
+ *
+ * Returns false if the diodes don't allow it to be resolved.
+ *
+ * The diode pattern on the corners indexes a table of actions.  Most
+ * patterns can only be resolved by blocking some of the corners, and for
+ * those the action is the mask of corners to block, which is applied
+ * without any branching.  A single diode, or two diagonal ones, allow more
+ * to be worked out with reverse scans, and those patterns go to
+ * ghost1Diode() or ghost2DiodesDiag().
+ */
 template<uint8_t NC, uint8_t NR, typename ImplT>
 bool
 KbdDiodeImpl<NC, NR, ImplT>::resolveRect(uint8_t col_a, uint8_t col_b,
@@ -306,81 +2110,87 @@ KbdDiodeImpl<NC, NR, ImplT>::resolveRect(uint8_t col_a, uint8_t col_b,
     FLOG(3, "attemping to resolve ghosting on rectangle (%d, %d) x (%d, %d)\n",
          col_a, row_a, col_b, row_b);
 
-    // Check to see which keys have diodes.
-    bool diode_aa = _diodes[getIndex(col_a, row_a)];
-    bool diode_ab = _diodes[getIndex(col_a, row_b)];
-    bool diode_ba = _diodes[getIndex(col_b, row_a)];
-    bool diode_bb = _diodes[getIndex(col_b, row_b)];
-    uint8_t num_diodes =
-        static_cast<uint8_t>(diode_aa) +
-        static_cast<uint8_t>(diode_ab) +
-        static_cast<uint8_t>(diode_ba) +
-        static_cast<uint8_t>(diode_bb);
-
-    // If there are no diodes we can't resolve ghosting
-    if (num_diodes == 0) {
-        FLOG(3, "  No diodes: unable to resolve ghosting\n");
-        return false;
-    }
+    typedef KeyTable<typename ImplT::Diodes, ROW_STRIDE,
+                     typename MakeByteSeq<KeyMap::NUM_BYTES>::Type> DiodeMap;
+    const KeyIndex idx[4] = {
+        getIndex(col_a, row_a),
+        getIndex(col_a, row_b),
+        getIndex(col_b, row_a),
+        getIndex(col_b, row_b),
+    };
 
-    // If there are diodes on all 4 keys then all 4 must actually be down.
-    if (num_diodes == 4) {
-        FLOG(3, "  4 diodes: all keys valid\n");
-        return true;
+    // Look up which corners have diodes, and which were reported by the
+    // previous scan, as CORNER_* masks.
+    uint8_t diodes = 0;
+    uint8_t reported = 0;
+    for (uint8_t k = 0; k < 4; ++k) {
+        const uint8_t byte = idx[k] >> 3;
+        const uint8_t bit = idx[k] & 0x7;
+        diodes |= ((pgm_read_byte(DiodeMap::bytes + byte) >> bit) & 1) << k;
+        reported |= ((_prevMap->bytes[byte] >> bit) & 1) << k;
     }
 
-    // Single diode: we should be able to detect ghosting
-    // on any key except for the key with the diode.
-    if (num_diodes == 1) {
-        // No matter where the diode is, we can reorder the arguments to
-        // ghost1Diode() so that ghost1Diode always sees the diode on
-        // (col_a, row_a)
-        if (diode_aa) {
-            return ghost1Diode(col_a, col_b, row_a, row_b);
-        } else if (diode_ab) {
-            return ghost1Diode(col_a, col_b, row_b, row_a);
-        } else if (diode_ba) {
-            return ghost1Diode(col_b, col_a, row_a, row_b);
-        } else { // diode_bb
-            return ghost1Diode(col_b, col_a, row_b, row_a);
-        }
-    }
-
-    // 2 diodes
-    if (num_diodes == 2) {
-        // There are several cases to consider here:
-        // - The diodes are both on the same column
-        // - The diodes are both on the same row
-        // - The diodes are on opposite diagonals
-        if (diode_aa && diode_ab) {
-            return ghost2DiodesCol(col_a, col_b, row_a, row_b);
-        } else if (diode_ba && diode_bb) {
-            return ghost2DiodesCol(col_b, col_a, row_a, row_b);
-        } else if (diode_aa && diode_ba) {
-            return ghost2DiodesRow(col_a, col_b, row_a, row_b);
-        } else if (diode_ab && diode_bb) {
-            return ghost2DiodesRow(col_a, col_b, row_b, row_a);
-        } else if (diode_aa) {
+    // For each diode pattern, either the corners to block and whether that
+    // resolves the rectangle, or which reverse scan function to use and how
+    // to reorder the corners so it sees the diodes where it expects them:
+    //
+    // - ghost1Diode() expects the diode on (col_a, row_a).
+    // - ghost2DiodesDiag() expects the diodes on (col_a, row_a) and
+    //   (col_b, row_b).
+    //
+    // With 2 diodes in a column or a row, the other keys are protected by
+    // them, but the keys with the diodes can't be told apart from ghosts.
+    // With 3 diodes only the corner opposite the one without a diode can be
+    // a ghost.  With none nothing can be resolved, and with 4 all the keys
+    // must be down.
+    static const uint8_t PROGMEM actions[16] = {
+        0,                                              // none
+        RESCAN_1,                                       // aa
+        RESCAN_1 | SWAP_ROWS,                           // ab
+        CORNER_AA | CORNER_AB,                          // aa ab
+        RESCAN_1 | SWAP_COLS,                           // ba
+        RESOLVED | CORNER_AA | CORNER_BA,               // aa ba
+        RESCAN_DIAG | SWAP_COLS,                        // ab ba
+        CORNER_AA,                                      // aa ab ba
+        RESCAN_1 | SWAP_COLS | SWAP_ROWS,               // bb
+        RESCAN_DIAG,                                    // aa bb
+        RESOLVED | CORNER_AB | CORNER_BB,               // ab bb
+        CORNER_AB,                                      // aa ab bb
+        CORNER_BA | CORNER_BB,                          // ba bb
+        CORNER_BA,                                      // aa ba bb
+        CORNER_BB,                                      // ab ba bb
+        RESOLVED,                                       // all
+    };
+    const uint8_t action = pgm_read_byte(actions + diodes);
+
+    if (action & (RESCAN_1 | RESCAN_DIAG)) {
+        const uint8_t swap_cols = (action & SWAP_COLS) ? col_a ^ col_b : 0;
+        const uint8_t swap_rows = (action & SWAP_ROWS) ? row_a ^ row_b : 0;
+        col_a ^= swap_cols;
+        col_b ^= swap_cols;
+        row_a ^= swap_rows;
+        row_b ^= swap_rows;
+        if (action & RESCAN_DIAG) {
             return ghost2DiodesDiag(col_a, col_b, row_a, row_b);
-        } else {
-            return ghost2DiodesDiag(col_b, col_a, row_a, row_b);
         }
-        // Unreachable
-        return false;
+        // Single diode: we should be able to detect ghosting
+        // on any key except for the key with the diode.
+        return ghost1Diode(col_a, col_b, row_a, row_b);
     }
 
-    // 3 diodes
-    if (diode_aa) {
-        return ghost3Diodes(col_a, col_b, row_a, row_b);
-    } else if (diode_ab) {
-        return ghost3Diodes(col_a, col_b, row_b, row_a);
-    } else if (diode_ba) {
-        return ghost3Diodes(col_b, col_a, row_a, row_b);
-    } else { // diode_bb
-        return ghost3Diodes(col_b, col_a, row_b, row_a);
+    // Block the corners in the action's mask, keeping any key that was
+    // reported in the previous scan.  Only report keys in this rectangle if
+    // they were reported in the previous scan iteration.  This means we
+    // might not report a key that is actually pressed, but it's better than
+    // reporting a key that isn't pressed.
+    FLOG(3, "  Diodes 0x%x: blocking corners 0x%x\n",
+         diodes, action & CORNER_MASK);
+    const uint8_t drop = action & CORNER_MASK & ~reported;
+    for (uint8_t k = 0; k < 4; ++k) {
+        _curMap->bytes[idx[k] >> 3] &=
+            ~(((drop >> k) & 1) << (idx[k] & 0x7));
     }
-    // Unreachable
-    return false;
+    return action & RESOLVED;
 }
 
 // Detect ghosting with a single diode at (col_a, row_a)
@@ -391,13 +2201,15 @@ KbdDiodeImpl<NC, NR, ImplT>::ghost1Diode(uint8_t col_a, uint8_t col_b,
     FLOG(3, "  Resolving ghosting with 1 diode at (%d, %d)\n",
          col_a, row_a);
 
+    _memoSkip = true;
+
     // Re-scan both columns, to see if the ghosting is still present.
     // Some time has elapsed since the initial scan, and the user may have
     // lifted off a key already.  If this has occurred, we may make the wrong
     // ghosting decision if we don't detect it.
     RowMap rows;
     _prepareColScan(col_a);
-    _delay_us(5);
+    settleAll();
     _readRows(&rows);
     if (!rows.get(row_a)) {
         FLOG(3, "  Key lifted off (%d, %d)\n", col_a, row_a);
@@ -411,7 +2223,7 @@ KbdDiodeImpl<NC, NR, ImplT>::ghost1Diode(uint8_t col_a, uint8_t col_b,
     }
 
     _prepareColScan(col_b);
-    _delay_us(5);
+    settleAll();
     _readRows(&rows);
     if (!rows.get(row_a)) {
         FLOG(3, "  Key lifted off (%d, %d)\n", col_b, row_a);
@@ -438,7 +2250,7 @@ KbdDiodeImpl<NC, NR, ImplT>::ghost1Diode(uint8_t col_a, uint8_t col_b,
     // Scan row_a.  We should either see both col_a and col_b, or neither.
     // If we see neither, then BA is up.
     _prepareRowScan(row_a);
-    _delay_us(5);
+    settleAll();
     _readCols(&cols);
     _finishRowScan();
     if (!cols.get(col_a)) {
@@ -461,48 +2273,6 @@ KbdDiodeImpl<NC, NR, ImplT>::ghost1Diode(uint8_t col_a, uint8_t col_b,
     return true;
 }
 
-// Detect ghosting with diodes at (col_a, row_a) and (col_a, row_b)
-template<uint8_t NC, uint8_t NR, typename ImplT>
-bool
-KbdDiodeImpl<NC, NR, ImplT>::ghost2DiodesCol(uint8_t col_a, uint8_t col_b,
-                                             uint8_t row_a, uint8_t row_b) {
-    FLOG(3, "  2 diodes in col %d\n", col_a);
-    // The keys in col B are protected by the diodes, and are definitely down.
-    // Unfortunately we can't tell about the keys in col A, so perform blocking
-    // for them.
-    auto idx_aa = getIndex(col_a, row_a);
-    if (!_prevMap->get(idx_aa)) {
-        _curMap->unset(idx_aa);
-    }
-    auto idx_ab = getIndex(col_a, row_b);
-    if (!_prevMap->get(idx_ab)) {
-        _curMap->unset(idx_ab);
-    }
-    return false;
-    (void)col_b;
-}
-
-// Detect ghosting with diodes at (col_a, row_a) and (col_b, row_a)
-template<uint8_t NC, uint8_t NR, typename ImplT>
-bool
-KbdDiodeImpl<NC, NR, ImplT>::ghost2DiodesRow(uint8_t col_a, uint8_t col_b,
-                                             uint8_t row_a, uint8_t row_b) {
-    FLOG(3, "  2 diodes in row %d\n", row_a);
-    // The keys in row B are protected by the diodes, and are definitely down.
-    // Unfortunately we can't tell about the keys in row A, so perform blocking
-    // for them.
-    auto idx_aa = getIndex(col_a, row_a);
-    if (!_prevMap->get(idx_aa)) {
-        _curMap->unset(idx_aa);
-    }
-    auto idx_ba = getIndex(col_b, row_a);
-    if (!_prevMap->get(idx_ba)) {
-        _curMap->unset(idx_ba);
-    }
-    return true;
-    (void)row_b;
-}
-
 // Detect ghosting with diodes at (col_a, row_a) and (col_b, row_b)
 template<uint8_t NC, uint8_t NR, typename ImplT>
 bool
@@ -512,9 +2282,10 @@ KbdDiodeImpl<NC, NR, ImplT>::ghost2DiodesDiag(uint8_t col_a, uint8_t col_b,
          col_a, row_a, col_b, row_b);
     // AA and BB are definitely down, we only need to worry about AB and BA.
     // Scan row_a.  We will see col_b if and only if BA is pressed.
+    _memoSkip = true;
     ColMap cols;
     _prepareRowScan(row_a);
-    _delay_us(5);
+    settleAll();
     _readCols(&cols);
     _finishRowScan();
     // 3 possibilities:
@@ -534,22 +2305,3 @@ KbdDiodeImpl<NC, NR, ImplT>::ghost2DiodesDiag(uint8_t col_a, uint8_t col_b,
     // All 4 keys in the rectangle are actually pressed.
     return true;
 }
-
-// Detect ghosting with 3 diodes.
-// Only (col_a, row_a) doesn't have a diode.
-template<uint8_t NC, uint8_t NR, typename ImplT>
-bool
-KbdDiodeImpl<NC, NR, ImplT>::ghost3Diodes(uint8_t col_a, uint8_t col_b,
-                                          uint8_t row_a, uint8_t row_b) {
-    FLOG(3, "  Resolving ghosting with 3 diodes\n");
-    // We only need to detect ghosting for (col_b, row_b).
-    // All other keys are protected by the diode on the opposite corner.
-    // Unfortunately we can't tell if BB is pressed, so perform blocking on it.
-    auto idx_bb = getIndex(col_b, row_b);
-    if (!_prevMap->get(idx_bb)) {
-        _curMap->unset(idx_bb);
-    }
-    return false;
-    (void)col_a;
-    (void)row_a;
-}
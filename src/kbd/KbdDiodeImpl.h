@@ -1,8 +1,105 @@
 // Copyright (c) 2013, Adam Simpkins
 #pragma once
 
+#include <avrpp/atomic.h>
 #include <avrpp/bitmap.h>
 #include <avrpp/kbd/Keyboard.h>
+#include <avrpp/progmem.h>
+
+/*
+ * Compile-time lists of matrix keys.
+ *
+ * An ImplT describes sets of keys with these, such as the keys with diodes
+ * installed or the keys that need slower debouncing.  KbdDiodeImpl turns
+ * each list into a bitmap in program memory:
+ *
+ *   typedef KeyList<MatrixKey<4, 16>, MatrixKey<3, 7>> SlowKeys;
+ */
+template<uint8_t C, uint8_t R>
+struct MatrixKey {
+    static constexpr uint8_t COL = C;
+    static constexpr uint8_t ROW = R;
+};
+
+template<typename... Keys>
+struct KeyList;
+
+template<>
+struct KeyList<> {
+    static constexpr uint8_t mapByte(uint8_t, uint8_t) {
+        return 0;
+    }
+    template<uint8_t NC, uint8_t NR>
+    static constexpr bool fits() {
+        return true;
+    }
+};
+
+template<typename First, typename... Rest>
+struct KeyList<First, Rest...> {
+    typedef KeyList<Rest...> Tail;
+
+    /*
+     * Byte n of a column-major key map with the specified number of bits per
+     * column, with the bit for each key set.
+     */
+    static constexpr uint8_t mapByte(uint8_t n, uint8_t stride) {
+        return (((First::COL * stride) + First::ROW) >> 3 == n ?
+                static_cast<uint8_t>(1 << (First::ROW & 0x7)) : 0) |
+            Tail::mapByte(n, stride);
+    }
+
+    /*
+     * Whether all of the keys are within an NC x NR matrix.
+     */
+    template<uint8_t NC, uint8_t NR>
+    static constexpr bool fits() {
+        return First::COL < NC && First::ROW < NR &&
+            Tail::template fits<NC, NR>();
+    }
+};
+
+/*
+ * The keys with diodes installed are listed with the same templates, under
+ * names that read better in a Diodes typedef:
+ *
+ *   typedef DiodeList<Diode<1, 17>, Diode<6, 17>> Diodes;
+ */
+template<uint8_t C, uint8_t R>
+using Diode = MatrixKey<C, R>;
+template<typename... Diodes>
+using DiodeList = KeyList<Diodes...>;
+
+/*
+ * ByteSeq<0, 1, ..., N - 1>, as MakeByteSeq<N>::Type.
+ */
+template<uint8_t... N>
+struct ByteSeq {};
+
+template<uint8_t COUNT, uint8_t... N>
+struct MakeByteSeq : MakeByteSeq<COUNT - 1, COUNT - 1, N...> {};
+
+template<uint8_t... N>
+struct MakeByteSeq<0, N...> {
+    typedef ByteSeq<N...> Type;
+};
+
+/*
+ * The bitmap of a KeyList, stored in program memory.
+ */
+template<typename List, uint8_t STRIDE, typename Seq>
+struct KeyTable;
+
+template<typename List, uint8_t STRIDE, uint8_t... N>
+struct KeyTable<List, STRIDE, ByteSeq<N...>> {
+    static const uint8_t bytes[sizeof...(N)] PROGMEM;
+};
+
+template<typename List, uint8_t STRIDE, uint8_t... N>
+const uint8_t
+KeyTable<List, STRIDE, ByteSeq<N...>>::bytes[sizeof...(N)] PROGMEM = {
+    List::mapByte(N, STRIDE)...
+};
 
 /*
  * A Keyboard implementation for keyboards that have diodes on a subset of
@@ -17,27 +114,323 @@
  * have to perform blocking to avoid ghosting.)
  */
 template<uint8_t NUM_COLS_T, uint8_t NUM_ROWS_T, typename ImplT>
-class KbdDiodeImpl : public Keyboard {
+class KbdDiodeImpl : public Keyboard, private ScanScheduler::SliceCallback {
   public:
     enum : uint8_t {
         NUM_COLS = NUM_COLS_T,
         NUM_ROWS = NUM_ROWS_T,
     };
 
-    KbdDiodeImpl() {}
+    enum : uint16_t {
+        // The default timing window for ghosting re-scans, in microseconds.
+        DEFAULT_RESCAN_WINDOW_US = 500,
+    };
+    enum : uint8_t {
+        // The default number of consecutive scans with no keys down before
+        // entering idle mode.
+        DEFAULT_IDLE_HOLDOFF = 50,
+        // The default number of scans a column stays hot after it last had a
+        // key down, when adaptive scanning is enabled.
+        DEFAULT_HOT_HOLDOFF = 100,
+    };
+
+    enum : uint8_t {
+        // An ImplT may redefine these to describe a split matrix made of two
+        // electrically independent halves: columns [0, SPLIT_COLS) are only
+        // wired to rows [0, SPLIT_ROWS), and the remaining columns only to
+        // the remaining rows.  scanKeys() then drives one column in each
+        // half at the same time, and resolves ghosting for each half
+        // separately.
+        //
+        // 0 means the matrix is not split.
+        SPLIT_COLS = 0,
+        SPLIT_ROWS = 0,
+    };
+    enum : uint16_t {
+        // An ImplT may redefine this to change how long ghosting resolution
+        // may run in each scanKeys() call, in microseconds.  Work that
+        // doesn't fit is carried over to the next scan, and the keys
+        // involved keep their previously reported state until then.
+        //
+        // The budget is checked before each connected component of
+        // rectangles is worked on, and between the re-scan attempts and
+        // search batches within one.  Finding the rectangles is not
+        // budgeted, so the worst case for scanKeys() is the sum of:
+        // - the column scan: one line read per column,
+        // - the rectangle search: one visit per key down, and one bitmask
+        //   AND per pair of rows with 2 or more keys down,
+        // - RESOLVE_BUDGET_US,
+        // - one more unit of work: finding a component (one visit per key
+        //   down in it), up to MAX_COMPONENT_KEYS reachability checks, a
+        //   re-scan pass (at most 2 * 8 column signals of 2 line reads
+        //   each, and 8 row reads), and 4 candidate states,
+        // - and blocking the rectangles left when the budget runs out: one
+        //   visit per corner.
+        //
+        // The first component in each scan is worked on even if the
+        // rectangle search has already used up the budget, so that deferred
+        // work always progresses.  ScanStats::maxResolveTicks records the
+        // longest resolution actually seen, and test/kbd/GhostingBench
+        // checks the line reads against this bound on adversarial key
+        // patterns.
+        RESOLVE_BUDGET_US = 500,
+    };
+    enum : uint8_t {
+        // Passed to prepareSplitColScan() for a half with no column to scan.
+        NO_COL = 0xff,
+    };
+
+    // An ImplT may redefine this to list the keys that have diodes.
+    typedef DiodeList<> Diodes;
+    // An ImplT may redefine this to list the keys debounced with the
+    // DEBOUNCE_SLOW thresholds, such as stabilized keys that bounce longer.
+    typedef KeyList<> SlowKeys;
+
+    enum : uint8_t {
+        // Debounce key classes, for setDebounce().
+        DEBOUNCE_NORMAL = 0,
+        DEBOUNCE_SLOW = 1,
+        NUM_DEBOUNCE_CLASSES = 2,
+        // The debounce counters are 3 bits wide.
+        DEBOUNCE_BITS = 3,
+        MAX_DEBOUNCE_SCANS = (1 << DEBOUNCE_BITS) - 1,
+        // By default presses are reported as soon as they are seen, and
+        // releases once seen in 2 consecutive scans.
+        DEFAULT_PRESS_SCANS = 1,
+        DEFAULT_RELEASE_SCANS = 2,
+    };
+
+    KbdDiodeImpl();
 
     virtual bool scanKeys() override;
+    virtual bool isIdle() const override {
+        return _sliced ? _sliceIdle : _idle;
+    }
+
+    /*
+     * Enable the sliced scan engine.
+     *
+     * In sliced mode the ScanScheduler's timer interrupt reads one column
+     * and signals the next on each tick, spreading the port I/O evenly over
+     * the scan period and sampling each column at a fixed point in it.
+     * Completed frames are double buffered, and scanKeys() only performs
+     * the processing: ghosting resolution and idle tracking.  Idle mode is
+     * also handled in the interrupt, which simply checks the rows on each
+     * tick while idle.
+     *
+     * Ghosting is resolved from the frame data and diodes alone in sliced
+     * mode, since a reverse scan from the main loop would interfere with
+     * the interrupt.
+     * Adaptive scanning and split matrices are not supported in sliced mode.
+     *
+     * This must be called before loop(), and the keyboard must then be
+     * driven by loop() rather than by calling scanKeys() directly.
+     */
+    void setSlicedScan(bool enabled) {
+        _sliced = enabled && ImplT::SPLIT_COLS == 0;
+        // Sliced mode resolves ghosting without reverse scans, so earlier
+        // decisions may not hold.
+        _memoValid = false;
+    }
+    virtual ScanScheduler::SliceCallback *
+    getSliceCallback(uint8_t *numSlices) override;
+
+    virtual bool prepareSuspendScan() override;
+    virtual bool checkSuspendScan() override;
+
+    /*
+     * Set the number of consecutive scans with no keys down that must occur
+     * before entering idle mode.
+     *
+     * In idle mode all columns are signalled at once, and scanKeys() simply
+     * reads the rows to check for any activity, rather than scanning each
+     * column individually.  As soon as any row is seen active a full scan is
+     * performed in the same scanKeys() call, so idle mode does not add any
+     * latency to the first key press.
+     *
+     * The rows are still checked on every scan tick, rather than sleeping
+     * until a pin-change interrupt: most of the row lines on our boards are
+     * on pins that can't raise one.
+     *
+     * A holdoff of 0 disables idle mode.
+     */
+    void setIdleHoldoff(uint8_t scans) {
+        _idleHoldoff = scans;
+    }
+
+    /*
+     * Configure adaptive scanning.
+     *
+     * When fullScanInterval is greater than 1, only hot columns are scanned
+     * on most calls to scanKeys(), and the whole matrix is swept once every
+     * fullScanInterval calls.  A column is hot if it has had a key down
+     * within the last hotHoldoff scans.  A press on a cold column is
+     * therefore detected within fullScanInterval scans.
+     *
+     * Any new key seen on a hot column triggers an immediate full scan, so
+     * that ghosting involving keys on cold columns is still resolved
+     * correctly.  A press while in idle mode is also always detected by a
+     * full scan.
+     *
+     * A fullScanInterval of 0 or 1 disables adaptive scanning.
+     * Adaptive scanning is not used for split matrices.
+     */
+    void setAdaptiveScan(uint8_t fullScanInterval,
+                         uint8_t hotHoldoff = DEFAULT_HOT_HOLDOFF) {
+        _fullScanInterval = fullScanInterval;
+        // A column with keys down must always be hot
+        _hotHoldoff = hotHoldoff ? hotHoldoff : 1;
+    }
+
+    /*
+     * Set the debounce thresholds for a class of keys.
+     *
+     * A key's reported state only changes once the scan has seen the new
+     * state in pressScans consecutive scans for a press, or releaseScans
+     * for a release.  Any scan that sees the old state again restarts the
+     * count.
+     *
+     * A pressScans of 1 selects eager press: a press is reported on the
+     * first scan that sees it, and bounce while the key settles is absorbed
+     * by the release threshold.  Larger values defer presses too, which also
+     * hides keys that appear down in only one scan, such as a ghost of a key
+     * pressed partway through a scan.
+     *
+     * Thresholds are clamped to [1, MAX_DEBOUNCE_SCANS].  1 for both turns
+     * debouncing off for the class.
+     */
+    void setDebounce(uint8_t keyClass, uint8_t pressScans,
+                     uint8_t releaseScans);
+
+    struct ScanStats {
+        // The number of scans that swept every column.
+        uint32_t fullScans{0};
+        // The number of scans that only swept the hot columns.
+        uint32_t partialScans{0};
+        // The number of partial scans that saw a new key down, and were
+        // redone as full scans.  These are also counted in fullScans.
+        uint16_t promotedScans{0};
+        // The number of times a full scan found a key down on a cold column,
+        // and the largest number of scans since that column was previously
+        // scanned.  Multiplying by the scan period gives the worst-case
+        // delay before a cold key press was seen.
+        uint16_t coldDetections{0};
+        uint8_t maxColdLatency{0};
+        // In sliced mode, the number of frames completed by the interrupt
+        // before scanKeys() had processed the previous one.  These frames
+        // are dropped.  The interrupt counts these separately, and
+        // getScanStats() fills this in.
+        uint16_t droppedFrames{0};
+        // The number of scans that needed ghosting resolution, split into
+        // those that reused the memoized result of an identical earlier scan
+        // and those that ran resolveGhosting().
+        uint32_t resolveHits{0};
+        uint32_t resolveMisses{0};
+        // The resolution time avoided by memo hits, in ScanScheduler timer
+        // counts.  Each hit is credited with the measured cost of the miss
+        // that produced its result.
+        uint32_t resolveTicksSaved{0};
+        // The number of ghosting re-scans that were retried because the keys
+        // changed or the re-scan overran the rescan window, and the number
+        // of components left blocked until the next scan after every
+        // attempt failed.
+        uint16_t rescanRetries{0};
+        uint16_t rescanDeferrals{0};
+        // The number of times ghosting work was deferred to a later scan
+        // because the scan's resolution time budget ran out, and the longest
+        // time spent resolving ghosting in one scan, in timer counts.
+        uint16_t resolveDeferrals{0};
+        uint16_t maxResolveTicks{0};
+        // The number of times a key returned to its reported state before
+        // its debounce threshold was reached.
+        uint32_t bouncesFiltered{0};
+    };
+
+    /*
+     * Set the timing window for ghosting re-scans, in microseconds.
+     *
+     * Ghosting resolution re-reads a group of keys forwards, reverse scans
+     * them, and then re-reads them forwards again.  The result is only
+     * trusted if both forward reads match the original scan and the whole
+     * pass took no longer than this window.  It should be comfortably
+     * shorter than the fastest key press, but long enough for a full pass:
+     * roughly 3 line reads per column and row involved.
+     */
+    void setRescanWindow(uint16_t window_us) {
+        _rescanWindowTicks = ScanScheduler::usToTicks(window_us);
+    }
+
+    ScanStats getScanStats() const {
+        ScanStats stats = _scanStats;
+        stats.droppedFrames = getDroppedFrames();
+        return stats;
+    }
+    void resetScanStats() {
+        _scanStats = ScanStats();
+        AtomicGuard ag;
+        _droppedFrames = 0;
+    }
+    virtual void logStats() const override;
+
+    /*
+     * Get the calibrated settle time for a column or row line.
+     *
+     * This is the time needed for the line to return to its inactive state
+     * after we stop driving it, in _delay_loop_1() iterations (3 CPU cycles
+     * each).  These values are measured by calibrate().
+     */
+    uint8_t getColSettle(uint8_t col) const {
+        return _colSettle[col];
+    }
+    uint8_t getRowSettle(uint8_t row) const {
+        return _rowSettle[row];
+    }
     virtual void getState(uint8_t *modifiers,
                           uint8_t *keys,
                           uint8_t *keys_len) const override;
+    virtual uint8_t getEvents(const KeyEvent **events) const override {
+        *events = _events;
+        return _numEvents;
+    }
 
   protected:
     typedef Bitmap<NUM_ROWS> RowMap;
     typedef Bitmap<NUM_COLS> ColMap;
-    typedef Bitmap<NUM_COLS * NUM_ROWS> KeyMap;
 
-    uint8_t getIndex(uint8_t col, uint8_t row) const {
-        return (row * NUM_COLS) + col;
+    enum : uint8_t {
+        // The KeyMap is stored in column-major order, with each column's rows
+        // starting on a byte boundary.  This way the RowMap read for each
+        // column during a scan can be copied directly into the KeyMap a byte
+        // at a time, rather than setting each bit individually.
+        ROW_BYTES = RowMap::NUM_BYTES,
+        ROW_STRIDE = ROW_BYTES * 8,
+        // The valid bits in the last byte of a RowMap.
+        LAST_ROW_MASK = (NUM_ROWS & 0x7) ? ((1 << (NUM_ROWS & 0x7)) - 1) : 0xff,
+    };
+    static_assert(NUM_ROWS <= 248, "too many rows for an 8-bit ROW_STRIDE");
+    typedef Bitmap<NUM_COLS * ROW_STRIDE> KeyMap;
+
+    // KeyIndex is 8 bits wide unless the KeyMap has more than 256 bits,
+    // so small matrices don't pay for 16-bit arithmetic.
+    typedef typename KeyMap::Index KeyIndex;
+    typedef typename IndexTypeFor<NUM_COLS * NUM_ROWS - 1>::Type KeyTableIndex;
+    // Large enough to count every key being pressed at once.
+    typedef typename IndexTypeFor<NUM_COLS * NUM_ROWS>::Type KeyCount;
+
+    /*
+     * Get the index of a key in a KeyMap.
+     */
+    KeyIndex getIndex(uint8_t col, uint8_t row) const {
+        return (static_cast<KeyIndex>(col) * ROW_STRIDE) + row;
+    }
+    /*
+     * Get the index of a key in _keyTable and _modifierTable.
+     *
+     * The key tables are stored in row-major order, which more closely
+     * follows the physical layout of the keyboard.
+     */
+    KeyTableIndex getKeyIndex(uint8_t col, uint8_t row) const {
+        return (static_cast<KeyTableIndex>(row) * NUM_COLS) + col;
     }
 
     // The following functions must be implemented by the ImplT subclass.
@@ -62,19 +455,58 @@ class KbdDiodeImpl : public Keyboard {
     //
     // void readRows(RowMap *rows);
     //   - Read the current row values.
+    //     Bits past NUM_ROWS in the last byte are ignored.
     //
     // void readCols(ColMap *rows);
     //   - Read the current column values.
+    //
+    // void prepareSplitColScan(uint8_t left, uint8_t right);
+    //   - Only used if ImplT defines SPLIT_COLS.
+    //     Signal the specified column in each half of a split matrix, and
+    //     set all other rows and columns to inputs.  Either column may be
+    //     NO_COL, when that half has fewer columns than the other.
+    //     As with prepareColScan(), this may assume that all rows are already
+    //     configured as inputs.
+    //
+    // void prepareIdleScan();
+    //   - Signal all columns at once, with all rows set to inputs.
+    //     A key press on any column will then be visible in readRows().
+    //     As with prepareColScan(), this may assume that all rows are already
+    //     configured as inputs.
+
+    /*
+     * Measure how long each column and row line takes to settle after it
+     * stops being driven, and log the results.
+     *
+     * This should be called at the end of the ImplT's prepare() function,
+     * once all lines have been configured for scanning.
+     */
+    void calibrate();
+
+    /*
+     * Boards that don't define SPLIT_COLS never have prepareSplitColScan()
+     * called, but scanKeys() still needs something to compile against.
+     * A split board must provide its own, which hides this one.
+     */
+    void prepareSplitColScan(uint8_t, uint8_t) {
+        static_assert(ImplT::SPLIT_COLS == 0,
+                      "boards that set SPLIT_COLS must define "
+                      "prepareSplitColScan()");
+    }
 
     pgm_ptr<uint8_t> _keyTable;
     pgm_ptr<uint8_t> _modifierTable;
-    KeyMap _diodes;
 
   private:
     // Forbidden copy constructor and assignment operator
     KbdDiodeImpl(KbdDiodeImpl const &) = delete;
     KbdDiodeImpl& operator=(KbdDiodeImpl const &) = delete;
 
+    uint16_t getDroppedFrames() const {
+        AtomicGuard ag;
+        return _droppedFrames;
+    }
+
     // Helper functions so we can invoke ImplT methods without
     // using virtual function calls.
     void _prepareColScan(uint8_t col) {
@@ -92,25 +524,254 @@ class KbdDiodeImpl : public Keyboard {
     void _readCols(ColMap *cols) {
         return static_cast<ImplT*>(this)->readCols(cols);
     }
+    void _prepareSplitColScan(uint8_t left, uint8_t right) {
+        return static_cast<ImplT*>(this)->prepareSplitColScan(left, right);
+    }
+    void _prepareIdleScan() {
+        return static_cast<ImplT*>(this)->prepareIdleScan();
+    }
+
+    /*
+     * The bits in byte n of a RowMap for rows below limit.
+     */
+    static constexpr uint8_t rowBitsBelow(uint8_t n, uint8_t limit) {
+        return (limit <= n * 8) ? 0 :
+            (limit >= (n + 1) * 8) ? 0xff : (1 << (limit - (n * 8))) - 1;
+    }
+
+    virtual bool onSlice() override;
+    bool processFrame();
+
+    KeyCount scanColumns();
+    KeyCount scanHotColumns();
+    bool hasNewPress() const;
+    void recordColdDetections();
+    void updateHeat();
+    void scanSplitColumns(KeyCount *numLeft, KeyCount *numRight);
+
+    bool debounce();
+    bool updateEvents();
+    void updatePressed();
+    void rebuildPressed();
+
+    bool checkIdle();
+    void updateIdle(bool active);
+    void discardScan();
+
+    enum : uint8_t {
+        // The most times calibration polls a line for it to settle.
+        MAX_SETTLE_POLLS = 64,
+    };
+    uint8_t pollColSettle(uint8_t col);
+    uint8_t pollRowSettle(uint8_t row);
+    uint16_t timeColPolls();
+    uint16_t timeRowPolls();
+    uint8_t measureColSettle(uint8_t col, uint16_t poll_ticks);
+    uint8_t measureRowSettle(uint8_t row, uint16_t poll_ticks);
+    static uint8_t pollsToSettleLoops(uint8_t polls, uint16_t poll_ticks);
+    static void settle(uint8_t loops);
+    void settleAll() {
+        settle(_maxColSettle > _maxRowSettle ? _maxColSettle : _maxRowSettle);
+    }
 
-    void resolveGhosting();
+    void resolveMatrix(KeyCount numLeft, KeyCount numRight);
+    bool memoMatches() const;
+    bool resolveTimeLeft();
+    void deferComponent(uint8_t col);
+    void resolveGhosting(uint8_t col_begin, uint8_t col_end,
+                         uint8_t row_begin, uint8_t row_end);
+    static uint8_t nextBit(const uint8_t *bytes, uint8_t pos, uint8_t end);
     void performBlocking(uint8_t col_a, uint8_t col_b,
                          uint8_t row_a, uint8_t row_b);
+    void blockRectangles(const ColMap *rectCols, const ColMap &cols,
+                         const RowMap &rows,
+                         uint8_t col_begin, uint8_t col_end,
+                         uint8_t row_begin, uint8_t row_end);
+    enum : uint8_t {
+        // The most keys in one connected group of rectangles that
+        // resolveComponent() will try to resolve.  Larger groups are
+        // blocked.
+        MAX_COMPONENT_KEYS = 8,
+    };
+    // A connected group of pressed keys, numbered locally.
+    struct Component {
+        uint8_t numCols;
+        uint8_t numRows;
+        uint8_t numKeys;
+        // The matrix column and row of each local column and row.
+        uint8_t cols[MAX_COMPONENT_KEYS];
+        uint8_t rows[MAX_COMPONENT_KEYS];
+        // The local column and row of each key.
+        uint8_t keyCol[MAX_COMPONENT_KEYS];
+        uint8_t keyRow[MAX_COMPONENT_KEYS];
+        // Bit k is set if key k has a diode.
+        uint8_t diodes;
+        // What the scans saw, as local masks.  Only the original scan is
+        // available unless rescanned is set.
+        bool rescanned;
+        uint8_t colRowsSeen[MAX_COMPONENT_KEYS];
+        uint8_t colColsSeen[MAX_COMPONENT_KEYS];
+        uint8_t rowColsSeen[MAX_COMPONENT_KEYS];
+    };
+    enum : uint8_t {
+        // How many times a ghosting re-scan is tried before the component
+        // is deferred to the next scan.
+        RESCAN_ATTEMPTS = 3,
+    };
+    bool resolveComponent(const ColMap &comp_cols, const RowMap &comp_rows,
+                          uint8_t col_begin, uint8_t col_end,
+                          uint8_t row_begin, uint8_t row_end);
+    bool rescanComponent(Component *comp);
+    bool readComponentCols(const Component &comp, uint8_t *col_cols);
+    bool resolveRectGuarded(const Component &comp);
+    // A component search paused by the time budget, to be resumed by the
+    // next scan if the component is unchanged.
+    struct PendingSearch {
+        Component comp;
+        uint16_t nextState;
+        uint8_t must;
+        uint8_t may;
+        bool valid;
+    };
+    static void keyPaths(const Component &comp, uint8_t keys,
+                         uint8_t *col_rows, uint8_t *row_cols);
+    static bool componentMatches(const Component &comp, uint8_t keys);
+    static void componentReach(const Component &comp,
+                               const uint8_t *col_rows,
+                               const uint8_t *row_cols,
+                               uint8_t *reached_cols, uint8_t *reached_rows);
+    static uint8_t localBits(const uint8_t *bytes, const uint8_t *ids,
+                             uint8_t num_ids);
+    bool hasDiode(uint8_t col, uint8_t row) const;
+    enum : uint8_t {
+        // The corners of a rectangle, for resolveRect()
+        CORNER_AA = 0x01,
+        CORNER_AB = 0x02,
+        CORNER_BA = 0x04,
+        CORNER_BB = 0x08,
+        CORNER_MASK = 0x0f,
+        // resolveRect() actions: either a mask of corners to block, with
+        // RESOLVED if that resolves the rectangle, or a reverse scan
+        // function and how to reorder the corners for it.  The SWAP bits
+        // are only used with a RESCAN bit, and share the corner bits.
+        RESOLVED = 0x10,
+        RESCAN_1 = 0x20,
+        RESCAN_DIAG = 0x40,
+        SWAP_COLS = 0x01,
+        SWAP_ROWS = 0x02,
+    };
     bool resolveRect(uint8_t col_a, uint8_t col_b,
                      uint8_t row_a, uint8_t row_b);
     bool ghost1Diode(uint8_t col_a, uint8_t col_b,
                      uint8_t row_a, uint8_t row_b);
-    bool ghost2DiodesCol(uint8_t col_a, uint8_t col_b,
-                         uint8_t row_a, uint8_t row_b);
-    bool ghost2DiodesRow(uint8_t col_a, uint8_t col_b,
-                         uint8_t row_a, uint8_t row_b);
     bool ghost2DiodesDiag(uint8_t col_a, uint8_t col_b,
                           uint8_t row_a, uint8_t row_b);
-    bool ghost3Diodes(uint8_t col_a, uint8_t col_b,
-                      uint8_t row_a, uint8_t row_b);
 
     KeyMap _mapA;
     KeyMap _mapB;
     KeyMap* _curMap{&_mapA};
     KeyMap* _prevMap{&_mapB};
+
+    bool _idle{false};
+    uint8_t _idleHoldoff{DEFAULT_IDLE_HOLDOFF};
+    uint8_t _emptyScans{0};
+    // The rows already active when USB was suspended.
+    RowMap _suspendRows;
+    // Set by prepareSuspendScan() when it changes the matrix lines under
+    // scanKeys().
+    volatile bool _suspendScanned{false};
+
+    // Settle times, in _delay_loop_1() iterations.
+    // These start out at a conservative default until calibrate() runs.
+    uint8_t _colSettle[NUM_COLS];
+    uint8_t _rowSettle[NUM_ROWS];
+    uint8_t _maxColSettle{0};
+    uint8_t _maxRowSettle{0};
+
+    // Adaptive scanning state.
+    // _colHeat counts down the scans remaining until each column goes cold.
+    uint8_t _fullScanInterval{1};
+    uint8_t _hotHoldoff{DEFAULT_HOT_HOLDOFF};
+    uint8_t _scansSinceFull{0};
+    uint8_t _colHeat[NUM_COLS];
+    ScanStats _scanStats;
+
+    // Debounce state.
+    // _bounce holds a vertical counter for each key: bit k of each key's
+    // count is in _bounce[k].  It counts the consecutive scans that have
+    // seen the key differ from its reported state.
+    //
+    // _debouncePlanes[k] holds bit k of each threshold, as 0x00 or 0xff,
+    // with the slow thresholds stored XORed with the normal ones.
+    struct DebouncePlane {
+        uint8_t press;
+        uint8_t pressSlow;
+        uint8_t release;
+        uint8_t releaseSlow;
+    };
+    KeyMap _bounce[DEBOUNCE_BITS];
+    DebouncePlane _debouncePlanes[DEBOUNCE_BITS];
+    uint8_t _pressScans[NUM_DEBOUNCE_CLASSES];
+    uint8_t _releaseScans[NUM_DEBOUNCE_CLASSES];
+
+    // The events from the last scan, and when each column was sampled in
+    // it, as ScanScheduler::timerCount() values.
+    uint16_t _colTime[NUM_COLS];
+    KeyEvent _events[MAX_EVENTS];
+    uint8_t _numEvents{0};
+
+    // The pressed keys in the order they were pressed, and the modifier
+    // mask, kept up to date from the events for getState().
+    // _numPressed counts every key down, of which the first _numListed are
+    // in _pressed.
+    enum : uint8_t {
+        MAX_PRESSED = 16,
+    };
+    struct PressedKey {
+        KeyIndex idx;
+        uint8_t code;
+        uint8_t modifier;
+    };
+    PressedKey _pressed[MAX_PRESSED];
+    uint8_t _numListed{0};
+    KeyCount _numPressed{0};
+    uint8_t _modifiers{0};
+
+    // Ghosting resolution memo.
+    // _memoIn is the raw scan last passed to resolveGhosting(), and _memoOut
+    // the resolved map it produced, which took _memoCost timer counts.
+    KeyMap _memoIn;
+    KeyMap _memoOut;
+    uint16_t _memoCost{0};
+    bool _memoValid{false};
+    // Set by resolveGhosting() when it used reverse scans, or deferred work
+    // to the next scan.  The result may then change while the raw scan stays
+    // the same, so it isn't memoized.
+    bool _memoSkip{false};
+
+    // Ghosting resolution time budget.
+    // _resolveDeadline is when this scan's budget runs out, as a
+    // ScanScheduler::elapsedInIteration() value.  _resolveStartCol is the
+    // column of the first component deferred by the last scan, or 0.
+    uint16_t _resolveDeadline{0};
+    bool _resolveDeferred{false};
+    bool _resolveStarted{false};
+    uint8_t _resolveStartCol{0};
+    PendingSearch _pending{};
+    uint16_t _rescanWindowTicks{
+        ScanScheduler::usToTicks(DEFAULT_RESCAN_WINDOW_US)};
+
+    // Sliced scanning state.
+    // The interrupt fills _frames[_sliceBack], and hands it off to
+    // scanKeys() by flipping _sliceBack and setting _frameReady.
+    bool _sliced{false};
+    volatile bool _frameReady{false};
+    volatile bool _sliceIdle{false};
+    volatile bool _sliceEnterIdle{false};
+    uint8_t _sliceCol{0};
+    uint8_t _sliceBack{0};
+    KeyMap _frames[2];
+    // ScanStats::droppedFrames, written by the interrupt.  The rest of
+    // _scanStats is only touched by the main loop.
+    volatile uint16_t _droppedFrames{0};
 };
@@ -0,0 +1,436 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <avrpp/kbd/KbdDiodeImpl.h>
+#include <avrpp/pin.h>
+#include <avrpp/progmem.h>
+
+/*
+ * Compile-time descriptions of keyboard matrix wiring.
+ *
+ * A board describes its columns and rows as PinLists of IoPin types, and
+ * derives from KbdMatrixImpl, which generates all of the hooks that
+ * KbdDiodeImpl needs:
+ *
+ *   typedef PinList<IoPin<PinB, 0>, IoPin<PinB, 1>, ...> MyCols;
+ *   typedef PinList<IoPin<PinD, 0>, IoPin<PinD, 1>, ...> MyRows;
+ *
+ *   class MyKeyboard : public KbdMatrixImpl<MyCols, MyRows, MyKeyboard> {
+ *     ...
+ *   };
+ *
+ * Split keyboards made of two independent halves can instead derive from
+ * KbdSplitMatrixImpl, giving a column and row list for each half.
+ *
+ * Line N of the matrix is the Nth pin in its list.  Lines are active low:
+ * the line being scanned is driven low, and all others are inputs with the
+ * pull-up resistor enabled.
+ *
+ * All of the port and bit computations happen at compile time:
+ *
+ * - Each port is accessed once per operation, no matter how many lines it
+ *   carries.
+ * - Reads are split into runs of consecutive bits on the same port, so a
+ *   list that maps a whole port in order is read with a single PINx access,
+ *   and a partial run costs one mask and one constant shift.
+ * - Selecting a single line uses a per-port table of bit masks in program
+ *   memory, indexed by line number, rather than a variable-length shift.
+ *   That is one LPM per port, and no SRAM.
+ * - Ports whose 8 bits all belong to the list are written directly.  Ports
+ *   that are shared with other functions are updated with a
+ *   read-modify-write, so interrupt handlers must not modify other bits on
+ *   those ports.
+ */
+
+template<typename... Pins>
+struct PinList;
+
+template<>
+struct PinList<> {
+    static constexpr uint8_t SIZE = 0;
+
+    template<typename Port>
+    static constexpr uint8_t portMask() {
+        return 0;
+    }
+    template<typename Port, uint8_t BIT>
+    static constexpr uint8_t count() {
+        return 0;
+    }
+    template<typename Other>
+    static constexpr bool disjoint() {
+        return true;
+    }
+    static constexpr bool unique() {
+        return true;
+    }
+};
+
+template<typename First, typename... Rest>
+struct PinList<First, Rest...> {
+    typedef First Head;
+    typedef PinList<Rest...> Tail;
+
+    static constexpr uint8_t SIZE = 1 + sizeof...(Rest);
+
+    /*
+     * The bits of the specified port that are used by this list.
+     */
+    template<typename Port>
+    static constexpr uint8_t portMask() {
+        return (First::Port::PIN_ADDR == Port::PIN_ADDR ?
+                (1 << First::BIT) : 0) |
+            Tail::template portMask<Port>();
+    }
+
+    /*
+     * The number of times the specified pin appears in this list.
+     */
+    template<typename Port, uint8_t BIT>
+    static constexpr uint8_t count() {
+        return (First::Port::PIN_ADDR == Port::PIN_ADDR &&
+                First::BIT == BIT ? 1 : 0) +
+            Tail::template count<Port, BIT>();
+    }
+
+    /*
+     * Whether none of the pins in this list appear in the Other list.
+     */
+    template<typename Other>
+    static constexpr bool disjoint() {
+        return
+            Other::template count<typename First::Port, First::BIT>() == 0 &&
+            Tail::template disjoint<Other>();
+    }
+
+    /*
+     * Whether each pin appears in this list only once.
+     */
+    static constexpr bool unique() {
+        return
+            Tail::template count<typename First::Port, First::BIT>() == 0 &&
+            Tail::unique();
+    }
+};
+
+/*
+ * PinListCat<A, B>::Type is the pins of A followed by the pins of B.
+ */
+template<typename A, typename B>
+struct PinListCat;
+
+template<typename... APins, typename... BPins>
+struct PinListCat<PinList<APins...>, PinList<BPins...>> {
+    typedef PinList<APins..., BPins...> Type;
+};
+
+/*
+ * PinListAt<List, I>::Type is the Ith pin in List.
+ */
+template<typename List, uint8_t I>
+struct PinListAt {
+    typedef typename PinListAt<typename List::Tail, I - 1>::Type Type;
+};
+
+template<typename List>
+struct PinListAt<List, 0> {
+    typedef typename List::Head Type;
+};
+
+/*
+ * The per-line bit masks for one port, stored in program memory.
+ *
+ * bits[N] is the bit for line N if it is on Port, and 0 otherwise.
+ */
+template<typename List, typename Port>
+struct PinListPortBits;
+
+template<typename... Pins, typename Port>
+struct PinListPortBits<PinList<Pins...>, Port> {
+    static const uint8_t bits[sizeof...(Pins)] PROGMEM;
+};
+
+template<typename... Pins, typename Port>
+const uint8_t
+PinListPortBits<PinList<Pins...>, Port>::bits[sizeof...(Pins)] PROGMEM = {
+    (Pins::Port::PIN_ADDR == Port::PIN_ADDR ?
+     static_cast<uint8_t>(1 << Pins::BIT) : static_cast<uint8_t>(0))...
+};
+
+/*
+ * Whether line I + 1 can be read together with line I: it is on the same
+ * port, in the next bit, and in the same byte of the output bitmap.
+ */
+template<typename List, uint8_t I, bool LAST = (I + 1 >= List::SIZE)>
+struct PinListContinues {
+    static constexpr bool value = false;
+};
+
+template<typename List, uint8_t I>
+struct PinListContinues<List, I, false> {
+    typedef typename PinListAt<List, I>::Type A;
+    typedef typename PinListAt<List, I + 1>::Type B;
+
+    static constexpr bool value =
+        ((I + 1) & 0x7) != 0 &&
+        A::Port::PIN_ADDR == B::Port::PIN_ADDR &&
+        B::BIT == A::BIT + 1;
+};
+
+/*
+ * The end (exclusive) of the run of lines starting at line I.
+ */
+template<typename List, uint8_t I,
+         bool CONTINUES = PinListContinues<List, I>::value>
+struct PinListRunEnd {
+    enum : uint8_t { value = PinListRunEnd<List, I + 1>::value };
+};
+
+template<typename List, uint8_t I>
+struct PinListRunEnd<List, I, false> {
+    enum : uint8_t { value = I + 1 };
+};
+
+/*
+ * Read the lines from I onwards into a bitmap, one run at a time.
+ */
+template<typename List, uint8_t I, bool DONE = (I >= List::SIZE)>
+struct PinListReader {
+    static void read(uint8_t *bytes) {
+        typedef typename PinListAt<List, I>::Type Pin;
+        enum : uint8_t {
+            END = PinListRunEnd<List, I>::value,
+            SRC_BIT = Pin::BIT,
+            DEST_BIT = I & 0x7,
+            MASK = ((1 << (END - I)) - 1) << SRC_BIT,
+        };
+
+        uint8_t value = static_cast<uint8_t>(~Pin::Port::pin()) & MASK;
+        if (DEST_BIT >= SRC_BIT) {
+            value <<= (DEST_BIT >= SRC_BIT ? DEST_BIT - SRC_BIT : 0);
+        } else {
+            value >>= (DEST_BIT < SRC_BIT ? SRC_BIT - DEST_BIT : 0);
+        }
+
+        // Each byte of the output starts a new run
+        if (DEST_BIT == 0) {
+            bytes[I >> 3] = value;
+        } else {
+            bytes[I >> 3] |= value;
+        }
+
+        PinListReader<List, END>::read(bytes);
+    }
+};
+
+template<typename List, uint8_t I>
+struct PinListReader<List, I, true> {
+    static void read(uint8_t *) {}
+};
+
+/*
+ * Whether any line before J in List is on Port.
+ */
+template<typename List, typename Port, uint8_t J>
+struct PinListPortBefore {
+    static constexpr bool value =
+        PinListAt<List, J - 1>::Type::Port::PIN_ADDR == Port::PIN_ADDR ||
+        PinListPortBefore<List, Port, J - 1>::value;
+};
+
+template<typename List, typename Port>
+struct PinListPortBefore<List, Port, 0> {
+    static constexpr bool value = false;
+};
+
+/*
+ * Invoke op->apply<Port, MASK>() once for each port used by List,
+ * where MASK is the set of bits on that port belonging to List.
+ */
+template<typename List, uint8_t I = 0, bool DONE = (I >= List::SIZE)>
+struct PinListPorts {
+    template<typename Op>
+    static void apply(Op *op) {
+        typedef typename PinListAt<List, I>::Type::Port Port;
+        if (!PinListPortBefore<List, Port, I>::value) {
+            op->template apply<Port, List::template portMask<Port>()>();
+        }
+        PinListPorts<List, I + 1>::apply(op);
+    }
+};
+
+template<typename List, uint8_t I>
+struct PinListPorts<List, I, true> {
+    template<typename Op>
+    static void apply(Op *) {}
+};
+
+/*
+ * Operations on the set of matrix lines described by a PinList.
+ */
+template<typename List>
+class MatrixLines {
+  public:
+    enum : uint8_t { SIZE = List::SIZE };
+
+    static_assert(SIZE > 0, "a matrix must have at least one line");
+    static_assert(List::unique(), "pin used more than once in a matrix");
+
+    /*
+     * Drive the specified line low, and set all other lines to pull-up
+     * inputs.
+     */
+    static void select(uint8_t line) {
+        SelectOp op{line};
+        PinListPorts<List>::apply(&op);
+    }
+
+    /*
+     * Drive all lines low.
+     */
+    static void selectAll() {
+        SelectAllOp op;
+        PinListPorts<List>::apply(&op);
+    }
+
+    /*
+     * Set all lines to pull-up inputs.
+     */
+    static void release() {
+        ReleaseOp op;
+        PinListPorts<List>::apply(&op);
+    }
+
+    /*
+     * Read the lines into a bitmap, with a 1 bit for each line that is low.
+     * Bits past SIZE in the last byte are set to 0.
+     */
+    static void read(uint8_t *bytes) {
+        PinListReader<List, 0>::read(bytes);
+    }
+
+  private:
+    template<typename Port, uint8_t MASK>
+    static void write(uint8_t selected) {
+        // Set the direction first, so lines being released never drive high.
+        if (MASK == 0xff) {
+            Port::direction() = selected;
+            Port::port() = ~selected;
+        } else {
+            Port::direction() = (Port::direction() & ~MASK) | selected;
+            Port::port() = (Port::port() & ~MASK) | (MASK & ~selected);
+        }
+    }
+
+    struct SelectOp {
+        uint8_t line;
+
+        template<typename Port, uint8_t MASK>
+        void apply() {
+            typedef PinListPortBits<List, Port> Bits;
+            write<Port, MASK>(pgm_read_byte(Bits::bits + line));
+        }
+    };
+    struct SelectAllOp {
+        template<typename Port, uint8_t MASK>
+        void apply() {
+            write<Port, MASK>(MASK);
+        }
+    };
+    struct ReleaseOp {
+        template<typename Port, uint8_t MASK>
+        void apply() {
+            write<Port, MASK>(0);
+        }
+    };
+};
+
+/*
+ * A KbdDiodeImpl whose scanning hooks are generated from PinLists.
+ *
+ * ImplT only needs to provide the key tables and diode locations in its
+ * constructor.  It may override prepare() to perform additional setup, but
+ * should call KbdMatrixImpl::prepare() when doing so.
+ */
+template<typename ColPins, typename RowPins, typename ImplT>
+class KbdMatrixImpl : public KbdDiodeImpl<ColPins::SIZE, RowPins::SIZE,
+                                          ImplT> {
+  public:
+    typedef MatrixLines<ColPins> Cols;
+    typedef MatrixLines<RowPins> Rows;
+    typedef KbdDiodeImpl<ColPins::SIZE, RowPins::SIZE, ImplT> Base;
+    typedef typename Base::RowMap RowMap;
+    typedef typename Base::ColMap ColMap;
+
+    static_assert(ColPins::template disjoint<RowPins>(),
+                  "pin used as both a row and a column");
+
+    virtual void prepare() override {
+        // Columns to output, low.  Rows to input, with pull-up resistors.
+        Cols::selectAll();
+        Rows::release();
+        this->calibrate();
+    }
+
+    // Methods invoked by KbdDiodeImpl
+    void prepareColScan(uint8_t col) {
+        // All rows are already pull-up inputs; see KbdDiodeImpl.
+        Cols::select(col);
+    }
+    void prepareRowScan(uint8_t row) {
+        Cols::release();
+        Rows::select(row);
+    }
+    void finishRowScan() {
+        Rows::release();
+    }
+    void readRows(RowMap *rows) {
+        Rows::read(rows->bytes);
+    }
+    void readCols(ColMap *cols) {
+        Cols::read(cols->bytes);
+    }
+    void prepareIdleScan() {
+        Cols::selectAll();
+    }
+};
+
+/*
+ * A KbdMatrixImpl for a split keyboard, made of two electrically independent
+ * halves.
+ *
+ * The left half's columns and rows come first in the combined matrix,
+ * followed by the right half's.  Each scan step drives one column in each
+ * half at once, so a full scan takes as many steps as the larger half has
+ * columns, rather than the total number of columns.
+ */
+template<typename LeftCols, typename LeftRows,
+         typename RightCols, typename RightRows, typename ImplT>
+class KbdSplitMatrixImpl :
+    public KbdMatrixImpl<typename PinListCat<LeftCols, RightCols>::Type,
+                         typename PinListCat<LeftRows, RightRows>::Type,
+                         ImplT> {
+  public:
+    enum : uint8_t {
+        SPLIT_COLS = LeftCols::SIZE,
+        SPLIT_ROWS = LeftRows::SIZE,
+    };
+
+    static_assert(LeftCols::template disjoint<RightRows>() &&
+                  RightCols::template disjoint<LeftRows>(),
+                  "pin used as both a row and a column");
+
+    // Methods invoked by KbdDiodeImpl
+    void prepareSplitColScan(uint8_t left, uint8_t right) {
+        if (left < SPLIT_COLS) {
+            MatrixLines<LeftCols>::select(left);
+        } else {
+            MatrixLines<LeftCols>::release();
+        }
+        if (right < SPLIT_COLS + RightCols::SIZE) {
+            MatrixLines<RightCols>::select(right - SPLIT_COLS);
+        } else {
+            MatrixLines<RightCols>::release();
+        }
+    }
+};
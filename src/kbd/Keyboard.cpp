@@ -3,7 +3,10 @@
  */
 #include <avrpp/kbd/Keyboard.h>
 
+#include <avrpp/kbd/ScanScheduler.h>
 #include <avrpp/log.h>
+#include <avrpp/system_time.h>
+#include <avrpp/task_scheduler.h>
 #include <avrpp/usb.h>
 #include <avrpp/usb_hid_keyboard.h>
 #include <avrpp/kbd_endpoint.h>
@@ -16,25 +19,73 @@
 
 F_LOG_LEVEL(1);
 
+namespace {
+
+/*
+ * Periodically logs the scanning and task statistics.
+ */
+class StatsTask : public Task {
+  public:
+    StatsTask(Keyboard *kbd, Keyboard::Callback *callback)
+        : Task("stats"), _kbd(kbd), _callback(callback) {}
+
+    virtual void run() override {
+        ScanScheduler::singleton()->logStats();
+        _kbd->logStats();
+        _callback->logStats();
+
+        auto tasks = TaskScheduler::singleton();
+        const auto &idle = tasks->getStats();
+        FLOG(1, "task stats: idle_sleeps=%lu idle_time=%lu\n",
+             idle.idleSleeps, idle.idleTime);
+        for (auto task = tasks->getTasks(); task; task = task->getNext()) {
+            const auto &stats = task->getStats();
+            FLOG(1, "task %s: runs=%u total=%lu max=%u overruns=%u\n",
+                 task->getName(), stats.runs, stats.totalTime,
+                 stats.maxTime, stats.overruns);
+        }
+    }
+
+  private:
+    Keyboard *_kbd;
+    Keyboard::Callback *_callback;
+};
+
+}
+
 void
 Keyboard::loop(Callback *callback) {
+    KeyboardScanTask<Keyboard, Callback> scan_task(this, callback);
+    runScanTasks(&scan_task, callback);
+}
+
+void
+Keyboard::runScanTasks(Task *scan_task, Callback *callback) {
     prepare();
 
-    // bounce_ms is the duration to delay between loops.  This is used to
-    // ensure that false key presses/releases aren't detected due to key
-    // bounce.
+    // Scan once per period, driven by the timer 1 tick.  Each tick posts
+    // the scan task, and the TaskScheduler idles the CPU for the remainder
+    // of each period, so the scan period doesn't drift as the amount of work
+    // done in each iteration changes.
     //
-    // TODO: We should use a counter to track how long the iteration takes,
-    // and then sleep for any remaining time.  At the moment with my current
-    // implementation, a 4MHz build takes around 2.5ms per iteration in the
-    // common case when when no ghosting is detected.
-    const uint8_t bounce_ms = 0;
-    while (true) {
-        if (scanKeys()) {
-            callback->onChange(this);
-        }
-        _delay_ms(bounce_ms);
-    }
+    // The period should be long enough that key bounce doesn't cause false
+    // key presses or releases to be detected.
+    //
+    // Keyboards with a slice callback sample the matrix from the timer
+    // interrupt, and the scan task is posted once per completed frame.
+    auto sched = ScanScheduler::singleton();
+    auto tasks = TaskScheduler::singleton();
+    StatsTask stats_task(this, callback);
+    tasks->addEvent(scan_task);
+    tasks->addPeriodic(&stats_task, STATS_LOG_INTERVAL_MS,
+                       STATS_LOG_INTERVAL_MS);
+
+    uint8_t num_slices = 1;
+    auto slicer = getSliceCallback(&num_slices);
+    sched->setTickTask(scan_task);
+    sched->start(_scanPeriodUs, slicer, num_slices);
+    SystemTime::singleton()->start();
+    tasks->run();
 }
 
 KeyboardImpl::~KeyboardImpl() {
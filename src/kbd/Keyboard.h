@@ -1,7 +1,9 @@
 // Copyright (c) 2013, Adam Simpkins
 #pragma once
 
+#include <avrpp/kbd/ScanScheduler.h>
 #include <avrpp/progmem.h>
+#include <avrpp/task_scheduler.h>
 #include <stdint.h>
 
 class Keyboard {
@@ -10,6 +12,41 @@ class Keyboard {
       public:
         virtual ~Callback() {}
         virtual void onChange(Keyboard* kbd) = 0;
+
+        /*
+         * Log any statistics the callback keeps.  loop() calls this along
+         * with Keyboard::logStats().
+         */
+        virtual void logStats() const {}
+    };
+
+    enum : uint16_t {
+        // The default scan period used by loop(), in microseconds.
+        DEFAULT_SCAN_PERIOD_US = 2000,
+        // How often loop() logs the scanning and task statistics.
+        STATS_LOG_INTERVAL_MS = 16000,
+    };
+    enum : uint8_t {
+        // The most events a single scanKeys() call can report.
+        MAX_EVENTS = 16,
+        // Returned by getEvents() when the changes are not available as
+        // events, and getState() must be used instead.
+        EVENTS_UNAVAILABLE = 0xff,
+    };
+
+    /*
+     * A single key press or release.
+     */
+    struct KeyEvent {
+        uint8_t col;
+        uint8_t row;
+        // The key's entries in the key and modifier tables.
+        uint8_t code;
+        uint8_t modifier;
+        bool pressed;
+        // When the key's column was sampled, in ScanScheduler timer counts
+        // since the tick that started the scan.
+        uint16_t time;
     };
 
     virtual ~Keyboard() {}
@@ -32,16 +69,96 @@ class Keyboard {
      *
      * Callers should wait for 2 to 5 milliseconds between calls to scanKeys().
      * This avoids false key changes detected due to key bounce.
+     * Implementations that debounce keys themselves, such as KbdDiodeImpl,
+     * may be scanned more often.
      */
     virtual bool scanKeys() = 0;
 
+    /*
+     * Returns true if the keyboard is in a low-power idle state, where no
+     * keys are down and scanKeys() only performs a cheap activity check.
+     *
+     * Keyboards that don't support an idle mode always return false.
+     */
+    virtual bool isIdle() const {
+        return false;
+    }
+
+    /*
+     * Arm a low-power check for key presses while USB is suspended.
+     *
+     * This is called from the USB interrupt on suspend, before the CPU is
+     * powered down.  It should set up the matrix so that checkSuspendScan()
+     * can detect a press with a single cheap read.
+     *
+     * The interrupt may arrive in the middle of scanKeys(), which resumes
+     * once the suspend ends.  The keyboard must notice that the matrix was
+     * changed under it, and not trust that scan.
+     *
+     * Returns false if the keyboard doesn't support this, in which case it
+     * cannot wake the host.
+     */
+    virtual bool prepareSuspendScan() {
+        return false;
+    }
+    /*
+     * Check for a key pressed since prepareSuspendScan().
+     *
+     * Keys that were already held down when prepareSuspendScan() was called
+     * are ignored, so that a stuck key can't keep the host awake.
+     */
+    virtual bool checkSuspendScan() {
+        return false;
+    }
+
+    /*
+     * Get the callback loop() should run from the scan timer interrupt,
+     * for keyboards that sample the matrix one slice at a time from the
+     * interrupt rather than all at once in scanKeys().
+     *
+     * On success, the number of slices per scan period is returned in
+     * numSlices.  Returns null if the keyboard scans everything in
+     * scanKeys().
+     */
+    virtual ScanScheduler::SliceCallback *getSliceCallback(uint8_t *) {
+        return nullptr;
+    }
+
+    /*
+     * Log any scanning statistics the keyboard keeps.
+     *
+     * loop() calls this periodically, along with the ScanScheduler stats.
+     */
+    virtual void logStats() const {}
+
     /*
      * Continuously scan the keys, notifying the callback on any state change.
      *
-     * This is a convenience method that simply loops calling scanKeys()
-     * repeatedly.
+     * This is a convenience method that calls scanKeys() once per scan period,
+     * using the ScanScheduler to time the scans.  The scans run as a
+     * TaskScheduler task, and this never returns: other work can be added
+     * to the TaskScheduler before calling loop().
      */
     virtual void loop(Callback *callback);
+    /*
+     * The body of loop(), with the task to run on each scan tick supplied by
+     * the caller.
+     *
+     * This lets a caller that knows the concrete keyboard and callback
+     * types run a KeyboardScanTask for them, so the per-scan calls are
+     * direct.  The callback is only used to log statistics.
+     */
+    void runScanTasks(Task *scan_task, Callback *callback)
+        __attribute__((noreturn));
+
+    /*
+     * Set the scan period used by loop().
+     *
+     * This must be called before loop() to have any effect.
+     */
+    void setScanPeriod(uint16_t period_us) {
+        _scanPeriodUs = period_us;
+    }
 
     /*
      * Get the current state of the keyboard.
@@ -61,6 +178,60 @@ class Keyboard {
     virtual void getState(uint8_t *modifiers,
                           uint8_t *keys,
                           uint8_t *keys_len) const = 0;
+
+    /*
+     * Get the keys that changed in the last scanKeys() call, as an ordered
+     * list of events.
+     *
+     * Events are listed in the order their keys were sampled.  The list is
+     * valid until the next call to scanKeys().
+     *
+     * Returns the number of events, or EVENTS_UNAVAILABLE if the keyboard
+     * doesn't report events or too many keys changed at once.  The caller
+     * must then use getState() to get the new state.
+     */
+    virtual uint8_t getEvents(const KeyEvent **) const {
+        return EVENTS_UNAVAILABLE;
+    }
+
+  private:
+    uint16_t _scanPeriodUs{DEFAULT_SCAN_PERIOD_US};
+};
+
+/*
+ * Runs one scan iteration on each ScanScheduler tick.
+ *
+ * Keyboard::loop() uses this with the Keyboard and Keyboard::Callback
+ * interfaces.  When KbdT and CallbackT are final classes instead, the
+ * compiler resolves the scanKeys() and onChange() calls statically.
+ */
+template<typename KbdT, typename CallbackT>
+class KeyboardScanTask : public Task {
+  public:
+    KeyboardScanTask(KbdT *kbd, CallbackT *callback)
+        : Task("scan"), _kbd(kbd), _callback(callback) {}
+
+    virtual void run() override {
+        auto sched = ScanScheduler::singleton();
+        sched->beginIteration();
+        const bool was_idle = _kbd->isIdle();
+        if (_kbd->scanKeys()) {
+            const uint16_t change_start = sched->elapsedInIteration();
+            _callback->onChange(_kbd);
+            sched->recordChangeTime(sched->elapsedInIteration() -
+                                    change_start);
+            if (was_idle) {
+                // Record how long it took from the start of the scan that
+                // left idle mode until the new state was handed off.
+                sched->recordWakeLatency();
+            }
+        }
+        sched->endIteration();
+    }
+
+  private:
+    KbdT *_kbd;
+    CallbackT *_callback;
 };
 
 class KeyboardImpl : public Keyboard {
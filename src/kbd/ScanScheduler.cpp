@@ -0,0 +1,325 @@
+// Copyright (c) 2013, Adam Simpkins
+#include <avrpp/kbd/ScanScheduler.h>
+
+#include <avrpp/atomic.h>
+#include <avrpp/log.h>
+#include <avrpp/system_time.h>
+#include <avrpp/task_scheduler.h>
+#include <avrpp/util.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+F_LOG_LEVEL(2);
+
+ScanScheduler ScanScheduler::s_scheduler;
+
+void
+ScanScheduler::start(uint16_t period_us,
+                     SliceCallback *slicer,
+                     uint8_t numSlices) {
+    AtomicGuard ag;
+
+    _slicer = slicer;
+    _numSlices = slicer ? numSlices : 1;
+    _periodTicks = usToTicks(period_us) / _numSlices;
+    _pendingTicks = 0;
+    _tickCount = 0;
+    _finishPending = false;
+
+    // The SOF always lands at the same point in the scan period only if the
+    // period is a whole number of frames.
+    const uint32_t full_period =
+        static_cast<uint32_t>(_periodTicks) * _numSlices;
+    _frameLocked = _frameLockEnabled && (full_period % FRAME_TICKS) == 0;
+
+    // Timer 1 in CTC mode, counting up to OCR1A at F_CPU / 8.
+    // The compare match interrupt fires once per period.
+    TCCR1A = 0;
+    TCCR1B = 0;
+    TCNT1 = 0;
+    OCR1A = _periodTicks - 1;
+    TIFR1 = (1 << OCF1A);
+    TIMSK1 = (1 << OCIE1A);
+    TCCR1B = timerControl();
+}
+
+void
+ScanScheduler::stop() {
+    AtomicGuard ag;
+    TIMSK1 = 0;
+    TCCR1B = 0;
+    _pendingTicks = 0;
+    setSlowClock(false);
+}
+
+void
+ScanScheduler::setSlowClock(bool slow) {
+    if (!_clockScaling) {
+        return;
+    }
+
+    AtomicGuard ag;
+    if (slow == _slowClock) {
+        return;
+    }
+    _slowClock = slow;
+    if (slow) {
+        ++_stats.slowClockSwitches;
+        set_cpu_prescale(CPU_PRESCALE + SLOW_CLOCK_SHIFT);
+    } else {
+        set_cpu_prescale(CPU_PRESCALE);
+    }
+    // Leave the timer stopped if it isn't running.
+    if (TCCR1B != 0) {
+        TCCR1B = timerControl();
+    }
+    SystemTime::singleton()->setSlowClock(slow);
+}
+
+uint8_t
+ScanScheduler::timerControl() const {
+    // CTC mode, clocked so that the timer always counts at F_CPU / 8.
+    if (_slowClock) {
+        return (1 << WGM12) | (1 << CS10);
+    }
+    return (1 << WGM12) | (1 << CS11);
+}
+
+void
+ScanScheduler::beginIteration() {
+    uint8_t pending;
+    uint16_t now;
+    {
+        AtomicGuard ag;
+        pending = _pendingTicks;
+        _pendingTicks = 0;
+        now = TCNT1;
+        _iterationStartTick = _tickCount;
+    }
+
+    if (pending > 1) {
+        _stats.missedTicks += pending - 1;
+    }
+    if (now < _stats.minStartDelay) {
+        _stats.minStartDelay = now;
+    }
+    if (now > _stats.maxStartDelay) {
+        _stats.maxStartDelay = now;
+    }
+    _iterationStart = now;
+}
+
+/*
+ * Read the current tick count and timer value.
+ *
+ * This must be called with interrupts disabled.
+ */
+void
+ScanScheduler::readTime(uint16_t *ticks, uint16_t *count) {
+    *count = TCNT1;
+    *ticks = _tickCount;
+    // If the counter has wrapped but the interrupt hasn't run yet,
+    // account for the tick ourselves.
+    if (TIFR1 & (1 << OCF1A)) {
+        *count = TCNT1;
+        ++*ticks;
+    }
+}
+
+/*
+ * Get the time since the specified point, in timer counts.
+ *
+ * This must be called with interrupts disabled.
+ */
+uint32_t
+ScanScheduler::elapsedSince(uint16_t startTicks, uint16_t startCount) {
+    uint16_t ticks;
+    uint16_t now;
+    readTime(&ticks, &now);
+
+    // Each tick since the start accounts for one full timer period.
+    return (static_cast<uint32_t>(ticks - startTicks) * _periodTicks) +
+        now - startCount;
+}
+
+uint16_t
+ScanScheduler::elapsedInIteration() {
+    uint32_t elapsed;
+    {
+        AtomicGuard ag;
+        elapsed = elapsedSince(_iterationStartTick, _iterationStart);
+    }
+    if (elapsed > 0xffff) {
+        return 0xffff;
+    }
+    return elapsed;
+}
+
+uint16_t
+ScanScheduler::timerCount() const {
+    // 16-bit timer reads go through the shared TEMP register, so they must
+    // not be interrupted by another one.
+    AtomicGuard ag;
+    return TCNT1;
+}
+
+void
+ScanScheduler::endIteration() {
+    const uint16_t busy = elapsedInIteration();
+
+    {
+        AtomicGuard ag;
+        readTime(&_finishTick, &_finishCount);
+        _finishPending = true;
+    }
+
+    // If the next tick (or frame) has already arrived, the iteration took
+    // longer than its period.
+    if (_pendingTicks != 0) {
+        ++_stats.overruns;
+    }
+
+    ++_stats.iterations;
+    _stats.busyTotal += busy;
+    if (busy > _stats.maxBusy) {
+        _stats.maxBusy = busy;
+    }
+}
+
+void
+ScanScheduler::recordWakeLatency() {
+    const uint16_t latency = elapsedInIteration();
+    ++_stats.wakeups;
+    _stats.lastWakeLatency = latency;
+    if (latency > _stats.maxWakeLatency) {
+        _stats.maxWakeLatency = latency;
+    }
+}
+
+void
+ScanScheduler::recordChangeTime(uint16_t ticks) {
+    ++_stats.changes;
+    _stats.changeTicksTotal += ticks;
+    if (ticks > _stats.maxChangeTicks) {
+        _stats.maxChangeTicks = ticks;
+    }
+}
+
+void
+ScanScheduler::recordSample() {
+    // The time since the tick that started this iteration
+    uint32_t delay = static_cast<uint32_t>(elapsedInIteration()) +
+        _iterationStart;
+    updateSampleDelay(delay > 0xffff ? 0xffff : delay);
+}
+
+void
+ScanScheduler::updateSampleDelay(uint16_t delay) {
+    if (delay < _stats.minSampleDelay) {
+        _stats.minSampleDelay = delay;
+    }
+    if (delay > _stats.maxSampleDelay) {
+        _stats.maxSampleDelay = delay;
+    }
+}
+
+void
+ScanScheduler::timerInterrupt() {
+    ++_tickCount;
+    if (_slicer) {
+        updateSampleDelay(TCNT1);
+        if (!_slicer->onSlice()) {
+            return;
+        }
+    }
+    ++_pendingTicks;
+    if (_tickTask) {
+        TaskScheduler::singleton()->post(_tickTask);
+    }
+}
+
+void
+ScanScheduler::startOfFrame() {
+    // Only the first SOF after each iteration is of interest.
+    if (!_finishPending) {
+        return;
+    }
+    _finishPending = false;
+
+    uint32_t offset = elapsedSince(_finishTick, _finishCount);
+    if (offset >= FRAME_TICKS) {
+        // We are only called when USB is configured, so the iteration must
+        // have ended before a suspend or reset.
+        offset = FRAME_TICKS - 1;
+    }
+    const uint8_t bucket = (offset * FRAME_OFFSET_BUCKETS) / FRAME_TICKS;
+    if (_stats.frameOffsets[bucket] != 0xffff) {
+        ++_stats.frameOffsets[bucket];
+    }
+
+    if (!_frameLocked) {
+        return;
+    }
+
+    // A positive error means the iteration ended too early, and the timer
+    // needs to be held back.  Past half a frame, it is quicker to move the
+    // iteration ahead of the previous SOF instead.
+    int16_t error = static_cast<int16_t>(offset) - _frameLeadTicks;
+    if (error > static_cast<int16_t>(FRAME_TICKS / 2)) {
+        error -= FRAME_TICKS;
+    }
+
+    // Only move part of the way there, so that jitter in the iteration
+    // length is filtered out.
+    int16_t nudge = error / 4;
+    if (nudge > MAX_FRAME_NUDGE) {
+        nudge = MAX_FRAME_NUDGE;
+    } else if (nudge < -MAX_FRAME_NUDGE) {
+        nudge = -MAX_FRAME_NUDGE;
+    }
+    if (nudge == 0) {
+        return;
+    }
+
+    // Don't move the counter across the compare match; just wait for the
+    // next frame instead.
+    const uint16_t now = TCNT1;
+    if (nudge > 0 && now < static_cast<uint16_t>(nudge)) {
+        return;
+    }
+    if (nudge < 0 && now - nudge >= OCR1A) {
+        return;
+    }
+    TCNT1 = now - nudge;
+    ++_stats.frameNudges;
+}
+
+void
+ScanScheduler::logStats() const {
+    FLOG(2, "scan stats: iterations=%lu busy=%lu period=%u slices=%u "
+         "overruns=%u missed=%u start_delay=%u-%u max_busy=%u "
+         "sample_delay=%u-%u\n",
+         _stats.iterations, _stats.busyTotal, _periodTicks, _numSlices,
+         _stats.overruns, _stats.missedTicks,
+         _stats.minStartDelay, _stats.maxStartDelay, _stats.maxBusy,
+         _stats.minSampleDelay, _stats.maxSampleDelay);
+    FLOG(2, "wake stats: wakeups=%u last_latency=%u max_latency=%u\n",
+         _stats.wakeups, _stats.lastWakeLatency, _stats.maxWakeLatency);
+    FLOG(2, "change stats: changes=%u total=%lu max=%u\n",
+         _stats.changes, _stats.changeTicksTotal, _stats.maxChangeTicks);
+    FLOG(2, "frame stats: locked=%u lead=%u nudges=%u "
+         "offsets=%u,%u,%u,%u,%u,%u,%u,%u\n",
+         static_cast<uint8_t>(_frameLocked), _frameLeadTicks, _stats.frameNudges,
+         _stats.frameOffsets[0], _stats.frameOffsets[1],
+         _stats.frameOffsets[2], _stats.frameOffsets[3],
+         _stats.frameOffsets[4], _stats.frameOffsets[5],
+         _stats.frameOffsets[6], _stats.frameOffsets[7]);
+    FLOG(2, "clock stats: scaling=%u slow=%u switches=%u\n",
+         static_cast<uint8_t>(_clockScaling),
+         static_cast<uint8_t>(_slowClock), _stats.slowClockSwitches);
+}
+
+ISR(TIMER1_COMPA_vect) {
+    ScanScheduler::singleton()->timerInterrupt();
+}
@@ -0,0 +1,319 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <stdint.h>
+
+class Task;
+
+/*
+ * A fixed-period scheduler for keyboard scanning.
+ *
+ * This uses timer 1 in CTC mode to generate a tick once per scan period.
+ * Each scan iteration starts on a tick, and the CPU idles in SLEEP_MODE_IDLE
+ * for whatever remains of the period once the iteration finishes.  This keeps
+ * the scan period constant no matter how much work an individual scan does
+ * (ghosting resolution, USB updates, logging), and avoids burning power
+ * spinning between scans.
+ *
+ * The iterations run as a TaskScheduler event task, posted on every tick:
+ * see setTickTask().
+ *
+ * Optionally, the scan period can be divided into a number of slices, with a
+ * SliceCallback invoked from the timer interrupt once per slice.  In this
+ * case the tick task is posted whenever the callback reports a complete
+ * frame, rather than on every tick.
+ *
+ * The scheduler can also phase-lock to the USB start-of-frame (SOF) signal.
+ * When startOfFrame() is called from the SOF interrupt, it measures how long
+ * before the SOF the last iteration finished, and nudges the timer so that
+ * iterations finish a fixed lead time ahead of the frame.  A changed report
+ * then sits in the endpoint bank for as short a time as possible before the
+ * host polls for it.  Locking only works when the scan period is a multiple
+ * of the 1ms USB frame.
+ *
+ * Timer 1 runs at F_CPU / 8, so all of the timer values reported in Stats are
+ * in units of 8 CPU cycles.
+ *
+ * While the keyboard is idle the CPU clock can be dropped to F_CPU / 8 with
+ * setSlowClock().  The timer prescaler is dropped to 1 at the same time, so
+ * the timer keeps counting at the same rate and all timer values (scan
+ * period, SOF lead, stats) mean the same thing at either speed.  Code that
+ * uses compile-time delays must only run at full speed.
+ */
+class ScanScheduler {
+  public:
+    enum : uint8_t {
+        TIMER_PRESCALE = 8,
+        // How many powers of two the CPU clock is divided by on the slow
+        // clock.  This matches TIMER_PRESCALE, so that the timer can run
+        // without a prescaler to keep the same count rate.
+        SLOW_CLOCK_SHIFT = 3,
+        // The slow clock needs to be at least 2MHz to keep up with the USB
+        // interrupts, so scaling is only supported on 16MHz builds.
+        CLOCK_SCALING_SUPPORTED = (F_CPU >> SLOW_CLOCK_SHIFT) >= 2000000,
+        // The number of buckets in the frame offset histogram.
+        FRAME_OFFSET_BUCKETS = 8,
+    };
+    enum : uint16_t {
+        // The USB full-speed frame period, in microseconds.
+        FRAME_US = 1000,
+        // The default time to finish each iteration before the SOF.
+        DEFAULT_FRAME_LEAD_US = 100,
+    };
+
+    class SliceCallback {
+      public:
+        virtual ~SliceCallback() {}
+
+        /*
+         * Called from the timer interrupt at the start of each slice.
+         *
+         * Returns true when a complete frame is ready for the main loop.
+         */
+        virtual bool onSlice() = 0;
+    };
+
+    struct Stats {
+        // The number of iterations run since the stats were last reset.
+        uint32_t iterations{0};
+        // The total time spent busy (not sleeping), in timer counts.
+        // Dividing this by (iterations * period * slices) gives the CPU duty
+        // cycle.
+        uint32_t busyTotal{0};
+        // The number of iterations that ran longer than the scan period.
+        uint16_t overruns{0};
+        // The total number of ticks that were skipped due to overruns.
+        uint16_t missedTicks{0};
+        // The minimum and maximum delay between the timer tick firing and the
+        // start of the iteration, in timer counts.  The difference between
+        // these two is the scan start jitter.
+        uint16_t minStartDelay{0xffff};
+        uint16_t maxStartDelay{0};
+        // The duration of the longest iteration, in timer counts.
+        uint16_t maxBusy{0};
+        // The number of times the keyboard left idle mode with a new key
+        // state, and the last and largest delay from the start of that
+        // iteration until the new state was reported, in timer counts.
+        //
+        // Note that this does not include the time between the key actually
+        // being pressed and the tick that sampled it, which is up to one full
+        // scan period.
+        uint16_t wakeups{0};
+        uint16_t lastWakeLatency{0};
+        uint16_t maxWakeLatency{0};
+        // The number of key state changes handed off to the keyboard
+        // callback, and the total and largest time spent in the callback,
+        // in timer counts.
+        uint16_t changes{0};
+        uint32_t changeTicksTotal{0};
+        uint16_t maxChangeTicks{0};
+        // The minimum and maximum delay from a tick until the matrix was
+        // sampled, in timer counts.  The difference is the sampling jitter.
+        //
+        // With a SliceCallback this is measured at the start of every slice.
+        // Otherwise it is measured once per iteration, when the keyboard
+        // calls recordSample() after reading the last column.
+        uint16_t minSampleDelay{0xffff};
+        uint16_t maxSampleDelay{0};
+        // A histogram of the time from the end of each iteration until the
+        // next USB SOF.  Bucket N counts offsets from N/8 up to (N+1)/8 of a
+        // frame.  The counts saturate at 0xffff.
+        uint16_t frameOffsets[FRAME_OFFSET_BUCKETS]{};
+        // The number of times the timer was nudged to track the SOF.
+        uint16_t frameNudges{0};
+        // The number of times the CPU was switched to the slow clock.
+        uint16_t slowClockSwitches{0};
+    };
+
+    static ScanScheduler *singleton() {
+        return &s_scheduler;
+    }
+
+    /*
+     * Start the timer, with a tick every period_us microseconds.
+     *
+     * The period must fit in 16 bits worth of timer counts: up to 131ms for
+     * 4MHz builds, or 32ms for 16MHz builds.
+     *
+     * If a slicer is supplied, the period is divided into numSlices ticks,
+     * and slicer->onSlice() is called from the interrupt on each one.
+     */
+    void start(uint16_t period_us,
+               SliceCallback *slicer = nullptr,
+               uint8_t numSlices = 1);
+    void stop();
+
+    /*
+     * Configure phase-locking to the USB SOF.
+     *
+     * When enabled, the timer is adjusted so that each iteration ends
+     * lead_us microseconds before a SOF.  This must be called before
+     * start().  Locking is enabled by default, but has no effect unless
+     * startOfFrame() is being called.
+     */
+    void setFrameLock(bool enabled,
+                      uint16_t lead_us = DEFAULT_FRAME_LEAD_US) {
+        _frameLockEnabled = enabled;
+        _frameLeadTicks = usToTicks(lead_us);
+    }
+    bool isFrameLocked() const {
+        return _frameLocked;
+    }
+
+    /*
+     * Enable or disable slow-clock operation.
+     *
+     * When disabled, setSlowClock() has no effect.  This is enabled by
+     * default when CLOCK_SCALING_SUPPORTED; the slow clock is too slow to
+     * keep up with USB interrupts on lower speed builds.
+     */
+    void setClockScaling(bool enabled) {
+        if (!enabled) {
+            setSlowClock(false);
+        }
+        _clockScaling = enabled && CLOCK_SCALING_SUPPORTED;
+    }
+
+    /*
+     * Switch the CPU between F_CPU and F_CPU / 8.
+     *
+     * This is meant to be called by the keyboard when it enters and leaves
+     * idle mode, and is safe to call from an interrupt.  Callers must switch
+     * back to full speed before any code that relies on compile-time delays,
+     * such as the column settle loops.
+     */
+    void setSlowClock(bool slow);
+    bool isSlowClock() const {
+        return _slowClock;
+    }
+
+    /*
+     * Notify the scheduler of a USB start-of-frame.
+     *
+     * This should be called from the USB interrupt.  It records the frame
+     * offset statistics and, if locking is enabled, adjusts the timer phase.
+     */
+    void startOfFrame();
+
+    /*
+     * Post a TaskScheduler event task on every tick, or every complete frame
+     * with a SliceCallback.
+     *
+     * The task should call beginIteration() and endIteration() around its
+     * work.  This must be called before start().
+     */
+    void setTickTask(Task *task) {
+        _tickTask = task;
+    }
+
+    /*
+     * Start an iteration for a tick that has already fired.
+     */
+    void beginIteration();
+
+    /*
+     * Record the end of an iteration started with beginIteration().
+     */
+    void endIteration();
+
+    /*
+     * Record the time elapsed in the current iteration as a
+     * wake-to-first-report latency sample.
+     */
+    void recordWakeLatency();
+
+    /*
+     * Record how long the keyboard callback took to handle a key state
+     * change, in timer counts.
+     */
+    void recordChangeTime(uint16_t ticks);
+
+    /*
+     * Record that the matrix has just been sampled, for the sample jitter
+     * statistics.
+     *
+     * This is only used without a SliceCallback; with one, the samples are
+     * recorded by the timer interrupt.
+     */
+    void recordSample();
+
+    /*
+     * Get the time since the start of the current iteration, in timer
+     * counts.  This saturates at 0xffff.
+     */
+    uint16_t elapsedInIteration();
+
+    const Stats &getStats() const {
+        return _stats;
+    }
+    void resetStats() {
+        _stats = Stats();
+    }
+    void logStats() const;
+
+    /*
+     * Get the raw timer count, in timer counts since the last tick.
+     *
+     * This is much cheaper than elapsedInIteration(), and is meant for
+     * timestamping samples taken within a single iteration.
+     */
+    uint16_t timerCount() const;
+
+    uint16_t getPeriodTicks() const {
+        return _periodTicks;
+    }
+
+    /*
+     * Convert a duration in microseconds into timer counts.
+     */
+    static constexpr uint16_t usToTicks(uint16_t us) {
+        return (static_cast<uint32_t>(us) *
+                (F_CPU / TIMER_PRESCALE / 1000)) / 1000;
+    }
+
+    void timerInterrupt();
+
+  private:
+    ScanScheduler() {}
+
+    enum : uint16_t {
+        FRAME_TICKS = (F_CPU / TIMER_PRESCALE / 1000) * (FRAME_US / 1000),
+    };
+    enum : uint8_t {
+        // The largest single adjustment made to the timer on a SOF,
+        // in timer counts.
+        MAX_FRAME_NUDGE = 8,
+    };
+
+    void readTime(uint16_t *ticks, uint16_t *count);
+    uint32_t elapsedSince(uint16_t startTicks, uint16_t startCount);
+    void updateSampleDelay(uint16_t delay);
+    uint8_t timerControl() const;
+
+    // Forbidden copy constructor and assignment operator
+    ScanScheduler(ScanScheduler const &) = delete;
+    ScanScheduler& operator=(ScanScheduler const &) = delete;
+
+    volatile uint8_t _pendingTicks{0};
+    // Incremented on every timer tick, whether or not it completes a frame.
+    volatile uint16_t _tickCount{0};
+    SliceCallback *_slicer{nullptr};
+    Task *_tickTask{nullptr};
+    uint8_t _numSlices{1};
+    uint16_t _periodTicks{0};
+    uint16_t _iterationStart{0};
+    uint16_t _iterationStartTick{0};
+    // When the last iteration finished.  Set by endIteration() and consumed
+    // by the next startOfFrame().
+    volatile bool _finishPending{false};
+    uint16_t _finishTick{0};
+    uint16_t _finishCount{0};
+    bool _clockScaling{CLOCK_SCALING_SUPPORTED};
+    volatile bool _slowClock{false};
+    bool _frameLockEnabled{true};
+    bool _frameLocked{false};
+    uint16_t _frameLeadTicks{usToTicks(DEFAULT_FRAME_LEAD_US)};
+    Stats _stats;
+
+    static ScanScheduler s_scheduler;
+};
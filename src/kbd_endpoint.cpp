@@ -3,6 +3,7 @@
 
 #include <avrpp/atomic.h>
 #include <avrpp/log.h>
+#include <avrpp/system_time.h>
 #include <avrpp/usb.h>
 #include <avrpp/usb_descriptors.h>
 #include <avrpp/usb_hid.h>
@@ -39,22 +40,11 @@ KeyboardIface::startOfFrame() {
         return;
     }
 
-    // Increment our idle counters
-    //
-    // startOfFrame() will be called every 1ms.  _idleConfig specifies
-    // how long we should retransmit, in 4ms units.  We use the lower
-    // two bits of _flags to track 4ms intervals, and bump _idleCount every
-    // time it rolls over.
-    if ((_flags & Flags::COUNT_MASK) == Flags::COUNT_MASK) {
-        // Another 4ms has passed, so bump _idleCount.
-        _flags &= ~Flags::COUNT_MASK;
-        ++_idleCount;
-        if (_idleCount >= _idleConfig) {
-            _sendUpdate();
-            return;
-        }
-    } else {
-        ++_flags;
+    // _idleConfig specifies how often we should retransmit, in 4ms units.
+    const uint16_t idle_ms = static_cast<uint16_t>(_idleConfig) * 4;
+    const uint16_t now = SystemTime::singleton()->millis();
+    if (static_cast<uint16_t>(now - _lastReportMs) >= idle_ms) {
+        _sendUpdate();
     }
 }
 
@@ -86,13 +76,16 @@ KeyboardIface::_sendUpdate() {
     }
     set_UEINTX(ueintx_bits & ~UEINTXFlags::FIFO_CONTROL);
 
-    _idleCount = 0;
-    _flags &= ~(Flags::UPDATE_PENDING | Flags::COUNT_MASK);
+    _lastReportMs = SystemTime::singleton()->millis();
+    _flags &= ~Flags::UPDATE_PENDING;
     return true;
 }
 
 bool
 KeyboardIface::addEndpoints(UsbController* usb) {
+    // The idle reports are timed with the SystemTime clock, so make sure it
+    // is running whoever set up USB.  This does nothing if it already is.
+    SystemTime::singleton()->start();
     return usb->addEndpoint(&_endpoint);
 }
 
@@ -141,7 +134,7 @@ KeyboardIface::handleSetupPacket(const SetupPacket* pkt) {
         }
         if (pkt->bRequest == HID_SET_IDLE) {
             _idleConfig = (pkt->wValue >> 8);
-            _idleCount = 0;
+            _lastReportMs = SystemTime::singleton()->millis();
             // UsbController::waitForTxReady();
             UsbController::sendIn();
             return true;
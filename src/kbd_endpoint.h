@@ -36,21 +36,24 @@ class KeyboardIface : public UsbInterface {
 
     void update(const uint8_t* keys, uint8_t modifiers);
 
-    virtual bool addEndpoints(UsbController* usb) override;
-    virtual bool handleSetupPacket(const SetupPacket* pkt) override;
-    virtual void startOfFrame() override;
+    /*
+     * Whether the last report passed to update() is still waiting for room
+     * in the endpoint.  A new update() would replace it unsent.
+     */
+    bool updatePending() const {
+        return _flags & Flags::UPDATE_PENDING;
+    }
+
+    bool addEndpoints(UsbController* usb);
+    bool handleSetupPacket(const SetupPacket* pkt);
+    void startOfFrame();
 
   private:
     /*
-     * The lower 2 bits of _flags are a 2-bit counter, used for incrementing
-     * _idleCount.  (_idleCount is incremented on every 4th call to
-     * startOfFrame(), since it represents idle time in 4ms units.)
-     *
      * The most significant bit of _flags indicates if we need to send
      * an update.
      */
     enum Flags : uint8_t {
-        COUNT_MASK = 0x03,
         UPDATE_PENDING = 0x80,
     };
 
@@ -62,7 +65,9 @@ class KeyboardIface : public UsbInterface {
     // the idle configuration, how often we send the report to the
     // host (ms * 4) even when it hasn't changed
     uint8_t _idleConfig{125};
-    uint8_t _idleCount{0};
+    // When the last report was sent, in the low 16 bits of
+    // SystemTime::millis().
+    uint16_t _lastReportMs{0};
     uint8_t _flags{0};
     uint8_t _protocol{1};
 
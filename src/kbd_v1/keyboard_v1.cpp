@@ -84,77 +84,4 @@ static const uint8_t PROGMEM default_modifier_table[16 * 8] = {
 KeyboardV1::KeyboardV1() {
     _keyTable = pgm_cast(default_key_table);
     _modifierTable = pgm_cast(default_modifier_table);
-
-    // There are diodes installed on the left and right shift and control keys,
-    // as well as the control and alt thumb keys.
-    _diodes.set(getIndex(6, 2)); // Left shift
-    _diodes.set(getIndex(2, 7)); // Right shift
-    _diodes.set(getIndex(6, 14)); // Left ctrl
-    _diodes.set(getIndex(3, 7)); // Right ctrl
-    _diodes.set(getIndex(2, 4)); // Left thumb ctrl
-    _diodes.set(getIndex(2, 1)); // Right thumb ctrl
-    _diodes.set(getIndex(3, 12)); // Left thumb alt
-    _diodes.set(getIndex(2, 11)); // Right thumb alt
-}
-
-void
-KeyboardV1::prepare() {
-    // Set columns to output, low
-    DDRF = 0xff;
-    PORTF = 0x00;
-
-    // Set rows to input, with pull-up resistors
-    DDRB = 0x00;
-    PORTB = 0xff;
-    DDRC = 0x00;
-    PORTC = 0xff;
-}
-
-void
-KeyboardV1::prepareColScan(uint8_t col) {
-    // Set the specified column to low output, with all other
-    // columns as pull-up input.
-    //
-    // We assume that all rows are already configured as pull-up inputs.
-    // (After each call to prepareRowScan(), finishRowScan() is always called
-    // before subsequent prepareColScan() calls.)
-    DDRF = 0x01 << col;
-    PORTF = 0xff & ~(0x01 << col);
-}
-
-void
-KeyboardV1::prepareRowScan(uint8_t row) {
-    // Set the specified row to low output, with all other rows and columns
-    // as pull-up input.
-    DDRF = 0x00;
-    PORTF = 0xff;
-    if (row < 8) {
-        uint8_t bit = row;
-        DDRB = 0x01 << bit;
-        PORTB = 0xff & ~(0x01 << bit);
-    } else if (row < 16) {
-        uint8_t bit = row - 8;
-        DDRC = 0x01 << bit;
-        PORTC = 0xff & ~(0x01 << bit);
-    }
-}
-
-void
-KeyboardV1::finishRowScan() {
-    // Reset all rows to pull-up input.
-    DDRB = 0x00;
-    PORTB = 0xff;
-    DDRC = 0x00;
-    PORTC = 0xff;
-}
-
-void
-KeyboardV1::readRows(RowMap *rows) {
-    rows->bytes[0] = ~PINB;
-    rows->bytes[1] = ~PINC;
-}
-
-void
-KeyboardV1::readCols(ColMap *cols) {
-    cols->bytes[0] = ~PINF;
 }
@@ -1,18 +1,48 @@
 // Copyright (c) 2013, Adam Simpkins
 #pragma once
 
-#include <avrpp/kbd/KbdDiodeImpl.h>
+#include <avrpp/kbd/KbdMatrix.h>
 
-class KeyboardV1 : public KbdDiodeImpl<8, 16, KeyboardV1> {
+// Columns are on port F
+typedef PinList<
+    IoPin<PinF, 0>, IoPin<PinF, 1>, IoPin<PinF, 2>, IoPin<PinF, 3>,
+    IoPin<PinF, 4>, IoPin<PinF, 5>, IoPin<PinF, 6>, IoPin<PinF, 7>
+> KeyboardV1Cols;
+
+// Rows 0-7 are on port B, and rows 8-15 on port C
+typedef PinList<
+    IoPin<PinB, 0>, IoPin<PinB, 1>, IoPin<PinB, 2>, IoPin<PinB, 3>,
+    IoPin<PinB, 4>, IoPin<PinB, 5>, IoPin<PinB, 6>, IoPin<PinB, 7>,
+    IoPin<PinC, 0>, IoPin<PinC, 1>, IoPin<PinC, 2>, IoPin<PinC, 3>,
+    IoPin<PinC, 4>, IoPin<PinC, 5>, IoPin<PinC, 6>, IoPin<PinC, 7>
+> KeyboardV1Rows;
+
+class KeyboardV1 :
+    public KbdMatrixImpl<KeyboardV1Cols, KeyboardV1Rows, KeyboardV1> {
   public:
-    KeyboardV1();
+    // There are diodes installed on the left and right shift and control keys,
+    // as well as the control and alt thumb keys.
+    typedef DiodeList<
+        Diode<6, 2>,    // Left shift
+        Diode<2, 7>,    // Right shift
+        Diode<6, 14>,   // Left ctrl
+        Diode<3, 7>,    // Right ctrl
+        Diode<2, 4>,    // Left thumb ctrl
+        Diode<2, 1>,    // Right thumb ctrl
+        Diode<3, 12>,   // Left thumb alt
+        Diode<2, 11>    // Right thumb alt
+    > Diodes;
 
-    virtual void prepare() override;
+    enum : uint16_t {
+        // Bound the ghosting resolution done in each scanKeys() call.
+        // With 8 columns and 16 rows, the worst case for scanKeys() is 8
+        // column reads, a visit per key down and 120 row pair comparisons
+        // for the rectangle search, this budget, one more component
+        // (including a re-scan of 40 line reads), and blocking whatever is
+        // left.  This is counted from the code, not timed on the board;
+        // logStats() reports the longest resolution actually seen.
+        RESOLVE_BUDGET_US = 500,
+    };
 
-    // Methods invoked by KbdDiodeImpl
-    void prepareColScan(uint8_t col);
-    void prepareRowScan(uint8_t row);
-    void finishRowScan();
-    void readRows(RowMap *rows);
-    void readCols(ColMap *cols);
+    KeyboardV1();
 };
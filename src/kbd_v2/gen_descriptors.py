@@ -122,6 +122,9 @@ def gen_config():
                 endpoints=[dbg_endpoint])
         dbg_hid = usb_config.HidDescriptor([dbg_report_desc])
 
+    # A key press can wake the host from suspend;
+    # see KbdControllerBase::suspend().
+    config.configs[0].attributes |= usb_config.CONFIG_ATTR_REMOTE_WAKEUP
     config.configs[0].descriptors = [
         kbd_boot_iface,
         kbd_hid,
@@ -91,79 +91,4 @@ static const uint8_t PROGMEM default_modifier_table[18 * 8] = {
 KeyboardV2::KeyboardV2() {
     _keyTable = pgm_cast(default_key_table);
     _modifierTable = pgm_cast(default_modifier_table);
-
-    // There are diodes installed on the left and right shift keys.
-    _diodes.set(getIndex(1, 17));
-    _diodes.set(getIndex(6, 17));
-}
-
-void
-KeyboardV2::prepare() {
-    // Set columns to output, low
-    DDRB = 0xff;
-    PORTB = 0x00;
-
-    // Set rows to input, with pull-up resistors
-    DDRD = 0x00;
-    PORTD = 0xff;
-    DDRF = 0x00;
-    PORTF = 0xff;
-    DDRE = 0x00;
-    PORTE = 0xc0;
-}
-
-void
-KeyboardV2::prepareColScan(uint8_t col) {
-    // Set the specified column to low output, with all other
-    // columns as pull-up input.
-    //
-    // We assume that all rows are already configured as pull-up inputs.
-    // (After each call to prepareRowScan(), finishRowScan() is always called
-    // before subsequent prepareColScan() calls.)
-    DDRB = 0x01 << col;
-    PORTB = 0xff & ~(0x01 << col);
-}
-
-void
-KeyboardV2::prepareRowScan(uint8_t row) {
-    // Set the specified row to low output, with all other rows and columns
-    // as pull-up input.
-    DDRB = 0x00;
-    PORTB = 0xff;
-    if (row < 8) {
-        uint8_t bit = row;
-        DDRD = 0x01 << bit;
-        PORTD = 0xff & ~(0x01 << bit);
-    } else if (row < 16) {
-        uint8_t bit = row - 8;
-        DDRF = 0x01 << bit;
-        PORTF = 0xff & ~(0x01 << bit);
-    } else {
-        uint8_t bit = row - 10;
-        DDRE = 0x01 << bit;
-        PORTE = 0xc0 & ~(0x01 << bit);
-    }
-}
-
-void
-KeyboardV2::finishRowScan() {
-    // Reset all rows to pull-up input.
-    DDRD = 0x00;
-    PORTD = 0xff;
-    DDRF = 0x00;
-    PORTF = 0xff;
-    DDRE = 0x00;
-    PORTE = 0xc0;
-}
-
-void
-KeyboardV2::readRows(RowMap *rows) {
-    rows->bytes[0] = ~PIND;
-    rows->bytes[1] = ~PINF;
-    rows->bytes[2] = (static_cast<uint8_t>(~PINE) >> 6);
-}
-
-void
-KeyboardV2::readCols(ColMap *cols) {
-    cols->bytes[0] = ~PINB;
 }
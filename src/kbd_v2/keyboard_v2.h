@@ -1,18 +1,39 @@
 // Copyright (c) 2013, Adam Simpkins
 #pragma once
 
-#include <avrpp/kbd/KbdDiodeImpl.h>
+#include <avrpp/kbd/KbdMatrix.h>
 
-class KeyboardV2 : public KbdDiodeImpl<8, 18, KeyboardV2> {
+// Columns are on port B
+typedef PinList<
+    IoPin<PinB, 0>, IoPin<PinB, 1>, IoPin<PinB, 2>, IoPin<PinB, 3>,
+    IoPin<PinB, 4>, IoPin<PinB, 5>, IoPin<PinB, 6>, IoPin<PinB, 7>
+> KeyboardV2Cols;
+
+// Rows 0-7 are on port D, rows 8-15 on port F, and rows 16-17 on E6 and E7
+typedef PinList<
+    IoPin<PinD, 0>, IoPin<PinD, 1>, IoPin<PinD, 2>, IoPin<PinD, 3>,
+    IoPin<PinD, 4>, IoPin<PinD, 5>, IoPin<PinD, 6>, IoPin<PinD, 7>,
+    IoPin<PinF, 0>, IoPin<PinF, 1>, IoPin<PinF, 2>, IoPin<PinF, 3>,
+    IoPin<PinF, 4>, IoPin<PinF, 5>, IoPin<PinF, 6>, IoPin<PinF, 7>,
+    IoPin<PinE, 6>, IoPin<PinE, 7>
+> KeyboardV2Rows;
+
+class KeyboardV2 final :
+    public KbdMatrixImpl<KeyboardV2Cols, KeyboardV2Rows, KeyboardV2> {
   public:
-    KeyboardV2();
+    // There are diodes installed on the left and right shift keys.
+    typedef DiodeList<Diode<1, 17>, Diode<6, 17>> Diodes;
 
-    virtual void prepare() override;
+    enum : uint16_t {
+        // Bound the ghosting resolution done in each scanKeys() call.
+        // With 8 columns and 18 rows, the worst case for scanKeys() is 8
+        // column reads, a visit per key down and 153 row pair comparisons
+        // for the rectangle search, this budget, one more component
+        // (including a re-scan of 40 line reads), and blocking whatever is
+        // left.  This is counted from the code, not timed on the board;
+        // logStats() reports the longest resolution actually seen.
+        RESOLVE_BUDGET_US = 500,
+    };
 
-    // Methods invoked by KbdDiodeImpl
-    void prepareColScan(uint8_t col);
-    void prepareRowScan(uint8_t row);
-    void finishRowScan();
-    void readRows(RowMap *rows);
-    void readCols(ColMap *cols);
+    KeyboardV2();
 };
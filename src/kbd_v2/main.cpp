@@ -12,7 +12,11 @@
 
 F_LOG_LEVEL(2);
 
-class LedController : public KbdController::LedController {
+/*
+ * The LED controller doesn't need to derive from KbdLedController, since
+ * KbdControllerT calls it directly.
+ */
+class LedController {
   public:
     LedController() {
         // The LEDs are C0 through C4.
@@ -25,20 +29,20 @@ class LedController : public KbdController::LedController {
         PORTC = 0xff & ~(PIN_POWER | PIN_ERROR);
     }
 
-    void setPowerLED() override {
+    void setPowerLED() {
         PORTC &= ~PIN_POWER;
     }
-    void clearPowerLED() override {
+    void clearPowerLED() {
         PORTC |= PIN_POWER;
     }
-    void setErrorLED() override {
+    void setErrorLED() {
         PORTC &= ~PIN_ERROR;
     }
-    void clearErrorLED() override {
+    void clearErrorLED() {
         PORTC |= PIN_ERROR;
     }
 
-    void setKeyboardLEDs(uint8_t led_value) override {
+    void setKeyboardLEDs(uint8_t led_value) {
         uint8_t new_pins = PORTC;
         if (led_value & LED_NUM_LOCK) {
             new_pins &= ~PIN_NUM_LOCK;
@@ -61,12 +65,12 @@ class LedController : public KbdController::LedController {
     // Turn off all LEDs for entering suspend mode.
     // Returns the current LED state.  This can be restored after suspending
     // by calling restoreLEDs().
-    uint8_t suspendLEDs() override {
+    uint8_t suspendLEDs() {
         uint8_t current_leds = ((~PORTC) & LED_MASK);
         PORTC |= LED_MASK;
         return current_leds;
     }
-    void restoreLEDs(uint8_t value) override {
+    void restoreLEDs(uint8_t value) {
         PORTC = (PORTC & ~LED_MASK) | ~value;
     }
 
@@ -87,13 +91,12 @@ int main() {
 
     KeyboardV2 kbd;
     LedController leds;
-    KbdController controller(&kbd, &leds,
-                             KEYBOARD_INTERFACE, KEYBOARD_ENDPOINT);
+    KbdControllerT<KeyboardV2, LedController> controller(
+        &kbd, &leds, KEYBOARD_INTERFACE, KEYBOARD_ENDPOINT);
 #if USB_DEBUG
     controller.cfgDebugIface(DEBUG_INTERFACE, DEBUG_ENDPOINT, 4096, DEBUG_SIZE);
 #endif
     controller.init(ENDPOINT0_SIZE, pgm_cast(usb_descriptors));
     FLOG(1, "Keyboard initialized\n");
     controller.loop();
-    return 0;
 }
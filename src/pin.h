@@ -19,6 +19,9 @@
 template<typename PinTraits, uint8_t PIN>
 class IoPin {
   public:
+    typedef PinTraits Port;
+    static constexpr uint8_t BIT = PIN;
+
     IoPin() { static_assert(PIN < 8, "invalid pin number"); }
     bool read() const {
         return (_pin.pin() & (1 << PIN));
@@ -59,13 +62,17 @@ class IoPin {
 template<uint8_t PinAddr, uint8_t DdrAddr, uint8_t PortAddr>
 class PinTraits {
   public:
-    constexpr volatile uint8_t& pin() {
+    static constexpr uint8_t PIN_ADDR = PinAddr;
+    static constexpr uint8_t DDR_ADDR = DdrAddr;
+    static constexpr uint8_t PORT_ADDR = PortAddr;
+
+    static constexpr volatile uint8_t& pin() {
         return _SFR_IO8(PinAddr);
     }
-    constexpr volatile uint8_t& direction() {
+    static constexpr volatile uint8_t& direction() {
         return _SFR_IO8(DdrAddr);
     }
-    constexpr volatile uint8_t& port() {
+    static constexpr volatile uint8_t& port() {
         return _SFR_IO8(PortAddr);
     }
 };
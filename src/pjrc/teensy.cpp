@@ -20,6 +20,7 @@
  * THE SOFTWARE.
  */
 #include <avrpp/pjrc/teensy.h>
+#include <avrpp/util.h>
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
@@ -31,6 +32,13 @@
  */
 void jump_to_bootloader() {
     cli();
+    // Undo any clock scaling and power reduction, in case we were called
+    // while idle on the slow clock.
+    set_cpu_prescale();
+#if defined(PRR1)
+    PRR0 = 0;
+    PRR1 = 0;
+#endif
     // disable watchdog, if enabled
     // disable all peripherals
     UDCON = 1;
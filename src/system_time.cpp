@@ -0,0 +1,171 @@
+// Copyright (c) 2013, Adam Simpkins
+#include <avrpp/system_time.h>
+
+#include <avrpp/atomic.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+SystemTime SystemTime::s_time;
+
+void
+SystemTime::start() {
+    AtomicGuard ag;
+    if (_running) {
+        return;
+    }
+    _running = true;
+    _ms = 0;
+    _frameLocked = false;
+
+    // Timer 3 in CTC mode, counting up to OCR3A at F_CPU / 8.
+    // Until the first SOF, the compare match interrupt fires once per
+    // millisecond.
+    PRR1 &= ~(1 << PRTIM3);
+    TCCR3A = 0;
+    TCCR3B = 0;
+    TCNT3 = 0;
+    OCR3A = COUNTS_PER_MS - 1;
+    TIFR3 = (1 << OCF3A);
+    TIMSK3 = (1 << OCIE3A);
+    TCCR3B = timerControl();
+}
+
+void
+SystemTime::setSlowClock(bool slow) {
+    AtomicGuard ag;
+    _slowClock = slow;
+    if (_running) {
+        TCCR3B = timerControl();
+    }
+}
+
+uint8_t
+SystemTime::timerControl() const {
+    // CTC mode, clocked so that the timer always counts at F_CPU / 8.
+    if (_slowClock) {
+        return (1 << WGM32) | (1 << CS30);
+    }
+    return (1 << WGM32) | (1 << CS31);
+}
+
+uint32_t
+SystemTime::millis() const {
+    AtomicGuard ag;
+    return _ms;
+}
+
+uint32_t
+SystemTime::ticks() const {
+    uint32_t ms;
+    uint16_t count;
+    {
+        AtomicGuard ag;
+        readTime(&ms, &count);
+    }
+    return (ms * COUNTS_PER_MS) + count;
+}
+
+/*
+ * Read the current millisecond count and timer value.
+ *
+ * This must be called with interrupts disabled.
+ */
+void
+SystemTime::readTime(uint32_t *ms, uint16_t *count) const {
+    *count = TCNT3;
+    *ms = _ms;
+    // If the timer has reached the end of a millisecond but the interrupt
+    // hasn't run yet, account for it ourselves.  While locked to the SOF the
+    // count runs past COUNTS_PER_MS until the next SOF restarts it.
+    if (_frameLocked) {
+        if (*count >= COUNTS_PER_MS) {
+            *count = COUNTS_PER_MS - 1;
+        }
+    } else if (TIFR3 & (1 << OCF3A)) {
+        *count = TCNT3;
+        ++*ms;
+    }
+}
+
+void
+SystemTime::startOfFrame() {
+    if (!_running) {
+        return;
+    }
+    const uint16_t frame = UDFNUM & 0x7ff;
+    if (!_frameLocked) {
+        relock(frame);
+        return;
+    }
+
+    // Restart the millisecond on the frame boundary, and push back the
+    // watchdog.  The first frame after relocking may have been given a
+    // later watchdog.
+    TCNT3 = 0;
+    TIFR3 = (1 << OCF3A);
+    OCR3A = SOF_TIMEOUT_COUNTS - 1;
+
+    uint16_t elapsed = (frame - _lastFrame) & 0x7ff;
+    _lastFrame = frame;
+    if (elapsed == 0 || elapsed > MAX_FRAME_GAP) {
+        elapsed = 1;
+    } else if (elapsed > 1) {
+        _stats.lateFrames += elapsed - 1;
+    }
+    _ms += elapsed;
+    _stats.sofMs += elapsed;
+}
+
+/*
+ * Lock the clock to the SOF again after counting on the timer.
+ *
+ * The timer has kept the milliseconds since the last frame, so only the
+ * part of a millisecond it has counted needs settling: it is rounded to the
+ * nearest frame boundary.  Rounding up restarts the timer at once.
+ * Rounding down leaves it running into the first frame, which then ends
+ * late, so that the clock never goes backwards.  Either way the error stays
+ * under half a millisecond rather than adding up over each suspend and
+ * resume.
+ */
+void
+SystemTime::relock(uint16_t frame) {
+    uint16_t count = TCNT3;
+    if (TIFR3 & (1 << OCF3A)) {
+        // The timer finished a millisecond, but its interrupt hasn't run.
+        count = TCNT3;
+        ++_ms;
+        ++_stats.timerMs;
+        TIFR3 = (1 << OCF3A);
+    }
+
+    _frameLocked = true;
+    _lastFrame = frame;
+    ++_stats.frameLocks;
+    if (count >= COUNTS_PER_MS / 2) {
+        TCNT3 = 0;
+        OCR3A = SOF_TIMEOUT_COUNTS - 1;
+        ++_ms;
+        ++_stats.sofMs;
+    } else {
+        OCR3A = count + SOF_TIMEOUT_COUNTS - 1;
+    }
+}
+
+void
+SystemTime::timerInterrupt() {
+    if (_frameLocked) {
+        // No SOF arrived in time.  The timer has just restarted from 0, part
+        // of the way into the next millisecond, so move it on by that much
+        // and keep counting on our own.
+        _frameLocked = false;
+        TCNT3 += OCR3A + 1 - COUNTS_PER_MS;
+        OCR3A = COUNTS_PER_MS - 1;
+    }
+    ++_ms;
+    ++_stats.timerMs;
+}
+
+ISR(TIMER3_COMPA_vect) {
+    SystemTime::singleton()->timerInterrupt();
+}
@@ -0,0 +1,125 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A monotonic system clock, with millisecond and sub-millisecond timestamps.
+ *
+ * Timer 3 runs at F_CPU / 8 and counts the time within the current
+ * millisecond.  While the host is sending USB start-of-frame packets, the
+ * milliseconds are counted from the SOF interrupt: each SOF restarts the
+ * timer, and the frame number in UDFNUM accounts for any SOF interrupts
+ * that were delayed past the next frame.  The timer compare interrupt is
+ * then only a watchdog, set a quarter of a frame past the next SOF.  If it
+ * fires, the SOFs have stopped (USB is unconfigured, suspended or
+ * unplugged) and the timer goes back to counting milliseconds on its own
+ * until the next SOF.  The clock then locks to the frames again, rounding
+ * to the nearest frame boundary, so it does not drift over repeated
+ * suspends and resumes.
+ *
+ * The clock does not advance while the CPU is in power-down sleep.
+ */
+class SystemTime {
+  public:
+    enum : uint16_t {
+        TIMER_PRESCALE = 8,
+        COUNTS_PER_MS = F_CPU / TIMER_PRESCALE / 1000,
+        // How long after a SOF to give up on the next one and fall back to
+        // the timer, in timer counts.
+        SOF_TIMEOUT_COUNTS = COUNTS_PER_MS + COUNTS_PER_MS / 4,
+        // Frame number gaps larger than this are treated as a restart of the
+        // frame numbering rather than missed SOF interrupts.
+        MAX_FRAME_GAP = 16,
+    };
+
+    struct Stats {
+        // The number of milliseconds counted from SOFs and from the timer.
+        uint32_t sofMs{0};
+        uint32_t timerMs{0};
+        // The number of SOF interrupts that ran too late to see their own
+        // frame, according to UDFNUM.
+        uint16_t lateFrames{0};
+        // The number of times the clock locked to the SOF.
+        uint16_t frameLocks{0};
+    };
+
+    static SystemTime *singleton() {
+        return &s_time;
+    }
+
+    /*
+     * Start the clock.
+     *
+     * This does nothing if the clock is already running.
+     */
+    void start();
+
+    /*
+     * Get the number of milliseconds since start().  This wraps after
+     * about 50 days.
+     */
+    uint32_t millis() const;
+
+    /*
+     * Get a sub-millisecond timestamp, in timer counts (8 CPU cycles) since
+     * start().
+     *
+     * This wraps after about 2 hours on 4MHz builds, or 36 minutes on
+     * 16MHz builds, so it is only meant for measuring short intervals:
+     * the difference between two timestamps is correct across a wrap.
+     */
+    uint32_t ticks() const;
+
+    /*
+     * Convert a duration in microseconds into timer counts.
+     */
+    static constexpr uint32_t usToTicks(uint32_t us) {
+        return (us * COUNTS_PER_MS) / 1000;
+    }
+
+    bool isFrameLocked() const {
+        return _frameLocked;
+    }
+
+    /*
+     * Adjust the timer prescaler for a CPU clock slowed down by 8.
+     *
+     * Whoever scales the CPU clock must call this, so that the clock keeps
+     * its rate.
+     */
+    void setSlowClock(bool slow);
+
+    const Stats &getStats() const {
+        return _stats;
+    }
+
+    /*
+     * Notify the clock of a USB start-of-frame.
+     *
+     * This is called from the USB interrupt, whether or not USB is
+     * configured.
+     */
+    void startOfFrame();
+    void timerInterrupt();
+
+  private:
+    SystemTime() {}
+
+    // Forbidden copy constructor and assignment operator
+    SystemTime(SystemTime const &) = delete;
+    SystemTime& operator=(SystemTime const &) = delete;
+
+    void readTime(uint32_t *ms, uint16_t *count) const;
+    void relock(uint16_t frame);
+    uint8_t timerControl() const;
+
+    volatile uint32_t _ms{0};
+    uint16_t _lastFrame{0};
+    volatile bool _frameLocked{false};
+    bool _running{false};
+    bool _slowClock{false};
+    Stats _stats;
+
+    static SystemTime s_time;
+};
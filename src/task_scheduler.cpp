@@ -0,0 +1,186 @@
+// Copyright (c) 2013, Adam Simpkins
+#include <avrpp/task_scheduler.h>
+
+#include <avrpp/atomic.h>
+#include <avrpp/system_time.h>
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+TaskScheduler TaskScheduler::s_scheduler;
+
+void
+TaskScheduler::add(Task *task) {
+    AtomicGuard ag;
+    for (Task *t = _tasks; t; t = t->_next) {
+        if (t == task) {
+            return;
+        }
+    }
+    task->_next = _tasks;
+    _tasks = task;
+}
+
+void
+TaskScheduler::addPeriodic(Task *task, uint16_t period_ms, uint16_t delay_ms) {
+    add(task);
+    AtomicGuard ag;
+    task->_periodMs = period_ms;
+    task->_dueMs = SystemTime::singleton()->millis() + delay_ms;
+    task->_timed = true;
+}
+
+void
+TaskScheduler::addOneShot(Task *task, uint16_t delay_ms) {
+    add(task);
+    AtomicGuard ag;
+    task->_periodMs = 0;
+    task->_dueMs = SystemTime::singleton()->millis() + delay_ms;
+    task->_timed = true;
+}
+
+void
+TaskScheduler::addEvent(Task *task) {
+    add(task);
+    AtomicGuard ag;
+    task->_periodMs = 0;
+    task->_timed = false;
+}
+
+void
+TaskScheduler::remove(Task *task) {
+    AtomicGuard ag;
+    Task **prev = &_tasks;
+    for (Task *t = _tasks; t; t = t->_next) {
+        if (t == task) {
+            *prev = t->_next;
+            break;
+        }
+        prev = &t->_next;
+    }
+    task->_next = nullptr;
+    task->_timed = false;
+    task->_posted = false;
+}
+
+bool
+TaskScheduler::isReady(const Task *task, uint32_t now) const {
+    if (task->_posted) {
+        return true;
+    }
+    return task->_timed && static_cast<int32_t>(now - task->_dueMs) >= 0;
+}
+
+/*
+ * Check whether any task is ready.
+ *
+ * This must be called with interrupts disabled.
+ */
+bool
+TaskScheduler::anyReady() const {
+    const uint32_t now = SystemTime::singleton()->millis();
+    for (const Task *task = _tasks; task; task = task->_next) {
+        if (isReady(task, now)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+TaskScheduler::runOnce() {
+    auto clock = SystemTime::singleton();
+    bool ran = false;
+    Task *task = _tasks;
+    while (task) {
+        // Grab the next pointer first, since the task may remove itself.
+        Task *next = task->_next;
+        if (isReady(task, clock->millis())) {
+            runTask(task);
+            ran = true;
+        }
+        task = next;
+    }
+
+    if (!ran) {
+        idle();
+    }
+    return ran;
+}
+
+void
+TaskScheduler::run() {
+    while (true) {
+        runOnce();
+    }
+}
+
+void
+TaskScheduler::runTask(Task *task) {
+    auto clock = SystemTime::singleton();
+    {
+        AtomicGuard ag;
+        task->_posted = false;
+    }
+    if (task->_timed) {
+        const uint32_t late = clock->millis() - task->_dueMs;
+        if (task->_periodMs == 0) {
+            task->_timed = false;
+        } else if (static_cast<int32_t>(late) >= 0) {
+            // Skip any whole periods we have fallen behind by.
+            uint16_t missed = 0;
+            if (late >= task->_periodMs) {
+                missed = late / task->_periodMs;
+                task->_stats.overruns += missed;
+            }
+            task->_dueMs += (static_cast<uint32_t>(missed) + 1) *
+                task->_periodMs;
+        }
+    }
+
+    const uint32_t start = clock->ticks();
+    task->run();
+    uint32_t elapsed = clock->ticks() - start;
+
+    auto &stats = task->_stats;
+    ++stats.runs;
+    stats.totalTime += elapsed;
+    if (elapsed > 0xffff) {
+        elapsed = 0xffff;
+    }
+    if (elapsed > stats.maxTime) {
+        stats.maxTime = elapsed;
+    }
+}
+
+void
+TaskScheduler::idle() {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+
+    AtomicGuard ag;
+    // The instruction immediately following sei() is always executed before
+    // any pending interrupt is serviced, so a task posted after this check
+    // still wakes us up.
+    if (anyReady()) {
+        return;
+    }
+
+    auto clock = SystemTime::singleton();
+    const uint32_t start = clock->ticks();
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+
+    ++_stats.idleSleeps;
+    _stats.idleTime += clock->ticks() - start;
+}
+
+void
+TaskScheduler::resetStats() {
+    _stats = Stats();
+    for (Task *task = _tasks; task; task = task->_next) {
+        task->resetStats();
+    }
+}
@@ -0,0 +1,171 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A unit of work run by the TaskScheduler.
+ *
+ * Tasks run to completion from the main loop, one at a time, so they never
+ * need to guard against each other.  They still need to guard any state
+ * shared with interrupt handlers.
+ */
+class Task {
+  public:
+    struct Stats {
+        // The number of times the task has run.
+        uint16_t runs{0};
+        // The total and longest time spent in run(), in SystemTime ticks.
+        uint32_t totalTime{0};
+        uint16_t maxTime{0};
+        // For periodic tasks, the number of periods skipped because the
+        // task started a full period or more late.  For event tasks, the
+        // number of posts merged into one run because the task was already
+        // pending.
+        uint16_t overruns{0};
+    };
+
+    explicit Task(const char *name) : _name(name) {}
+    virtual ~Task() {}
+
+    virtual void run() = 0;
+
+    const char *getName() const {
+        return _name;
+    }
+    const Stats &getStats() const {
+        return _stats;
+    }
+    void resetStats() {
+        _stats = Stats();
+    }
+
+    /*
+     * Get the next task registered with the scheduler, for walking the list
+     * returned by TaskScheduler::getTasks().
+     */
+    Task *getNext() const {
+        return _next;
+    }
+
+  private:
+    friend class TaskScheduler;
+
+    // Forbidden copy constructor and assignment operator
+    Task(Task const &) = delete;
+    Task& operator=(Task const &) = delete;
+
+    const char *_name;
+    Task *_next{nullptr};
+    // The run period in milliseconds, or 0 for one-shot and event tasks.
+    uint16_t _periodMs{0};
+    // When the task is next due, in SystemTime milliseconds.
+    uint32_t _dueMs{0};
+    bool _timed{false};
+    volatile bool _posted{false};
+    Stats _stats;
+};
+
+/*
+ * A cooperative, run-to-completion task scheduler.
+ *
+ * Periodic and one-shot tasks are timed with the SystemTime millisecond
+ * clock, which must be started before running any tasks.  Tasks can also
+ * be posted from an interrupt handler, to run as soon as the main loop gets
+ * to them.  When no task is ready the CPU sleeps in SLEEP_MODE_IDLE until
+ * the next interrupt.
+ *
+ * Run times are measured in SystemTime ticks, which are 8 CPU cycles, the
+ * same as the ScanScheduler stats.
+ */
+class TaskScheduler {
+  public:
+    struct Stats {
+        // The number of times the CPU went to sleep with nothing to do, and
+        // the total time spent asleep, in SystemTime ticks.
+        uint32_t idleSleeps{0};
+        uint32_t idleTime{0};
+    };
+
+    static TaskScheduler *singleton() {
+        return &s_scheduler;
+    }
+
+    /*
+     * Run task every period_ms milliseconds, starting delay_ms from now.
+     *
+     * If the task falls a full period or more behind, the missed runs are
+     * skipped rather than made up back to back, and counted as overruns.
+     */
+    void addPeriodic(Task *task, uint16_t period_ms, uint16_t delay_ms = 0);
+    /*
+     * Run task once, delay_ms milliseconds from now.
+     */
+    void addOneShot(Task *task, uint16_t delay_ms);
+    /*
+     * Register a task that only runs when post() is called.
+     */
+    void addEvent(Task *task);
+    /*
+     * Unregister a task.  It will not run again unless re-added.
+     */
+    void remove(Task *task);
+
+    /*
+     * Mark a task ready to run.
+     *
+     * This is safe to call from an interrupt handler.  The task must have
+     * been registered with one of the add methods.
+     */
+    void post(Task *task) {
+        if (task->_posted) {
+            ++task->_stats.overruns;
+        }
+        task->_posted = true;
+    }
+
+    /*
+     * Run every task that is ready.  If none were, sleep until the next
+     * interrupt.
+     *
+     * Returns true if any tasks ran.  This is meant for waiting on a
+     * condition set by an interrupt handler: the condition can be
+     * re-checked after each call, and the SystemTime interrupts bound how
+     * long a call can oversleep.
+     */
+    bool runOnce();
+    /*
+     * Run tasks forever.
+     */
+    void run() __attribute__((noreturn));
+
+    /*
+     * Sleep until the next interrupt.
+     */
+    void idle();
+
+    Task *getTasks() const {
+        return _tasks;
+    }
+    const Stats &getStats() const {
+        return _stats;
+    }
+    void resetStats();
+
+  private:
+    TaskScheduler() {}
+
+    // Forbidden copy constructor and assignment operator
+    TaskScheduler(TaskScheduler const &) = delete;
+    TaskScheduler& operator=(TaskScheduler const &) = delete;
+
+    void add(Task *task);
+    bool isReady(const Task *task, uint32_t now) const;
+    bool anyReady() const;
+    void runTask(Task *task);
+
+    Task *_tasks{nullptr};
+    Stats _stats;
+
+    static TaskScheduler s_scheduler;
+};
@@ -4,11 +4,14 @@
 #include <avrpp/atomic.h>
 #include <avrpp/avr_registers.h>
 #include <avrpp/log.h>
+#include <avrpp/system_time.h>
 #include <avrpp/usb_descriptors.h>
+#include <avrpp/util.h>
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <util/delay.h>
 
 F_LOG_LEVEL(1);
 
@@ -18,30 +21,11 @@ UsbController::UsbController() {
 }
 
 bool
-UsbController::addInterface(UsbInterface* iface) {
-    UsbInterface** free_entry{nullptr};
-    auto number = iface->getNumber();
-    for (auto &entry : _interfaces) {
-        if (entry == nullptr) {
-            if (free_entry == nullptr) {
-                free_entry = &entry;
-            }
-        } else if (entry->getNumber() == number) {
-            // Duplicate interface number
-            return false;
-        }
-    }
-
-    if (free_entry == nullptr) {
-        // No free interface slots
+UsbController::setInterfaceTable(UsbInterfaceTable* table) {
+    if (!table->addEndpoints(this)) {
         return false;
     }
-
-    // Add the interface endpoints
-    if (!iface->addEndpoints(this)) {
-        return false;
-    }
-    *free_entry = iface;
+    _interfaceTable = table;
     return true;
 }
 
@@ -116,8 +100,14 @@ UsbController::endpointInterrupt() {
 
 void
 UsbController::generalInterrupt() {
-    const auto intr_flags = get_UDINT();
-    set_UDINT(UDINTFlags::NONE);
+    auto intr_flags = get_UDINT();
+    // The SUSPEND flag is left set for as long as we are suspended, since
+    // the controller will only send a remote wakeup while it is set.  Its
+    // interrupt is disabled in the meantime, so ignore it until we wake.
+    if (suspended()) {
+        intr_flags = intr_flags & ~UDINTFlags::SUSPEND;
+    }
+    set_UDINT(UDINTFlags::SUSPEND);
 
     // END_OF_RESET:
     // The host just reset us.  Move back to an unconfigured state,
@@ -132,22 +122,28 @@ UsbController::generalInterrupt() {
         set_UECFG1X(UECFG1XFlags::CFG1_ALLOC | UECFG1XFlags::SINGLE_BANK |
                     usb_cfg_size(_endpoint0Size));
         set_UEIENX(UEIENXFlags::RX_SETUP);
-        _state &= ~StateFlags::CONFIGURED;
+        _state &= ~(StateFlags::CONFIGURED |
+                    StateFlags::REMOTE_WAKEUP_ENABLED);
         if (_stateCallback) {
             _stateCallback->onUnconfigured();
         }
     }
 
+    if (isset(intr_flags, UDINTFlags::START_OF_FRAME)) {
+        SystemTime::singleton()->startOfFrame();
+    }
     if (isset(intr_flags, UDINTFlags::START_OF_FRAME) && configured()) {
-        for (const auto& iface : _interfaces) {
-            if (iface) {
-                iface->startOfFrame();
-            }
+        if (_interfaceTable) {
+            _interfaceTable->startOfFrame();
+        }
+        if (_stateCallback) {
+            _stateCallback->onStartOfFrame();
         }
     }
 
     if (isset(intr_flags, UDINTFlags::SUSPEND)) {
         _state |= StateFlags::SUSPENDED;
+        remove_UDIEN(UDIENFlags::SUSPEND);
         add_UDIEN(UDIENFlags::WAKE_UP);
         add_USBCON(USBCONFlags::FREEZE_CLOCK);
         if (_stateCallback) {
@@ -157,6 +153,8 @@ UsbController::generalInterrupt() {
     if (isset(intr_flags, UDINTFlags::WAKE_UP)) {
         remove_USBCON(USBCONFlags::FREEZE_CLOCK);
         remove_UDIEN(UDIENFlags::WAKE_UP);
+        remove_UDINT(UDINTFlags::SUSPEND);
+        add_UDIEN(UDIENFlags::SUSPEND);
         _state &= ~StateFlags::SUSPENDED;
         if (_stateCallback) {
             _stateCallback->onWake();
@@ -164,6 +162,38 @@ UsbController::generalInterrupt() {
     }
 }
 
+bool
+UsbController::sendRemoteWakeup() {
+    if (!suspended() || !remoteWakeupEnabled()) {
+        return false;
+    }
+    // The delays below would be stretched past what the spec allows.
+    if (!check_full_speed()) {
+        return false;
+    }
+
+    // USB 2.0 section 7.1.7.7: the bus must have been idle for at least 5ms
+    // before we signal resume.  The SUSPEND interrupt fires after 3ms of
+    // idle, so wait out the rest of that window in case a key was pressed
+    // right as we suspended.
+    _delay_ms(2);
+
+    // The controller needs its clock to drive the bus.  It times the resume
+    // K state itself, and clears REMOTE_WAKE_UP once it is done.  The spec
+    // allows the K state to last at most 15ms, so give up after that rather
+    // than hang the USB interrupt if the controller never finishes.
+    remove_USBCON(USBCONFlags::FREEZE_CLOCK);
+    add_UDCON(UDCONFlags::REMOTE_WAKE_UP);
+    for (uint8_t n = 0; n < 150; ++n) {
+        if (!isset_UDCON(UDCONFlags::REMOTE_WAKE_UP)) {
+            return true;
+        }
+        _delay_us(100);
+    }
+    FLOG(1, "remote wakeup signalling did not finish\n");
+    return false;
+}
+
 bool
 UsbController::waitForTxReady() {
     // FIXME: Add a loop limit, so we cannot loop here infinitely.
@@ -253,11 +283,8 @@ UsbController::processSetupPacket() {
         handled = processDeviceSetupPacket(&pkt);
     } else if (recipient == RECIPIENT_INTERFACE) {
         const uint8_t num = (pkt.wIndex & 0xff);
-        for (const auto& iface : _interfaces) {
-            if (iface && iface->getNumber() == num) {
-                handled = iface->handleSetupPacket(&pkt);
-                break;
-            }
+        if (_interfaceTable) {
+            handled = _interfaceTable->handleSetupPacket(num, &pkt);
         }
     } else if (recipient == RECIPIENT_ENDPOINT) {
         for (const auto& ep : _endpoints) {
@@ -312,8 +339,22 @@ UsbController::processDeviceSetupPacket(const SetupPacket *pkt) {
         return true;
     } else if (pkt->bRequest == StdRequestType::GET_STATUS) {
         waitForTxReady();
+        // Bit 1 reports whether remote wakeup is enabled.
+        // We are never self-powered, so bit 0 is always clear.
+        UEDATX = remoteWakeupEnabled() ? 0x02 : 0;
         UEDATX = 0;
-        UEDATX = 0;
+        sendIn();
+        return true;
+    } else if ((pkt->bRequest == StdRequestType::SET_FEATURE ||
+                pkt->bRequest == StdRequestType::CLEAR_FEATURE) &&
+               pkt->wValue == FEATURE_DEVICE_REMOTE_WAKEUP) {
+        // The host only does this if our config descriptor advertises
+        // remote wakeup support.
+        if (pkt->bRequest == StdRequestType::SET_FEATURE) {
+            _state |= StateFlags::REMOTE_WAKEUP_ENABLED;
+        } else {
+            _state &= ~StateFlags::REMOTE_WAKEUP_ENABLED;
+        }
         sendIn();
         return true;
     }
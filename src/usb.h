@@ -42,6 +42,11 @@ enum StdRequestType : uint8_t {
     SET_INTERFACE = 11,
 };
 
+enum StdFeature : uint16_t {
+    FEATURE_ENDPOINT_HALT = 0,
+    FEATURE_DEVICE_REMOTE_WAKEUP = 1,
+};
+
 enum DescriptorType : uint8_t {
     DT_DEVICE = 1,
     DT_CONFIG = 2,
@@ -58,7 +63,6 @@ enum DescriptorType : uint8_t {
 };
 
 enum {
-    MAX_INTERFACES = 4,
     MAX_ENDPOINTS = 6,  // AT90USB128X/64x supports up to 6 endpoints
 };
 
@@ -83,28 +87,57 @@ class UsbEndpoint {
     const uint8_t _number{0xff};
 };
 
+/*
+ * The base class for USB interfaces.
+ *
+ * Interfaces are installed with a UsbInterfaceList, which calls them
+ * through their concrete types, so these methods are not virtual.  Each
+ * subclass must provide:
+ *
+ *   bool addEndpoints(UsbController* usb);
+ *   bool handleSetupPacket(const SetupPacket* pkt);
+ *   void startOfFrame();
+ */
 class UsbInterface {
   public:
     explicit UsbInterface(uint8_t number) : _number(number) {}
-    virtual ~UsbInterface() {}
 
     uint8_t getNumber() const {
         return _number;
     }
 
-    virtual bool addEndpoints(UsbController* usb) = 0;
-    virtual bool handleSetupPacket(const SetupPacket* pkt) = 0;
-    virtual void startOfFrame() {}
-
   private:
     const uint8_t _number{0xff};
 };
 
+/*
+ * The set of interfaces that the UsbController dispatches to.
+ *
+ * UsbInterfaceList in usb_iface_list.h implements this for a set of
+ * interface types known at compile time.
+ */
+class UsbInterfaceTable {
+  public:
+    virtual ~UsbInterfaceTable() {}
+
+    virtual bool addEndpoints(UsbController* usb) = 0;
+    /*
+     * Pass a SETUP packet to the interface with the given number.
+     *
+     * Returns false if there is no such interface, or if it did not handle
+     * the packet.
+     */
+    virtual bool handleSetupPacket(uint8_t number, const SetupPacket* pkt) = 0;
+    virtual void startOfFrame() = 0;
+};
+
 class UsbController {
   public:
     enum StateFlags : uint8_t {
         CONFIGURED = 0x01,
         SUSPENDED = 0x02,
+        // The host has enabled remote wakeup with SET_FEATURE.
+        REMOTE_WAKEUP_ENABLED = 0x04,
     };
     class StateCallback {
       public:
@@ -116,13 +149,22 @@ class UsbController {
         virtual void onUnconfigured() {}
         virtual void onSuspend() {}
         virtual void onWake() {}
+        // Called on every start-of-frame while configured, after the
+        // interfaces' startOfFrame() handlers.
+        virtual void onStartOfFrame() {}
     };
 
     static UsbController *singleton() {
         return &s_controller;
     }
 
-    bool addInterface(UsbInterface *iface);
+    /**
+     * Install the device's interfaces.
+     *
+     * The table's endpoints are added immediately.  Returns false if that
+     * fails, in which case the table is not installed.
+     */
+    bool setInterfaceTable(UsbInterfaceTable *table);
     bool addEndpoint(UsbEndpoint *endpoint);
 
     void init(uint8_t endpoint0_size, pgm_ptr<UsbDescriptor> descriptors);
@@ -140,6 +182,9 @@ class UsbController {
     bool suspended() const {
         return (_state & (StateFlags::SUSPENDED));
     }
+    bool remoteWakeupEnabled() const {
+        return (_state & (StateFlags::REMOTE_WAKEUP_ENABLED));
+    }
     StateFlags getState() const {
         return static_cast<StateFlags>(_state);
     }
@@ -164,6 +209,20 @@ class UsbController {
     void endpointInterrupt();
     void generalInterrupt();
 
+    /**
+     * Signal resume to the host while suspended.
+     *
+     * Returns false without doing anything unless we are suspended and the
+     * host has enabled remote wakeup.  The host follows up with its own
+     * resume signalling, which is handled by the normal WAKE_UP interrupt.
+     *
+     * This busy-waits for a few milliseconds, and must not be called on a
+     * scaled-down CPU clock: it returns false without signalling if it is.
+     * It also returns false if the controller is still signalling after
+     * 15ms.
+     */
+    bool sendRemoteWakeup();
+
     void handleGetDescriptor(const SetupPacket *pkt);
 
     /**
@@ -229,7 +288,7 @@ class UsbController {
     void unconfigure();
 
     volatile uint8_t _state{0};
-    UsbInterface* _interfaces[MAX_INTERFACES]{nullptr};
+    UsbInterfaceTable* _interfaceTable{nullptr};
     UsbEndpoint* _endpoints[MAX_ENDPOINTS]{nullptr};
     uint8_t _endpoint0Size{32};
     UsbDescriptorMap _descriptors;
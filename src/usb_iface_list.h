@@ -0,0 +1,92 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <avrpp/usb.h>
+
+/*
+ * A chain of interface pointers, one per type in IfacesT.
+ *
+ * Each interface is called through its own type, so the types must be the
+ * concrete interface classes.  Null entries are skipped, so optional
+ * interfaces can be left unset.
+ */
+template<typename... IfacesT>
+class UsbInterfaceChain;
+
+template<>
+class UsbInterfaceChain<> {
+  public:
+    void set() {}
+
+    bool addEndpoints(UsbController*) {
+        return true;
+    }
+    bool handleSetupPacket(uint8_t, const SetupPacket*) {
+        return false;
+    }
+    void startOfFrame() {}
+};
+
+template<typename IfaceT, typename... RestT>
+class UsbInterfaceChain<IfaceT, RestT...> {
+  public:
+    void set(IfaceT *iface, RestT*... rest) {
+        _iface = iface;
+        _rest.set(rest...);
+    }
+
+    bool addEndpoints(UsbController* usb) {
+        if (_iface && !_iface->addEndpoints(usb)) {
+            return false;
+        }
+        return _rest.addEndpoints(usb);
+    }
+    bool handleSetupPacket(uint8_t number, const SetupPacket* pkt) {
+        if (_iface && _iface->getNumber() == number) {
+            return _iface->handleSetupPacket(pkt);
+        }
+        return _rest.handleSetupPacket(number, pkt);
+    }
+    void startOfFrame() {
+        if (_iface) {
+            _iface->startOfFrame();
+        }
+        _rest.startOfFrame();
+    }
+
+  private:
+    IfaceT *_iface{nullptr};
+    UsbInterfaceChain<RestT...> _rest;
+};
+
+/*
+ * A UsbInterfaceTable for a set of interface types known at compile time.
+ *
+ * The UsbController makes a single virtual call into the list for each
+ * start-of-frame or interface SETUP packet, and the list then calls the
+ * matching interfaces directly.
+ *
+ * Set the interfaces with set() before installing the list with
+ * UsbController::setInterfaceTable().
+ */
+template<typename... IfacesT>
+class UsbInterfaceList final : public UsbInterfaceTable {
+  public:
+    void set(IfacesT*... ifaces) {
+        _chain.set(ifaces...);
+    }
+
+    virtual bool addEndpoints(UsbController* usb) override {
+        return _chain.addEndpoints(usb);
+    }
+    virtual bool handleSetupPacket(uint8_t number,
+                                   const SetupPacket* pkt) override {
+        return _chain.handleSetupPacket(number, pkt);
+    }
+    virtual void startOfFrame() override {
+        _chain.startOfFrame();
+    }
+
+  private:
+    UsbInterfaceChain<IfacesT...> _chain;
+};
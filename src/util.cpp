@@ -1,19 +1,39 @@
 // Copyright (c) 2013, Adam Simpkins
 #include <avrpp/avr_registers.h>
 #include <avrpp/log.h>
+#include <avrpp/util.h>
 
 #include <avr/wdt.h>
 #include <stdlib.h>
 
+F_LOG_LEVEL(1);
+
 void set_cpu_prescale() {
     static_assert(F_CPU * (1 << CPU_PRESCALE) == 16000000,
                   "F_CPU and CPU_PRESCALE definitions do not match");
+    set_cpu_prescale(CPU_PRESCALE);
+}
 
+void set_cpu_prescale(uint8_t prescale) {
+    // The second CLKPR write must happen within 4 cycles of the first,
+    // so don't let an interrupt in between them.
+    uint8_t sreg = SREG;
+    cli();
     // Set the CLKPR register to 0x80 to enable changing the CPU scaling
     CLKPR = 0x80;
     // Now set it to a value with the high bit clear, to change the actual
     // scaling.
-    CLKPR = CPU_PRESCALE;
+    CLKPR = prescale;
+    SREG = sreg;
+}
+
+bool check_full_speed() {
+    if (LIKELY((CLKPR & 0x0f) == CPU_PRESCALE)) {
+        return true;
+    }
+    FLOG(1, "compile-time delay needed with the CPU clock divided by %d\n",
+         1 << ((CLKPR & 0x0f) - CPU_PRESCALE));
+    return false;
 }
 
 // Disable the watchdog very early during startup.
@@ -1,7 +1,31 @@
 // Copyright (c) 2013, Adam Simpkins
 #pragma once
 
+#include <stdint.h>
+
 #define LIKELY(x)   (__builtin_expect((x), 1))
 #define UNLIKELY(x) (__builtin_expect((x), 0))
 
+/*
+ * Set the CPU clock to F_CPU, as configured for this build.
+ */
 void set_cpu_prescale();
+/*
+ * Set the CPU clock to 16MHz / (1 << prescale).
+ *
+ * Everything that derives timing from F_CPU at compile time (_delay_us(),
+ * _delay_ms(), timer periods) runs slower by the same factor until the
+ * clock is set back with set_cpu_prescale().
+ */
+void set_cpu_prescale(uint8_t prescale);
+
+/*
+ * Check that the CPU is running at F_CPU.
+ *
+ * Compile-time delays (_delay_us(), _delay_ms()) are only right at F_CPU,
+ * and ScanScheduler::setSlowClock() divides the clock by 8 while the
+ * keyboard is idle.  Code that may run then should check this before
+ * relying on such delays.  A message is logged when this returns false, so
+ * that a missed switch back to full speed shows up in the debug log.
+ */
+bool check_full_speed();
@@ -0,0 +1,155 @@
+// Copyright (c) 2013, Adam Simpkins
+//
+// Run SystemTime against a model of timer 3 and a host sending USB
+// start-of-frame packets, through many suspends and resumes.
+//
+// While the host's frames keep the same phase, the clock must come back to
+// exactly the same offset from them every time it locks again, so that it
+// doesn't drift.  When the phase changes (as after a bus reset), each relock
+// may move the offset by at most half a millisecond.  The sub-millisecond
+// timestamps must never go backwards.
+#include <avrpp/system_time.h>
+
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+volatile uint8_t SREG;
+volatile uint8_t PRR1;
+volatile uint8_t TCCR3A;
+volatile uint8_t TCCR3B;
+volatile uint16_t TCNT3;
+volatile uint16_t OCR3A;
+FlagRegister TIFR3;
+volatile uint8_t TIMSK3;
+volatile uint16_t UDFNUM;
+
+void TIMER3_COMPA_vect();
+
+enum : uint16_t {
+    COUNTS = SystemTime::COUNTS_PER_MS,
+};
+
+namespace {
+
+// Real time, in timer counts since the clock was started.
+uint32_t g_now;
+// Where the host's frames start within each millisecond of real time, in
+// timer counts.
+uint32_t g_framePhase;
+bool g_failed;
+uint32_t g_lastTicks;
+
+void fail(const char *what) {
+    if (!g_failed) {
+        printf("FAIL: %s at %u counts\n", what, g_now);
+    }
+    g_failed = true;
+}
+
+/*
+ * Advance real time by one timer count.
+ *
+ * The timer counts up to OCR3A and restarts, flagging a compare match.  If
+ * the host sends a SOF at the same time, the USB interrupt runs first, as
+ * it has the higher priority on the AVR.
+ */
+void step(bool sof) {
+    ++g_now;
+    if (TCNT3 == OCR3A) {
+        TCNT3 = 0;
+        TIFR3.value |= (1 << OCF3A);
+    } else {
+        ++TCNT3;
+    }
+
+    auto clock = SystemTime::singleton();
+    if (sof) {
+        UDFNUM = ((g_now + COUNTS - g_framePhase) / COUNTS) & 0x7ff;
+        clock->startOfFrame();
+    }
+    if ((TIFR3 & (1 << OCF3A)) && (TIMSK3 & (1 << OCIE3A))) {
+        TIFR3.value &= ~(1 << OCF3A);
+        TIMER3_COMPA_vect();
+    }
+
+    const uint32_t ticks = clock->ticks();
+    if (ticks < g_lastTicks) {
+        fail("the clock went backwards");
+    }
+    g_lastTicks = ticks;
+}
+
+/*
+ * Run for the specified number of milliseconds, with or without frames
+ * from the host.
+ */
+void run(uint32_t ms, bool frames) {
+    for (uint32_t n = 0; n < ms * COUNTS; ++n) {
+        step(frames && ((g_now + 1 + COUNTS - g_framePhase) % COUNTS) == 0);
+    }
+}
+
+/*
+ * The clock's offset from real time, in timer counts, as measured on a
+ * frame boundary while it is locked.
+ */
+int32_t lockedOffset() {
+    run(1, true);
+    const uint32_t to_frame =
+        COUNTS - ((g_now + COUNTS - g_framePhase) % COUNTS);
+    for (uint32_t n = 0; n < to_frame; ++n) {
+        step(n + 1 == to_frame);
+    }
+    if (!SystemTime::singleton()->isFrameLocked()) {
+        fail("the clock did not lock to the frames");
+    }
+    return static_cast<int32_t>(SystemTime::singleton()->ticks() - g_now);
+}
+
+}
+
+int main() {
+    auto clock = SystemTime::singleton();
+    clock->start();
+    g_framePhase = 700;
+
+    srand(1);
+    int32_t offset = lockedOffset();
+    uint32_t max_shift = 0;
+    uint16_t phase_changes = 0;
+    for (uint16_t cycle = 0; cycle < 300; ++cycle) {
+        run(20 + rand() % 80, true);
+        // Suspend, or unplug.
+        run(3 + rand() % 300, false);
+        const bool new_phase = (rand() % 4 == 0);
+        if (new_phase) {
+            g_framePhase = rand() % COUNTS;
+            ++phase_changes;
+        }
+
+        const int32_t new_offset = lockedOffset();
+        const uint32_t shift = abs(new_offset - offset);
+        if (!new_phase && shift != 0) {
+            printf("cycle %u: offset moved from %d to %d counts\n",
+                   cycle, offset, new_offset);
+            fail("the clock drifted over a suspend");
+        }
+        if (shift > COUNTS / 2) {
+            printf("cycle %u: offset moved from %d to %d counts\n",
+                   cycle, offset, new_offset);
+            fail("relocking moved the clock by more than half a frame");
+        }
+        if (shift > max_shift) {
+            max_shift = shift;
+        }
+        offset = new_offset;
+    }
+
+    const auto &stats = clock->getStats();
+    printf("%u ms: %u locks, %u phase changes, largest relock shift %u "
+           "counts, final offset %d counts\n",
+           g_now / COUNTS, stats.frameLocks, phase_changes, max_shift,
+           offset);
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,11 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <avr/io.h>
+
+// There are no interrupts on the host.
+static inline void sei() {}
+static inline void cli() {}
+
+// Interrupt handlers become plain functions, which the tests call.
+#define ISR(vector) void vector()
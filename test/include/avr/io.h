@@ -0,0 +1,40 @@
+// Copyright (c) 2013, Adam Simpkins
+//
+// Minimal stand-ins for the avr-libc headers, so that hardware-independent
+// library code can be built and tested on the host.  Only what the tests
+// actually use is defined here.
+#pragma once
+
+#include <stdint.h>
+
+// The status register, for AtomicGuard.
+extern volatile uint8_t SREG;
+
+// Interrupt flag registers, which clear the bits written to them as the
+// hardware ones do.
+struct FlagRegister {
+    FlagRegister &operator=(uint8_t bits) {
+        value &= ~bits;
+        return *this;
+    }
+    operator uint8_t() const {
+        return value;
+    }
+    uint8_t value;
+};
+
+// Timer 3 and the USB frame number, for SystemTime.
+extern volatile uint8_t PRR1;
+extern volatile uint8_t TCCR3A;
+extern volatile uint8_t TCCR3B;
+extern volatile uint16_t TCNT3;
+extern volatile uint16_t OCR3A;
+extern FlagRegister TIFR3;
+extern volatile uint8_t TIMSK3;
+extern volatile uint16_t UDFNUM;
+#define PRTIM3 3
+#define WGM32 3
+#define CS30 0
+#define CS31 1
+#define OCF3A 1
+#define OCIE3A 1
@@ -0,0 +1,13 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <avr/io.h>
+#include <stddef.h>
+
+// The host has a single address space, so program memory is ordinary
+// read-only data.
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*reinterpret_cast<const uint8_t*>(p))
+#define pgm_read_word(p) (*reinterpret_cast<const uint16_t*>(p))
+#define pgm_read_dword(p) (*reinterpret_cast<const uint32_t*>(p))
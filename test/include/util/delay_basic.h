@@ -0,0 +1,8 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <avr/io.h>
+
+// The matrix model settles instantly, so delays are no-ops.
+static inline void _delay_loop_1(uint8_t) {}
+static inline void _delay_loop_2(uint16_t) {}
@@ -0,0 +1,184 @@
+// Copyright (c) 2013, Adam Simpkins
+//
+// Check the simple blocking resolveGhosting(), used when
+// COMPLEX_GHOSTING_RESOLUTION is 0, against the plain nested loop over
+// (col_a, row_a, row_b, col_b) that it replaced.
+//
+// The scans read arbitrary key maps rather than an electrical model, so the
+// maps need not be ones a real matrix could produce.  Each keyboard scans a
+// random sequence of maps, and after every scan the keys reported must be
+// those the nested loop leaves, given the previous scan's report.  Only the
+// first keys pressed are listed by getState(), so past that only the count
+// of keys down can be compared.
+// The sequences repeat maps, so the resolution memo is checked too.
+#include "MatrixModel.h"
+
+#include <avrpp/log.h>
+#include <avrpp/usb_hid_keyboard.h>
+F_LOG_LEVEL(0);
+// Test simple blocking, not the component resolver.
+#define COMPLEX_GHOSTING_RESOLUTION 0
+#include <avrpp/kbd/KbdDiodeImpl-defs.h>
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * A stand-in for MatrixModel whose scans see an arbitrary set of keys:
+ * signalling a column shows exactly the keys set in that column.
+ */
+template<uint8_t NC, uint8_t NR>
+class RawMatrix {
+  public:
+    typedef std::bitset<NC * NR> Keys;
+
+    static uint16_t keyIndex(uint8_t col, uint8_t row) {
+        return (static_cast<uint16_t>(row) * NC) + col;
+    }
+    static uint32_t colBit(uint8_t col) {
+        return static_cast<uint32_t>(1) << col;
+    }
+    static uint32_t rowBit(uint8_t row) {
+        return static_cast<uint32_t>(1) << (NC + row);
+    }
+
+    void setDiode(uint8_t, uint8_t, bool) {}
+    void setPressed(const Keys &keys) {
+        _pressed = keys;
+    }
+
+    void signalCol(uint8_t col) {
+        _col = col;
+    }
+    void signalRow(uint8_t) {
+        // Simple blocking never scans the rows.
+        abort();
+    }
+    void signalAllCols() {
+        _col = NC;
+    }
+    void release() {
+        _col = NC;
+    }
+    uint32_t readLines() {
+        uint32_t lines = 0;
+        if (_col < NC) {
+            lines |= colBit(_col);
+            for (uint8_t row = 0; row < NR; ++row) {
+                if (_pressed[keyIndex(_col, row)]) {
+                    lines |= rowBit(row);
+                }
+            }
+        }
+        return lines;
+    }
+
+  private:
+    Keys _pressed;
+    uint8_t _col{NC};
+};
+
+/*
+ * The blocking loop as it was before rectangles were found with row masks.
+ */
+template<uint8_t NC, uint8_t NR>
+static std::bitset<NC * NR> nestedLoop(std::bitset<NC * NR> cur,
+                                       const std::bitset<NC * NR> &prev) {
+    typedef RawMatrix<NC, NR> Raw;
+    for (uint8_t col_a = 0; col_a < NC; ++col_a) {
+        for (uint8_t row_a = 0; row_a < NR; ++row_a) {
+            if (!cur[Raw::keyIndex(col_a, row_a)]) {
+                continue;
+            }
+            for (uint8_t row_b = row_a + 1; row_b < NR; ++row_b) {
+                if (!cur[Raw::keyIndex(col_a, row_b)]) {
+                    continue;
+                }
+                for (uint8_t col_b = col_a + 1; col_b < NC; ++col_b) {
+                    const uint16_t idx_ba = Raw::keyIndex(col_b, row_a);
+                    const uint16_t idx_bb = Raw::keyIndex(col_b, row_b);
+                    if (!cur[idx_ba] || !cur[idx_bb]) {
+                        continue;
+                    }
+                    const uint16_t corners[4] = {
+                        Raw::keyIndex(col_a, row_a),
+                        Raw::keyIndex(col_a, row_b),
+                        idx_ba,
+                        idx_bb,
+                    };
+                    for (uint16_t idx : corners) {
+                        if (!prev[idx]) {
+                            cur.reset(idx);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return cur;
+}
+
+/*
+ * Scan sequences of random maps on an NC x NR matrix, and return the number
+ * of scans that didn't match the nested loop.
+ */
+template<uint8_t NC, uint8_t NR>
+static uint32_t checkMatrix(uint32_t sequences, uint32_t *scans) {
+    typedef ModelKeyboard<NC, NR, DiodeList<>, RawMatrix<NC, NR>> Kbd;
+    typedef typename Kbd::Keys Keys;
+
+    uint32_t failures = 0;
+    srand(NC * NR);
+    for (uint32_t seq = 0; seq < sequences; ++seq) {
+        typename Kbd::Model model;
+        Kbd kbd(&model);
+        // Report exactly what was resolved.
+        kbd.setDebounce(Kbd::DEBOUNCE_NORMAL, 1, 1);
+
+        // A few maps of one density, scanned in a random order.
+        const int density = 2 + (rand() % 20);
+        Keys maps[4];
+        for (Keys &map : maps) {
+            for (uint16_t k = 0; k < NC * NR; ++k) {
+                if (rand() % 100 < density) {
+                    map.set(k);
+                }
+            }
+        }
+
+        Keys expected;
+        for (uint8_t scan = 0; scan < 8; ++scan) {
+            const Keys &map = maps[rand() % 4];
+            model.setPressed(map);
+            kbd.scan();
+            expected = nestedLoop<NC, NR>(map, expected);
+            ++*scans;
+            // Only so many keys are listed, so check that those are
+            // expected, and that the count matches.
+            uint16_t count;
+            const Keys reported = kbd.reported(&count);
+            if ((reported & ~expected).any() || count != expected.count()) {
+                if (failures < 5) {
+                    printf("FAIL: %dx%d, sequence %u scan %d differs from "
+                           "the nested loop\n", NC, NR, seq, scan);
+                }
+                ++failures;
+                break;
+            }
+        }
+    }
+    return failures;
+}
+
+int main() {
+    uint32_t scans = 0;
+    uint32_t failures = 0;
+    failures += checkMatrix<3, 5>(20000, &scans);
+    failures += checkMatrix<4, 4>(20000, &scans);
+    failures += checkMatrix<6, 12>(20000, &scans);
+    failures += checkMatrix<8, 18>(20000, &scans);
+    failures += checkMatrix<12, 16>(20000, &scans);
+    printf("Simple blocking: %u scans, %u failures\n", scans, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,289 @@
+// Copyright (c) 2013, Adam Simpkins
+//
+// Run ghosting resolution on key patterns chosen to make it work hard, and
+// check that it keeps to the bound documented with RESOLVE_BUDGET_US.
+//
+// The matrix has the keyboard_v2 dimensions.  Every line read advances the
+// host clock, so the time budget runs out as it would on the keyboard, and
+// the reads made after it has run out are counted.  Only one more unit of
+// work may start then, and its reads are limited to one re-scan pass.
+//
+// Host time per scan is printed too, to show what the unbudgeted work
+// costs relative to the rest.  It is not a substitute for timing on the
+// AVR, where maxResolveTicks in logStats() gives the real figure.
+//
+// Finally the ghosting resolution memo is checked while a chord is held.
+#include "MatrixModel.h"
+
+#include <avrpp/log.h>
+#include <avrpp/usb_hid_keyboard.h>
+F_LOG_LEVEL(0);
+#include <avrpp/kbd/KbdDiodeImpl-defs.h>
+
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum : uint8_t {
+    NC = 8,
+    NR = 18,
+    // The scans run on each pattern, so that deferred work can be picked
+    // up again.
+    SCANS = 8,
+};
+/*
+ * The most line reads a re-scan of a component with the specified number of
+ * columns and rows makes: it signals each column twice, reading the rows
+ * and columns each time, and reads the columns from each row.
+ */
+static constexpr uint32_t rescanReads(uint8_t cols, uint8_t rows) {
+    return (2 * cols * 2) + rows;
+}
+
+/*
+ * Diodes on every other key, in a checkerboard.  Mixing keys with and
+ * without diodes makes resolution search through the key states.
+ */
+struct CheckerDiodes {
+    static constexpr bool isDiode(uint16_t col, uint16_t row) {
+        return col < NC && row < NR && ((col + row) & 1);
+    }
+    static constexpr uint8_t mapByte(uint8_t n, uint8_t stride,
+                                     uint8_t bit = 0) {
+        return bit >= 8 ? 0 :
+            (isDiode(((n * 8) + bit) / stride, ((n * 8) + bit) % stride) ?
+             static_cast<uint8_t>(1 << bit) : 0) |
+            mapByte(n, stride, bit + 1);
+    }
+    template<uint8_t C, uint8_t R>
+    static constexpr bool fits() {
+        return true;
+    }
+};
+
+typedef MatrixModel<NC, NR> Model;
+typedef Model::Keys Keys;
+
+static void press(Keys *keys, uint8_t col, uint8_t row) {
+    keys->set(Model::keyIndex(col, row));
+}
+
+struct Pattern {
+    const char *name;
+    Keys keys;
+    // The most reads any one unit of work on the pattern makes, and so the
+    // most that may be made once the budget has run out.
+    uint32_t unitReads;
+};
+
+static std::vector<Pattern> makePatterns() {
+    std::vector<Pattern> patterns;
+
+    // Every row has 2 or more keys down, so every pair of rows is compared,
+    // and everything is one component too large to resolve.
+    Keys all;
+    all.set();
+    patterns.push_back({"all keys", all, 0});
+
+    // As many separate rectangles as fit: each one is its own unit of
+    // work, with its own re-scan.
+    Keys rects;
+    for (uint8_t n = 0; n < NC / 2; ++n) {
+        press(&rects, 2 * n, 2 * n);
+        press(&rects, 2 * n + 1, 2 * n);
+        press(&rects, 2 * n, 2 * n + 1);
+        press(&rects, 2 * n + 1, 2 * n + 1);
+    }
+    patterns.push_back({"separate rectangles", rects, rescanReads(2, 2)});
+
+    // Components of 8 keys, the largest that are searched: 4 tall ones,
+    // and 2 wide ones that each take a longer re-scan.
+    Keys tall;
+    for (uint8_t n = 0; n < NC / 2; ++n) {
+        for (uint8_t row = 4 * n; row < (4 * n) + 4; ++row) {
+            press(&tall, 2 * n, row);
+            press(&tall, 2 * n + 1, row);
+        }
+    }
+    patterns.push_back({"tall components", tall, rescanReads(2, 4)});
+    Keys wide;
+    for (uint8_t n = 0; n < 2; ++n) {
+        for (uint8_t col = 4 * n; col < (4 * n) + 4; ++col) {
+            press(&wide, col, 2 * n);
+            press(&wide, col, 2 * n + 1);
+        }
+    }
+    patterns.push_back({"wide components", wide, rescanReads(4, 2)});
+
+    // A staircase through every column, joined to a rectangle at one end,
+    // so that finding the component takes the longest flood fill.
+    Keys stairs;
+    for (uint8_t col = 0; col < NC; ++col) {
+        press(&stairs, col, 2 * col);
+        press(&stairs, col, 2 * col + 1);
+        if (col + 1 < NC) {
+            press(&stairs, col + 1, 2 * col + 1);
+        }
+    }
+    press(&stairs, 1, 0);
+    patterns.push_back({"staircase", stairs, 0});
+
+    srand(1);
+    for (uint8_t n = 0; n < 4; ++n) {
+        Keys random;
+        for (uint16_t k = 0; k < NC * NR; ++k) {
+            if (rand() % 4 == 0) {
+                random.set(k);
+            }
+        }
+        patterns.push_back({"random", random, rescanReads(8, 8)});
+    }
+    return patterns;
+}
+
+template<typename DiodesT>
+static bool runPatterns(const char *layout, uint16_t read_ticks) {
+    typedef ModelKeyboard<NC, NR, DiodesT> Kbd;
+
+    const uint16_t budget_ticks =
+        ScanScheduler::usToTicks(Kbd::RESOLVE_BUDGET_US);
+    const uint32_t budget_reads =
+        (budget_ticks + read_ticks - 1) / read_ticks;
+    printf("%s diodes, %u ticks per read, budget %u reads:\n",
+           layout, read_ticks, budget_reads);
+
+    bool ok = true;
+    for (const Pattern &pattern : makePatterns()) {
+        Model model;
+        model.readTicks = read_ticks;
+        model.setPressed(pattern.keys);
+        Kbd kbd(&model);
+        // The keys never change during a re-scan here, so let slow re-scans
+        // through and leave the budget to cut resolution short.
+        kbd.setRescanWindow(4000);
+
+        uint32_t max_reads = 0;
+        uint32_t max_resolve_reads = 0;
+        uint32_t max_late_reads = 0;
+        uint32_t deferrals = 0;
+        uint64_t max_ns = 0;
+        Keys prev;
+        for (uint8_t scan = 0; scan < SCANS; ++scan) {
+            kbd.resetScanStats();
+            const uint32_t reads_before = model.reads;
+            const auto start = std::chrono::steady_clock::now();
+            kbd.scan();
+            const auto end = std::chrono::steady_clock::now();
+            const uint64_t ns =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    end - start).count();
+
+            const auto stats = kbd.getScanStats();
+            const uint32_t reads = model.reads - reads_before;
+            const uint32_t resolve_reads = stats.maxResolveTicks / read_ticks;
+            const uint32_t late_reads = resolve_reads > budget_reads ?
+                resolve_reads - budget_reads : 0;
+            if (reads > max_reads) {
+                max_reads = reads;
+            }
+            if (resolve_reads > max_resolve_reads) {
+                max_resolve_reads = resolve_reads;
+            }
+            if (late_reads > max_late_reads) {
+                max_late_reads = late_reads;
+            }
+            if (ns > max_ns) {
+                max_ns = ns;
+            }
+            deferrals += stats.resolveDeferrals;
+
+            const Keys reported = kbd.reported();
+            if ((reported & ~pattern.keys & ~prev).any()) {
+                printf("FAIL: %s, scan %d reported a ghost\n",
+                       pattern.name, scan);
+                ok = false;
+            }
+            prev = reported;
+        }
+
+        printf("  %-20s %3u reads/scan, %3u resolving (%2u late), "
+               "%2u deferrals, %6.1f us on the host\n",
+               pattern.name, max_reads, max_resolve_reads, max_late_reads,
+               deferrals, max_ns / 1000.0);
+        if (max_late_reads > pattern.unitReads) {
+            printf("FAIL: %s made %u reads after the budget ran out\n",
+                   pattern.name, max_late_reads);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*
+ * Hold a chord that needs ghosting resolution while tapping other keys, and
+ * report how often the resolution memo is reused.
+ *
+ * With no diodes the chord is resolved without reverse scans, so every scan
+ * that sees the same raw matrix as the one before should reuse the memo,
+ * however long releases are debounced.  Presses deferred by debouncing
+ * still miss until they are reported.
+ */
+static bool checkMemo(uint8_t pressScans, uint8_t releaseScans,
+                      bool expectAll) {
+    typedef ModelKeyboard<NC, NR, DiodeList<>> Kbd;
+
+    Model model;
+    Kbd kbd(&model);
+    kbd.setDebounce(Kbd::DEBOUNCE_NORMAL, pressScans, releaseScans);
+    Keys chord;
+    press(&chord, 0, 0);
+    press(&chord, 1, 0);
+    press(&chord, 0, 1);
+    press(&chord, 2, 4);
+
+    srand(3);
+    kbd.resetScanStats();
+    uint32_t scans = 0;
+    uint32_t repeats = 0;
+    Keys prev;
+    for (uint16_t tap = 0; tap < 200; ++tap) {
+        Keys keys = chord;
+        press(&keys, 3 + (rand() % (NC - 3)), 5 + (rand() % (NR - 5)));
+        for (uint8_t n = 0; n < 16; ++n) {
+            const Keys &down = n < 10 ? chord : keys;
+            model.setPressed(down);
+            kbd.scan();
+            ++scans;
+            if (down == prev) {
+                ++repeats;
+            }
+            prev = down;
+        }
+    }
+
+    const auto stats = kbd.getScanStats();
+    printf("Memo, debounce %u/%u: %u scans, %u repeated the previous one, "
+           "%u hits, %u misses\n",
+           pressScans, releaseScans, scans, repeats,
+           stats.resolveHits, stats.resolveMisses);
+    if (expectAll && stats.resolveHits != repeats) {
+        printf("FAIL: a repeated scan missed the memo\n");
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool ok = true;
+    // A line read that takes about 6us, and a slow one that takes 24us.
+    for (uint16_t read_ticks : {12, 48}) {
+        ok &= runPatterns<DiodeList<>>("No", read_ticks);
+        ok &= runPatterns<CheckerDiodes>("Checkerboard", read_ticks);
+    }
+    // No debouncing, the default thresholds, and deferred presses.
+    ok &= checkMemo(1, 1, true);
+    ok &= checkMemo(1, 2, true);
+    ok &= checkMemo(3, 4, false);
+    return ok ? 0 : 1;
+}
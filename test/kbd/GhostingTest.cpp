@@ -0,0 +1,311 @@
+// Copyright (c) 2013, Adam Simpkins
+//
+// Check KbdDiodeImpl's ghosting resolution against an electrical model of
+// the matrix.
+//
+// For every diode layout of a 3x3 matrix, up to the order of its rows and
+// columns, and for a selection of 4x4 layouts, every set of keys is pressed
+// from an empty state and scanned.
+// Every key reported must really be down.  The keys that any scan could
+// prove are down are also worked out from the model, by comparing what the
+// scans would see for every other set of keys.  Resolution doesn't find all
+// of them: it blocks components with too many keys, and some single
+// rectangles.  The number it does find is checked against a floor, so that
+// resolution can get better but not worse.
+//
+// Finally random walks through the 4x4 states, with several debounce
+// settings and with keys bouncing, check that a scan never reports a key
+// that is neither down nor reported by the previous scan.
+#include "MatrixModel.h"
+
+#include <avrpp/log.h>
+#include <avrpp/usb_hid_keyboard.h>
+F_LOG_LEVEL(0);
+// Test the component resolver, not simple blocking.
+#define COMPLEX_GHOSTING_RESOLUTION 1
+#include <avrpp/kbd/KbdDiodeImpl-defs.h>
+
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * A diode list for KbdDiodeImpl, given as a bitmask of MatrixModel key
+ * numbers.
+ */
+template<uint8_t NC, uint32_t MASK>
+struct MaskDiodes {
+    static constexpr uint8_t mapByte(uint8_t n, uint8_t stride,
+                                     uint8_t k = 0) {
+        return k >= 32 ? 0 :
+            ((((MASK >> k) & 1) &&
+              ((((k % NC) * stride) + (k / NC)) >> 3) == n) ?
+             static_cast<uint8_t>(1 << ((k / NC) & 0x7)) : 0) |
+            mapByte(n, stride, k + 1);
+    }
+    template<uint8_t C, uint8_t R>
+    static constexpr bool fits() {
+        return (C * R >= 32) || (MASK >> (C * R)) == 0;
+    }
+};
+
+struct Totals {
+    uint32_t layouts{0};
+    uint32_t states{0};
+    uint32_t failures{0};
+    // Keys the scans could prove are down, and how many of them were
+    // reported.
+    uint32_t provable{0};
+    uint32_t reported{0};
+};
+
+template<typename Keys>
+static void printKeys(const char *label, const Keys &keys) {
+    printf("  %s:", label);
+    for (size_t k = 0; k < keys.size(); ++k) {
+        if (keys[k]) {
+            printf(" %zu", k);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * For each set of keys, the keys that are down in every set that the scans
+ * can't tell apart from it.
+ */
+template<typename Model>
+static std::vector<typename Model::Keys> provableKeys(const Model &model) {
+    typedef typename Model::Keys Keys;
+    const uint32_t num_states = 1UL << model.pressed().size();
+
+    std::vector<typename Model::Observations> seen(num_states);
+    for (uint32_t state = 0; state < num_states; ++state) {
+        seen[state] = model.observe(Keys(state));
+    }
+    // Group the states by what the scans see.
+    std::map<std::vector<uint32_t>, Keys> common;
+    std::vector<std::vector<uint32_t>> keys_of(num_states);
+    for (uint32_t state = 0; state < num_states; ++state) {
+        const auto &obs = seen[state];
+        std::vector<uint32_t> key(obs.fromCol,
+                                  obs.fromCol + sizeof(obs.fromCol) / 4);
+        key.insert(key.end(), obs.fromRow,
+                   obs.fromRow + sizeof(obs.fromRow) / 4);
+        auto it = common.find(key);
+        if (it == common.end()) {
+            common[key] = Keys(state);
+        } else {
+            it->second &= Keys(state);
+        }
+        keys_of[state] = key;
+    }
+
+    std::vector<Keys> provable(num_states);
+    for (uint32_t state = 0; state < num_states; ++state) {
+        provable[state] = common[keys_of[state]];
+    }
+    return provable;
+}
+
+template<uint8_t NC, uint8_t NR, uint32_t MASK>
+static void checkLayout(Totals *totals) {
+    typedef ModelKeyboard<NC, NR, MaskDiodes<NC, MASK>> Kbd;
+    typedef typename Kbd::Model Model;
+    typedef typename Model::Keys Keys;
+
+    Model model;
+    {
+        // Constructing a keyboard sets up the model's diodes.
+        Kbd kbd(&model);
+    }
+    const auto provable = provableKeys(model);
+
+    ++totals->layouts;
+    const uint32_t num_states = 1UL << (NC * NR);
+    for (uint32_t state = 0; state < num_states; ++state) {
+        const Keys down(state);
+        model.setPressed(down);
+        Kbd kbd(&model);
+        // A second scan sees the first one's result as the previous state.
+        for (uint8_t scan = 0; scan < 2; ++scan) {
+            kbd.scan();
+            const Keys reported = kbd.reported();
+            if ((reported & ~down).any()) {
+                printf("FAIL: %dx%d diodes 0x%x, scan %d reported a ghost\n",
+                       NC, NR, MASK, scan);
+                printKeys("down", down);
+                printKeys("reported", reported);
+                ++totals->failures;
+                break;
+            }
+        }
+        ++totals->states;
+        totals->provable += provable[state].count();
+        totals->reported += (kbd.reported() & provable[state]).count();
+    }
+}
+
+/*
+ * Scan once, and check that every key reported is either down or was
+ * reported by the previous scan.
+ */
+template<typename Kbd>
+static void scanStep(Kbd *kbd, const typename Kbd::Keys &down,
+                     typename Kbd::Keys *prev, const char *layout,
+                     uint32_t step, Totals *totals) {
+    kbd->scan();
+    const typename Kbd::Keys reported = kbd->reported();
+    if ((reported & ~down & ~*prev).any()) {
+        printf("FAIL: %s, step %u reported a ghost\n", layout, step);
+        printKeys("down", down);
+        printKeys("previous", *prev);
+        printKeys("reported", reported);
+        ++totals->failures;
+    }
+    *prev = reported;
+}
+
+/*
+ * Walk randomly through the key states, with the specified debounce
+ * thresholds.  When bounce is set, a random key also flips for a single
+ * scan before some steps, as a key does while its contacts settle.
+ *
+ * Debouncing runs after ghosting resolution, on the resolved keys, so it
+ * must not let a ghost through either.
+ */
+template<uint8_t NC, uint8_t NR, uint32_t MASK>
+static void walkLayout(uint32_t steps, uint8_t pressScans,
+                       uint8_t releaseScans, bool bounce, Totals *totals) {
+    typedef ModelKeyboard<NC, NR, MaskDiodes<NC, MASK>> Kbd;
+    typedef typename Kbd::Model Model;
+    typedef typename Model::Keys Keys;
+
+    char layout[64];
+    snprintf(layout, sizeof(layout), "%dx%d diodes 0x%x, debounce %d/%d%s",
+             NC, NR, MASK, pressScans, releaseScans,
+             bounce ? " with bounce" : "");
+
+    Model model;
+    Kbd kbd(&model);
+    kbd.setDebounce(Kbd::DEBOUNCE_NORMAL, pressScans, releaseScans);
+    Keys down;
+    Keys prev;
+    srand(MASK);
+    for (uint32_t step = 0; step < steps; ++step) {
+        // Mostly toggle one key at a time, with an occasional jump.
+        if (rand() % 8 == 0) {
+            down = Keys(rand() & ((1UL << (NC * NR)) - 1));
+        } else {
+            down.flip(rand() % (NC * NR));
+        }
+        if (bounce && rand() % 4 == 0) {
+            Keys bounced = down;
+            bounced.flip(rand() % (NC * NR));
+            model.setPressed(bounced);
+            scanStep(&kbd, bounced, &prev, layout, step, totals);
+        }
+        model.setPressed(down);
+        scanStep(&kbd, down, &prev, layout, step, totals);
+    }
+}
+
+/*
+ * The orderings of 3 lines, and a 3x3 diode layout with its rows and columns
+ * reordered by two of them.
+ */
+static constexpr uint8_t ORDERS[6][3] = {
+    {0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0},
+};
+static constexpr uint32_t reorder3x3(uint32_t mask, uint8_t rows,
+                                     uint8_t cols, uint8_t k = 0) {
+    return k >= 9 ? 0 :
+        (((mask >> k) & 1) <<
+         ((ORDERS[rows][k / 3] * 3) + ORDERS[cols][k % 3])) |
+        reorder3x3(mask, rows, cols, k + 1);
+}
+/*
+ * Whether mask is the smallest of the layouts it can be reordered into.
+ */
+static constexpr bool smallest3x3(uint32_t mask, uint8_t order = 0) {
+    return order >= 36 ? true :
+        reorder3x3(mask, order / 6, order % 6) >= mask &&
+        smallest3x3(mask, order + 1);
+}
+
+/*
+ * Every 3x3 diode layout from MASK up, skipping those that only differ from
+ * an earlier one in the order of the rows and columns.
+ */
+template<uint32_t MASK, bool CHECK = smallest3x3(MASK)>
+struct AllLayouts3x3 {
+    static void check(Totals *totals) {
+        if (CHECK) {
+            checkLayout<3, 3, MASK>(totals);
+        }
+        AllLayouts3x3<MASK + 1>::check(totals);
+    }
+};
+template<uint32_t MASK>
+struct AllLayouts3x3<MASK, false> {
+    static void check(Totals *totals) {
+        AllLayouts3x3<MASK + 1>::check(totals);
+    }
+};
+template<>
+struct AllLayouts3x3<(1 << 9), false> {
+    static void check(Totals *) {}
+};
+
+static void printTotals(const char *name, const Totals &totals) {
+    printf("%s: %u layouts, %u key states, %u failures; "
+           "%u of %u provable keys reported\n",
+           name, totals.layouts, totals.states, totals.failures,
+           totals.reported, totals.provable);
+}
+
+enum : uint32_t {
+    // The provable keys reported when this test was written.
+    MIN_REPORTED_3X3 = 48474,
+    MIN_REPORTED_4X4 = 770326,
+};
+
+int main() {
+    Totals small;
+    AllLayouts3x3<0>::check(&small);
+    printTotals("3x3", small);
+
+    // No diodes, all diodes, a diagonal, a checkerboard, a column and a row
+    // of diodes, and a couple of irregular layouts.
+    Totals large;
+    checkLayout<4, 4, 0x0000>(&large);
+    checkLayout<4, 4, 0xffff>(&large);
+    checkLayout<4, 4, 0x8421>(&large);
+    checkLayout<4, 4, 0xa5a5>(&large);
+    checkLayout<4, 4, 0x1111>(&large);
+    checkLayout<4, 4, 0x000f>(&large);
+    checkLayout<4, 4, 0x4c21>(&large);
+    checkLayout<4, 4, 0x7bde>(&large);
+    printTotals("4x4", large);
+
+    // The default debounce thresholds, no debouncing at all, and presses
+    // deferred as well as releases, with and without bouncing keys.
+    Totals walk;
+    walkLayout<4, 4, 0x0000>(100000, 1, 2, false, &walk);
+    walkLayout<4, 4, 0x8421>(100000, 1, 2, false, &walk);
+    walkLayout<4, 4, 0x4c21>(100000, 1, 2, false, &walk);
+    walkLayout<4, 4, 0x4c21>(100000, 1, 1, true, &walk);
+    walkLayout<4, 4, 0x0000>(100000, 1, 2, true, &walk);
+    walkLayout<4, 4, 0x8421>(100000, 3, 4, true, &walk);
+    walkLayout<4, 4, 0x4c21>(100000, 3, 4, true, &walk);
+    printf("4x4 random walk: %u failures\n", walk.failures);
+
+    bool ok = !small.failures && !large.failures && !walk.failures;
+    if (small.reported < MIN_REPORTED_3X3 ||
+        large.reported < MIN_REPORTED_4X4) {
+        printf("FAIL: fewer provable keys reported than before\n");
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+// Copyright (c) 2013, Adam Simpkins
+//
+// Host replacements for the hardware-facing parts of libkbd that the tests
+// link against, in place of ScanScheduler.cpp and Keyboard.cpp.
+#include "MatrixModel.h"
+
+#include <stdlib.h>
+
+volatile uint8_t SREG;
+uint16_t g_testTicks;
+
+ScanScheduler ScanScheduler::s_scheduler;
+
+void
+ScanScheduler::setSlowClock(bool slow) {
+    _slowClock = slow;
+}
+
+void
+ScanScheduler::recordSample() {
+}
+
+uint16_t
+ScanScheduler::elapsedInIteration() {
+    return g_testTicks;
+}
+
+uint16_t
+ScanScheduler::timerCount() const {
+    return g_testTicks;
+}
+
+void
+Keyboard::loop(Callback *) {
+    // The tests call scanKeys() directly.
+    abort();
+}
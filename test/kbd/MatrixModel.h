@@ -0,0 +1,253 @@
+// Copyright (c) 2013, Adam Simpkins
+#pragma once
+
+#include <avrpp/kbd/KbdDiodeImpl.h>
+
+#include <bitset>
+
+/*
+ * The host's stand-in for the ScanScheduler clock, in timer counts.
+ *
+ * ScanScheduler::elapsedInIteration() and timerCount() return this on the
+ * host.  Tests reset it at the start of each scan, and MatrixModel advances
+ * it on every line read.
+ */
+extern uint16_t g_testTicks;
+
+/*
+ * An electrical model of a key matrix.
+ *
+ * Signalling a line pulls it low, and all other lines are pulled up.  A
+ * pressed key connects its column and row.  Through a key with a diode the
+ * column can pull the row low, but not the other way round; a key without
+ * one conducts both ways.  A line reads active if a chain of pressed keys
+ * connects it to a signalled line.
+ *
+ * Keys are numbered in row-major order, as in the KbdDiodeImpl key tables.
+ */
+template<uint8_t NC, uint8_t NR>
+class MatrixModel {
+  public:
+    typedef std::bitset<NC * NR> Keys;
+
+    static uint16_t keyIndex(uint8_t col, uint8_t row) {
+        return (static_cast<uint16_t>(row) * NC) + col;
+    }
+
+    void setDiode(uint8_t col, uint8_t row, bool diode) {
+        _diodes[keyIndex(col, row)] = diode;
+    }
+    bool hasDiode(uint8_t col, uint8_t row) const {
+        return _diodes[keyIndex(col, row)];
+    }
+
+    void setPressed(const Keys &keys) {
+        _pressed = keys;
+    }
+    const Keys &pressed() const {
+        return _pressed;
+    }
+
+    void signalCol(uint8_t col) {
+        _signalled = colBit(col);
+    }
+    void signalRow(uint8_t row) {
+        _signalled = rowBit(row);
+    }
+    void signalAllCols() {
+        _signalled = colBit(NC) - 1;
+    }
+    void release() {
+        _signalled = 0;
+    }
+
+    /*
+     * Read the lines: one bit per line, set if it is active.  Use colBit()
+     * and rowBit() to pick out the lines.
+     */
+    uint32_t readLines() {
+        ++reads;
+        g_testTicks += readTicks;
+        return reach(_pressed, _signalled);
+    }
+    static uint32_t colBit(uint8_t col) {
+        return static_cast<uint32_t>(1) << col;
+    }
+    static uint32_t rowBit(uint8_t row) {
+        return static_cast<uint32_t>(1) << (NC + row);
+    }
+
+    /*
+     * Everything a scan could observe for the current keys: the lines
+     * active while each column is signalled, and while each row is.
+     * Two key states with the same observations can't be told apart by
+     * any scan.
+     */
+    struct Observations {
+        uint32_t fromCol[NC];
+        uint32_t fromRow[NR];
+
+        bool operator==(const Observations &other) const {
+            for (uint8_t col = 0; col < NC; ++col) {
+                if (fromCol[col] != other.fromCol[col]) {
+                    return false;
+                }
+            }
+            for (uint8_t row = 0; row < NR; ++row) {
+                if (fromRow[row] != other.fromRow[row]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+    Observations observe(const Keys &keys) const {
+        Observations obs;
+        for (uint8_t col = 0; col < NC; ++col) {
+            obs.fromCol[col] = reach(keys, colBit(col));
+        }
+        for (uint8_t row = 0; row < NR; ++row) {
+            obs.fromRow[row] = reach(keys, rowBit(row));
+        }
+        return obs;
+    }
+
+    // The number of line reads so far, and the clock ticks each one costs.
+    uint32_t reads{0};
+    uint16_t readTicks{0};
+
+  private:
+    static_assert(NC + NR < 32, "too many lines for the model");
+
+    uint32_t reach(const Keys &keys, uint32_t low) const {
+        uint32_t prev = 0;
+        while (low != prev) {
+            prev = low;
+            for (uint8_t row = 0; row < NR; ++row) {
+                for (uint8_t col = 0; col < NC; ++col) {
+                    const uint16_t k = keyIndex(col, row);
+                    if (!keys[k]) {
+                        continue;
+                    }
+                    if (low & colBit(col)) {
+                        low |= rowBit(row);
+                    } else if (!_diodes[k] && (low & rowBit(row))) {
+                        low |= colBit(col);
+                    }
+                }
+            }
+        }
+        return low;
+    }
+
+    Keys _diodes;
+    Keys _pressed;
+    uint32_t _signalled{0};
+};
+
+/*
+ * A KbdDiodeImpl scanning a MatrixModel, or another model with the same
+ * interface.
+ *
+ * The model's diodes are set from DiodesT.  Each key reports its key number
+ * plus 1 as its key code, so reported() can map getState() back to keys.
+ * Idle mode is disabled.
+ */
+template<uint8_t NC, uint8_t NR, typename DiodesT,
+         typename ModelT = MatrixModel<NC, NR>>
+class ModelKeyboard :
+    public KbdDiodeImpl<NC, NR, ModelKeyboard<NC, NR, DiodesT, ModelT>> {
+  public:
+    typedef KbdDiodeImpl<NC, NR, ModelKeyboard> Base;
+    typedef typename Base::RowMap RowMap;
+    typedef typename Base::ColMap ColMap;
+    typedef ModelT Model;
+    typedef typename Model::Keys Keys;
+    typedef DiodesT Diodes;
+
+    static_assert(NC * NR < 0xff, "key codes don't fit in a byte");
+
+    explicit ModelKeyboard(Model *model) : _model(model) {
+        for (uint8_t row = 0; row < NR; ++row) {
+            for (uint8_t col = 0; col < NC; ++col) {
+                const uint16_t k = Model::keyIndex(col, row);
+                _codes[k] = k + 1;
+                _modifiers[k] = 0;
+                const uint16_t idx = (col * Base::ROW_STRIDE) + row;
+                model->setDiode(col, row,
+                                DiodesT::mapByte(idx >> 3, Base::ROW_STRIDE) &
+                                (1 << (idx & 0x7)));
+            }
+        }
+        this->_keyTable.reset(_codes);
+        this->_modifierTable.reset(_modifiers);
+        this->setIdleHoldoff(0);
+    }
+
+    /*
+     * Scan the matrix, as KeyboardScanTask would at the start of a scan
+     * period.
+     */
+    bool scan() {
+        g_testTicks = 0;
+        return this->scanKeys();
+    }
+
+    /*
+     * The keys reported by getState().
+     *
+     * getState() only lists so many keys, and the count it returns includes
+     * the rest.  When numReported is given it is set to that count, and it
+     * is more than the keys returned if some weren't listed.
+     */
+    Keys reported(uint16_t *numReported = nullptr) const {
+        uint8_t modifiers;
+        uint8_t codes[NC * NR] = {};
+        uint8_t len = NC * NR;
+        this->getState(&modifiers, codes, &len);
+        Keys keys;
+        for (uint8_t n = 0; n < len && n < NC * NR; ++n) {
+            // Codes start at 1, so unlisted keys are still 0.
+            if (codes[n] != 0) {
+                keys[codes[n] - 1] = true;
+            }
+        }
+        if (numReported) {
+            *numReported = len;
+        }
+        return keys;
+    }
+
+    virtual void prepare() override {}
+
+    // Methods invoked by KbdDiodeImpl
+    void prepareColScan(uint8_t col) {
+        _model->signalCol(col);
+    }
+    void prepareRowScan(uint8_t row) {
+        _model->signalRow(row);
+    }
+    void finishRowScan() {
+        _model->release();
+    }
+    void readRows(RowMap *rows) {
+        const uint32_t lines = _model->readLines();
+        for (uint8_t row = 0; row < NR; ++row) {
+            rows->set(row, lines & Model::rowBit(row));
+        }
+    }
+    void readCols(ColMap *cols) {
+        const uint32_t lines = _model->readLines();
+        for (uint8_t col = 0; col < NC; ++col) {
+            cols->set(col, lines & Model::colBit(col));
+        }
+    }
+    void prepareIdleScan() {
+        _model->signalAllCols();
+    }
+
+  private:
+    Model *_model;
+    uint8_t _codes[NC * NR];
+    uint8_t _modifiers[NC * NR];
+};